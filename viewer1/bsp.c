@@ -6,11 +6,82 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BSP_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#ifdef _MSC_VER
+#define PRINTF_FORMAT(fmt, args)
+#else
+#define PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#endif
+// Heap allocations made on this thread, for -profile. Defined ahead of buf.h so growing a buf is
+// counted too. parallel_for adds what its workers allocated to the thread that called it.
+typedef struct {
+  uint64_t count, bytes;
+} AllocCounter;
+#ifdef _MSC_VER
+static __declspec(thread) AllocCounter thread_allocs;
+#else
+static __thread AllocCounter thread_allocs;
+#endif
+// Only the tool counts, and only once -profile turns counting on. The library leaves malloc alone and
+// thread_allocs stays zero.
+#ifndef BSP_LIBRARY
+static bool count_allocations;
+static void *counted_malloc(size_t size) {
+  if (count_allocations) {
+    thread_allocs.count++;
+    thread_allocs.bytes += size;
+  }
+  return malloc(size);
+}
+static void *counted_calloc(size_t count, size_t size) {
+  if (count_allocations) {
+    thread_allocs.count++;
+    thread_allocs.bytes += count * size;
+  }
+  return calloc(count, size);
+}
+static void *counted_realloc(void *p, size_t size) {
+  if (count_allocations) {
+    thread_allocs.count++;
+    thread_allocs.bytes += size;
+  }
+  return realloc(p, size);
+}
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+#define realloc(p, size) counted_realloc(p, size)
+#endif
 #include <growable-buf/buf.h>
 #include <linmath.h/linmath.h>
+#include "bsp.h"
 typedef float f32;
 typedef double f64;
 typedef uint8_t u8;
@@ -32,49 +103,7 @@ typedef struct lump_s {
   u32 fileofs;
 } lump_t;
 #pragma pack(pop)
-enum LumpType {
-  LUMP_MATERIALS = 0,
-  LUMP_LIGHTBYTES = 1,
-  LUMP_LIGHTGRIDENTRIES = 2,
-  LUMP_LIGHTGRIDCOLORS = 3,
-  LUMP_PLANES = 4,
-  LUMP_BRUSHSIDES = 5,
-  LUMP_BRUSHES = 6,
-  LUMP_TRIANGLES = 7,
-  LUMP_DRAWVERTS = 8,
-  LUMP_DRAWINDICES = 9,
-  LUMP_CULLGROUPS = 10,
-  LUMP_CULLGROUPINDICES = 11,
-  LUMP_OBSOLETE_1 = 12,
-  LUMP_OBSOLETE_2 = 13,
-  LUMP_OBSOLETE_3 = 14,
-  LUMP_OBSOLETE_4 = 15,
-  LUMP_OBSOLETE_5 = 16,
-  LUMP_PORTALVERTS = 17,
-  LUMP_OCCLUDERS = 18,
-  LUMP_OCCLUDERPLANES = 19,
-  LUMP_OCCLUDEREDGES = 20,
-  LUMP_OCCLUDERINDICES = 21,
-  LUMP_AABBTREES = 22,
-  LUMP_CELLS = 23,
-  LUMP_PORTALS = 24,
-  LUMP_NODES = 25,
-  LUMP_LEAFS = 26,
-  LUMP_LEAFBRUSHES = 27,
-  LUMP_LEAFSURFACES = 28,
-  LUMP_COLLISIONVERTS = 29,
-  LUMP_COLLISIONEDGES = 30,
-  LUMP_COLLISIONTRIS = 31,
-  LUMP_COLLISIONBORDERS = 32,
-  LUMP_COLLISIONPARTITIONS = 33,
-  LUMP_COLLISIONAABBS = 34,
-  LUMP_MODELS = 35,
-  LUMP_VISIBILITY = 36,
-  LUMP_ENTITIES = 37,
-  LUMP_PATHCONNECTIONS = 38,
-  LUMP_MAX = 39
-};
-const char *lumpnames[] = {
+static const char *lumpnames[] = {
   [LUMP_MATERIALS] = "materials",
   [LUMP_LIGHTBYTES] = "lightmaps",
   [LUMP_LIGHTGRIDENTRIES] = "light grid hash",
@@ -280,7 +309,7 @@ typedef struct {
   s32 childCount;
 } DiskGfxAabbTree;
 #pragma pack(pop)
-const size_t lumpsizes[] = {
+static const size_t lumpsizes[] = {
   [LUMP_MATERIALS] = sizeof(dmaterial_t),
   [LUMP_LIGHTBYTES] = sizeof(DiskGfxLightmap),
   [LUMP_LIGHTGRIDENTRIES] = 0,
@@ -324,7 +353,29 @@ const size_t lumpsizes[] = {
 typedef struct {
   void *data;
   size_t count;
+  bool mapped; // data points into the file mapping and must not be freed
+  bool loaded;
 } LumpData;
+#define LUMP_BIT(type) (1ull << (type))
+// Lumps each operation reads. lump() asserts that whatever it's asked for was declared here.
+static const u64 brush_lumps = LUMP_BIT(LUMP_MATERIALS) | LUMP_BIT(LUMP_PLANES) | LUMP_BIT(LUMP_BRUSHSIDES)
+                      | LUMP_BIT(LUMP_BRUSHES);
+static const u64 export_lumps = LUMP_BIT(LUMP_ENTITIES) | LUMP_BIT(LUMP_MODELS) | brush_lumps;
+static const u64 patch_lumps = LUMP_BIT(LUMP_MATERIALS) | LUMP_BIT(LUMP_COLLISIONVERTS) | LUMP_BIT(LUMP_COLLISIONTRIS)
+                      | LUMP_BIT(LUMP_COLLISIONPARTITIONS) | LUMP_BIT(LUMP_COLLISIONAABBS);
+#ifndef BSP_LIBRARY
+static const u64 info_lumps = LUMP_BIT(LUMP_ENTITIES);
+static const u64 trace_lumps = LUMP_BIT(LUMP_MATERIALS) | LUMP_BIT(LUMP_COLLISIONVERTS) | LUMP_BIT(LUMP_COLLISIONTRIS)
+                      | LUMP_BIT(LUMP_COLLISIONPARTITIONS) | LUMP_BIT(LUMP_COLLISIONAABBS);
+static const u64 leaf_lumps = LUMP_BIT(LUMP_PLANES) | LUMP_BIT(LUMP_NODES) | LUMP_BIT(LUMP_LEAFS);
+static const u64 pvs_lumps = LUMP_BIT(LUMP_VISIBILITY) | LUMP_BIT(LUMP_LEAFS);
+static const u64 vis_lumps = LUMP_BIT(LUMP_PLANES) | LUMP_BIT(LUMP_NODES) | LUMP_BIT(LUMP_LEAFS) | LUMP_BIT(LUMP_CELLS)
+                    | LUMP_BIT(LUMP_PORTALS) | LUMP_BIT(LUMP_PORTALVERTS) | LUMP_BIT(LUMP_CULLGROUPS);
+static const u64 lightmap_lumps = LUMP_BIT(LUMP_LIGHTBYTES);
+static const u64 mesh_lumps = LUMP_BIT(LUMP_MATERIALS) | LUMP_BIT(LUMP_TRIANGLES) | LUMP_BIT(LUMP_DRAWVERTS)
+                     | LUMP_BIT(LUMP_DRAWINDICES);
+static const u64 portal_lumps = LUMP_BIT(LUMP_PLANES) | LUMP_BIT(LUMP_PORTALS) | LUMP_BIT(LUMP_PORTALVERTS);
+#endif
 enum {
   PARSE_NODE_DEPTH_ROOT,
   PARSE_NODE_DEPTH_ENTITY,
@@ -334,10 +385,77 @@ typedef struct KeyValuePair_s {
   // struct KeyValuePair_s *next;
   char *key;
   char *value;
+  s32 key_id;
 } KeyValuePair;
 typedef struct Entity_s {
   KeyValuePair *keyvalues;
 } Entity;
+typedef struct {
+  vec3 normal;
+  float distance;
+  s32 material; // index into LUMP_MATERIALS
+} MapPlane;
+// The same planes as structure-of-arrays for the half-space kernels. count is padded to a multiple
+// of BRUSH_PLANE_LANES with planes every point passes (zero normal, zero distance).
+#define BRUSH_PLANE_LANES 8
+typedef struct {
+  float *nx, *ny, *nz, *d;
+  size_t count;
+} BrushPlanes;
+typedef struct {
+  vec3 mins, maxs;
+  MapPlane *planes;
+  size_t plane_count;
+  BrushPlanes soa;
+} MapBrush;
+typedef struct {
+  vec3 *points;
+  uint32_t *indices;
+  vec2 *uvs;
+  size_t point_count;
+  size_t index_count;
+  MapPlane *plane;
+} Polygon;
+// Bump allocator. Nothing is freed on its own, the blocks all go at once in arena_free. Like malloc,
+// arena_alloc returns NULL when it runs out of memory.
+typedef struct ArenaBlock_s {
+  struct ArenaBlock_s *next;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+typedef struct {
+  ArenaBlock *head;
+  size_t block_size; // 0 = ARENA_BLOCK_SIZE
+} Arena;
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+static void *arena_alloc(Arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  ArenaBlock *b = a->head;
+  if (!b || b->used + size > b->size) {
+    size_t block_size = a->block_size ? a->block_size : ARENA_BLOCK_SIZE;
+    if (block_size < size)
+      block_size = size;
+    b = malloc(ARENA_HEADER + block_size);
+    if (!b)
+      return NULL;
+    b->next = a->head;
+    b->size = block_size;
+    b->used = 0;
+    a->head = b;
+  }
+  void *p = (u8*)b + ARENA_HEADER + b->used;
+  b->used += size;
+  return p;
+}
+static void arena_free(Arena *a) {
+  while (a->head) {
+    ArenaBlock *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+}
 enum {
   STREAM_SEEK_BEG,
   STREAM_SEEK_CUR,
@@ -356,80 +474,280 @@ typedef struct {
     char path[256];
   FILE *fp;
 } StreamFile;
-typedef struct {
-  size_t offset, length;
-  unsigned char *buffer;
-} StreamBuffer;
-LumpData lumpdata[LUMP_MAX];
-Entity *parse_entities() {
-  Stream s = {0};
-  StreamBuffer sb = {0};
-  init_stream_from_buffer(&s, &sb, lumpdata[LUMP_ENTITIES].data, lumpdata[LUMP_ENTITIES].count);
-  char line[2048];
+typedef struct Bsp_s Bsp;
+static LumpData *lump(Bsp *bsp, int type);
+static void bsp_error(Bsp *bsp, const char *fmt, ...) PRINTF_FORMAT(2, 3);
+static void bsp_set_entity_strings(Bsp *bsp, char *strings);
+// One pass straight over the lump. Every key and value is copied once into a single arena the size
+// of the lump (each string gives up its two quotes for a terminator, so it always fits), which means
+// no per-string allocations and no length limit on values.
+static Entity *parse_entities(Bsp *bsp) {
+  LumpData *entdata = lump(bsp, LUMP_ENTITIES);
+  const char *p = entdata->data;
+  const char *end = p ? memchr(p, 0, entdata->count) : NULL;
+  if (!end)
+    end = p + entdata->count;
+  char *arena = malloc(entdata->count + 1);
+  char *dst = arena;
+  bsp_set_entity_strings(bsp, arena);
   unsigned int node_depth = PARSE_NODE_DEPTH_ROOT;
   Entity *entities = NULL;
   Entity *entity   = NULL;
-  while(!stream_read_line(&s, line, sizeof(line))) {
-    size_t offsz = 0;
-    while(line[offsz] && line[offsz] == ' ')
-      offsz++;
-    switch(line[offsz]) {
+  while (p < end) {
+    switch (*p) {
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+        ++p;
+      break;
       case '{':
         ++node_depth;
         assert(node_depth == PARSE_NODE_DEPTH_ENTITY);
         buf_push(entities, (Entity) { 0 });
         entity = &entities[buf_size(entities) - 1];
+        ++p;
       break;
       case '}':
         assert(node_depth != PARSE_NODE_DEPTH_ROOT);
         --node_depth;
+        ++p;
       break;
       case '(':
       {
-                fprintf(stderr, "No support for parsing brushes.\n");
-                exit(1);
+        bsp_error(bsp, "No support for parsing brushes.");
       } break;
       case '"':
       {
-        if(node_depth == PARSE_NODE_DEPTH_ENTITY)
+        const char *key = p + 1;
+        const char *key_end = memchr(key, '"', end - key);
+        if (!key_end)
+          return entities;
+        p = key_end + 1;
+        while (p < end && (*p == ' ' || *p == '\t'))
+          ++p;
+        if (p == end || *p != '"')
+          break;
+        const char *value = p + 1;
+        const char *value_end = memchr(value, '"', end - value);
+        if (!value_end)
+          return entities;
+        p = value_end + 1;
+        if (node_depth == PARSE_NODE_DEPTH_ENTITY)
         {
-                    char key[512];
-                    char value[512];
-          sscanf(line, "\"%511[^\"]\" \"%511[^\"]\"", key, value);
           assert(entity);
-          buf_push(entity->keyvalues, (KeyValuePair) { 0 });
-          KeyValuePair *kvp = &entity->keyvalues[buf_size(entity->keyvalues) - 1];
-                    // Leaking memory, but fine for this particular instance.
-                    kvp->key = strdup(key);
-                    kvp->value = strdup(value);
+          KeyValuePair kvp;
+          kvp.key = dst;
+          memcpy(dst, key, key_end - key);
+          dst += key_end - key;
+          *dst++ = 0;
+          kvp.key_id = -1;
+          kvp.value = dst;
+          memcpy(dst, value, value_end - value);
+          dst += value_end - value;
+          *dst++ = 0;
+          buf_push(entity->keyvalues, kvp);
         }
       } break;
+      default:
+      {
+        const char *eol = memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+      } break;
     }
   }
   return entities;
 }
-size_t stream_read_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb) {
-  StreamFile *sd = (StreamFile *)stream->ctx;
-  return fread(ptr, size, nmemb, sd->fp);
+// Interned strings. Ids are dense and handed out in first-seen order. The strings aren't copied,
+// so they have to outlive the table.
+typedef struct {
+  const char **strings;
+  s32 *slots;
+  size_t mask;
+} StringTable;
+static u32 string_hash(const char *s) {
+  u32 h = 2166136261u;
+  for (; *s; ++s)
+    h = (h ^ (u8)*s) * 16777619u;
+  return h;
+}
+static s32 string_table_find(StringTable *t, const char *s) {
+  if (!t->slots)
+    return -1;
+  for (size_t i = string_hash(s) & t->mask;; i = (i + 1) & t->mask) {
+    s32 id = t->slots[i];
+    if (id == -1 || !strcmp(t->strings[id], s))
+      return id;
+  }
+}
+static void string_table_insert_slot(StringTable *t, s32 id) {
+  size_t i = string_hash(t->strings[id]) & t->mask;
+  while (t->slots[i] != -1)
+    i = (i + 1) & t->mask;
+  t->slots[i] = id;
+}
+static s32 string_table_intern(StringTable *t, const char *s) {
+  s32 id = string_table_find(t, s);
+  if (id != -1)
+    return id;
+  id = buf_size(t->strings);
+  buf_push(t->strings, s);
+  if (!t->slots || buf_size(t->strings) * 2 > t->mask + 1) {
+    size_t size = t->slots ? (t->mask + 1) * 2 : 64;
+    free(t->slots);
+    t->slots = malloc(size * sizeof(s32));
+    memset(t->slots, -1, size * sizeof(s32));
+    t->mask = size - 1;
+    for (s32 i = 0; i < id; ++i)
+      string_table_insert_slot(t, i);
+  }
+  string_table_insert_slot(t, id);
+  return id;
+}
+static void string_table_free(StringTable *t) {
+  buf_free(t->strings);
+  free(t->slots);
+  memset(t, 0, sizeof(*t));
+}
+// Every (entity, key id) pair of the map in one open-addressing table, so a key lookup doesn't
+// walk the entity's keyvalues. Entities are also bucketed by classname in file order, and the
+// classnames are sorted so a family like trigger_* is one range.
+typedef struct {
+  StringTable keys;
+  StringTable classnames;
+  s32 *classname_of;        // classname id of each entity, "" when it has none
+  s32 **classname_entities; // entity indices of each classname id
+  s32 *classname_order;     // classname ids in strcmp order
+  u64 *slots;               // (entity + 1) << 32 | key id, 0 when empty
+  const char **values;
+  size_t mask;
+} EntityIndex;
+static size_t entity_slot_hash(u64 slot) {
+  u64 h = slot * 0x9E3779B97F4A7C15ull;
+  return h ^ h >> 32;
+}
+static s32 entity_key_id(EntityIndex *ix, const char *key) {
+  return string_table_find(&ix->keys, key);
+}
+// Returns "" when the entity doesn't have the key, like the old linear scan did.
+static const char *entity_value(EntityIndex *ix, size_t entity, s32 key) {
+  if (key < 0 || !ix->slots)
+    return "";
+  u64 slot = (u64)(entity + 1) << 32 | (u32)key;
+  for (size_t i = entity_slot_hash(slot) & ix->mask;; i = (i + 1) & ix->mask) {
+    if (ix->slots[i] == slot)
+      return ix->values[i];
+    if (!ix->slots[i])
+      return "";
+  }
+}
+static int compare_string_refs(const void *a, const void *b) {
+  return strcmp(**(const char ***)a, **(const char ***)b);
+}
+static void entity_index_build(EntityIndex *ix, Entity *entities) {
+  size_t count = 0;
+  for (size_t i = 0; i < buf_size(entities); ++i)
+    count += buf_size(entities[i].keyvalues);
+  size_t size = 16;
+  while (size < count * 2)
+    size *= 2;
+  ix->slots = calloc(size, sizeof(u64));
+  ix->values = malloc(size * sizeof(const char *));
+  ix->mask = size - 1;
+  for (size_t i = 0; i < buf_size(entities); ++i) {
+    Entity *e = &entities[i];
+    for (size_t j = 0; j < buf_size(e->keyvalues); ++j) {
+      KeyValuePair *kvp = &e->keyvalues[j];
+      kvp->key_id = string_table_intern(&ix->keys, kvp->key);
+      u64 slot = (u64)(i + 1) << 32 | (u32)kvp->key_id;
+      size_t k = entity_slot_hash(slot) & ix->mask;
+      while (ix->slots[k] && ix->slots[k] != slot)
+        k = (k + 1) & ix->mask;
+      // A repeated key keeps its first value.
+      if (!ix->slots[k]) {
+        ix->slots[k] = slot;
+        ix->values[k] = kvp->value;
+      }
+    }
+  }
+  s32 classname_key = entity_key_id(ix, "classname");
+  ix->classname_of = malloc((buf_size(entities) + 1) * sizeof(s32));
+  for (size_t i = 0; i < buf_size(entities); ++i) {
+    s32 id = string_table_intern(&ix->classnames, entity_value(ix, i, classname_key));
+    if (id == (s32)buf_size(ix->classname_entities))
+      buf_push(ix->classname_entities, NULL);
+    buf_push(ix->classname_entities[id], (s32)i);
+    ix->classname_of[i] = id;
+  }
+  // Sorted through pointers into the table, which give back the ids.
+  const char **strings = ix->classnames.strings;
+  size_t classname_count = buf_size(strings);
+  const char ***sorted = malloc((classname_count + 1) * sizeof(const char **));
+  for (size_t i = 0; i < classname_count; ++i)
+    sorted[i] = &strings[i];
+  qsort(sorted, classname_count, sizeof(const char **), compare_string_refs);
+  ix->classname_order = malloc((classname_count + 1) * sizeof(s32));
+  for (size_t i = 0; i < classname_count; ++i)
+    ix->classname_order[i] = sorted[i] - strings;
+  free(sorted);
+}
+static void entity_index_free(EntityIndex *ix) {
+  for (size_t i = 0; i < buf_size(ix->classname_entities); ++i)
+    buf_free(ix->classname_entities[i]);
+  buf_free(ix->classname_entities);
+  string_table_free(&ix->keys);
+  string_table_free(&ix->classnames);
+  free(ix->classname_of);
+  free(ix->classname_order);
+  free(ix->slots);
+  free(ix->values);
+  memset(ix, 0, sizeof(*ix));
+}
+// Ids of the classnames starting with prefix, a binary search for the first then a walk over the
+// rest of the range.
+static size_t classnames_with_prefix(EntityIndex *ix, const char *prefix, const s32 **ids) {
+  const char **strings = ix->classnames.strings;
+  size_t count = buf_size(strings), len = strlen(prefix);
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(strings[ix->classname_order[mid]], prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  size_t end = lo;
+  while (end < count && !strncmp(strings[ix->classname_order[end]], prefix, len))
+    ++end;
+  *ids = ix->classname_order + lo;
+  return end - lo;
+}
+#ifndef BSP_LIBRARY
+// Entities with exactly this classname, in file order.
+static size_t entities_by_classname(EntityIndex *ix, const char *classname, const s32 **entities) {
+  s32 id = string_table_find(&ix->classnames, classname);
+  *entities = id == -1 ? NULL : ix->classname_entities[id];
+  return buf_size(*entities);
 }
-size_t stream_write_(struct Stream_s *stream, const void *ptr, size_t size, size_t nmemb) {
+#endif
+static size_t stream_read_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb) {
   StreamFile *sd = (StreamFile *)stream->ctx;
-  return fwrite(ptr, size, nmemb, sd->fp);
+  return fread(ptr, size, nmemb, sd->fp);
 }
-int stream_eof_(struct Stream_s *stream) {
+static int stream_eof_(struct Stream_s *stream) {
   StreamFile *sd = (StreamFile *)stream->ctx;
   return feof(sd->fp);
 }
-int stream_name_(struct Stream_s *s, char *buffer, size_t size) {
+static int stream_name_(struct Stream_s *s, char *buffer, size_t size) {
   StreamFile *sd = (StreamFile *)s->ctx;
   snprintf(buffer, size, "%s", sd->path);
   return 0;
 }
-int64_t stream_tell_(struct Stream_s *s) {
+static int64_t stream_tell_(struct Stream_s *s) {
   StreamFile *sd = (StreamFile *)s->ctx;
   return ftell(sd->fp);
 }
-int stream_seek_(struct Stream_s *s, int64_t offset, int whence) {
+static int stream_seek_(struct Stream_s *s, int64_t offset, int whence) {
   StreamFile *sd = (StreamFile *)s->ctx;
   switch(whence) {
     case STREAM_SEEK_BEG:
@@ -450,7 +768,7 @@ int stream_seek_(struct Stream_s *s, int64_t offset, int whence) {
   }
   return 0;
 }
-int stream_open_file(Stream *s, const char *path, const char *mode) {
+static int stream_open_file(Stream *s, const char *path, const char *mode) {
     FILE *fp = fopen(path, mode);
     if(!fp)
         return 1;
@@ -466,7 +784,7 @@ int stream_open_file(Stream *s, const char *path, const char *mode) {
   s->seek = stream_seek_;
     return 0;
 }
-int stream_close_file(Stream *s) {
+static int stream_close_file(Stream *s) {
     if(!s->ctx) {
         return 1;
     }
@@ -476,130 +794,688 @@ int stream_close_file(Stream *s) {
     s->ctx = NULL;
     return 0;
 }
-size_t stream_read_buffer(Stream *s, void *ptr, size_t n) {
+static size_t stream_read_buffer(Stream *s, void *ptr, size_t n) {
   return s->read(s, ptr, n, 1);
 }
 #define stream_read(s, ptr) stream_read_buffer(&(s), &(ptr), sizeof(ptr))
-int stream_read_line(Stream *s, char *line, size_t max_line_length) {
-  size_t n = 0;
-  line[n] = 0;
-  int eol = 0;
-  int eof = 0;
-  size_t offset = 0;
-  while(!eol)
-  {
-    uint8_t ch = 0;
-    if(0 == s->read(s, &ch, 1, 1) || !ch)
-    {
-      eof = 1;
-      break;
-    }
-    if(n + 1 >= max_line_length) // n + 1 account for \0
-    {
-      break;
-    }
-    switch(ch)
-    {
-      case '\r': break;
-      case '\n': eol = 1; break;
-      default: line[n++] = ch; break;
-    }
-  }
-  line[n] = 0;
-  return eof;
-}
-size_t stream_read_buffer_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb) {
-  StreamBuffer *sd = (StreamBuffer *)stream->ctx;
-  size_t nb = size * nmemb;
-  if(sd->offset + nb > sd->length)
-  {
-    return 0; // EOF
-  }
-  memcpy(ptr, &sd->buffer[sd->offset], nb);
-  sd->offset += nb;
-  return nmemb;
-}
-size_t stream_write_buffer_(struct Stream_s *stream, const void *ptr, size_t size, size_t nmemb) {
-  StreamBuffer *sd = (StreamBuffer *)stream->ctx;
-  size_t nb = size * nmemb;
-  if(sd->offset + nb > sd->length) {
-    return 0; // EOF
-  }
-  memcpy(&sd->buffer[sd->offset], ptr, nb);
-  sd->offset += nb;
-  return nmemb;
-}
-int stream_eof_buffer_(struct Stream_s *stream) {
-  StreamBuffer *sd = (StreamBuffer *)stream->ctx;
-  return sd->offset >= sd->length;
-}
-int stream_name_buffer_(struct Stream_s *s, char *buffer, size_t size) {
-  StreamBuffer *sd = (StreamBuffer *)s->ctx;
-  buffer[0] = 0;
+typedef struct {
+  void *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+} FileMapping;
+static int file_mapping_open(FileMapping *fm, const char *path) {
+  memset(fm, 0, sizeof(*fm));
+#ifdef _WIN32
+  fm->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (fm->file == INVALID_HANDLE_VALUE)
+    return 1;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(fm->file, &size) || size.QuadPart == 0) {
+    CloseHandle(fm->file);
+    return 1;
+  }
+  fm->mapping = CreateFileMappingA(fm->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!fm->mapping) {
+    CloseHandle(fm->file);
+    return 1;
+  }
+  fm->data = MapViewOfFile(fm->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!fm->data) {
+    CloseHandle(fm->mapping);
+    CloseHandle(fm->file);
+    return 1;
+  }
+  fm->size = (size_t)size.QuadPart;
+#else
+  fm->fd = open(path, O_RDONLY);
+  if (fm->fd == -1)
+    return 1;
+  struct stat st;
+  if (fstat(fm->fd, &st) || st.st_size == 0) {
+    close(fm->fd);
+    return 1;
+  }
+  fm->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fm->fd, 0);
+  if (fm->data == MAP_FAILED) {
+    fm->data = NULL;
+    close(fm->fd);
+    return 1;
+  }
+  fm->size = st.st_size;
+#endif
   return 0;
 }
-int64_t stream_tell_buffer_(struct Stream_s *s) {
-  StreamBuffer *sd = (StreamBuffer *)s->ctx;
-  return sd->offset;
+static void file_mapping_close(FileMapping *fm) {
+  if (!fm->data)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(fm->data);
+  CloseHandle(fm->mapping);
+  CloseHandle(fm->file);
+#else
+  munmap(fm->data, fm->size);
+  close(fm->fd);
+#endif
+  fm->data = NULL;
 }
-int stream_seek_buffer_(struct Stream_s *s, int64_t offset, int whence) {
-  StreamBuffer *sd = (StreamBuffer *)s->ctx;
-  switch(whence) {
-    case STREAM_SEEK_BEG:
-    {
-      sd->offset = sd->length == 0 ? 0 : offset % sd->length;
-    }
-    break;
-    case STREAM_SEEK_CUR:
-    {
-      sd->offset = sd->length == 0 ? 0 : (sd->offset + offset) % sd->length;
-    }
-    break;
-    case STREAM_SEEK_END:
-    {
-      sd->offset = sd->length;
+// Points the lump straight into the mapping. Lumps whose offset isn't aligned for their
+// element type get copied instead, so the typed pointers we hand out stay valid.
+static bool map_lump(FileMapping *fm, lump_t *l, int type, LumpData *ld) {
+  if ((u64)l->fileofs + l->filelen > fm->size)
+    return false;
+  size_t align = lumpsizes[type] % 4 == 0 ? 4 : (lumpsizes[type] % 2 == 0 ? 2 : 1);
+  u8 *p = (u8*)fm->data + l->fileofs;
+  ld->count = l->filelen / lumpsizes[type];
+  if ((uintptr_t)p % align == 0) {
+    ld->data = p;
+    ld->mapped = true;
+  } else {
+    ld->data = malloc(l->filelen);
+    memcpy(ld->data, p, l->filelen);
+    ld->mapped = false;
+  }
+  return true;
+}
+// Bounding volume hierarchy over the roots of the collision aabb trees. Inner nodes are followed by
+// their first child, leaves list count roots starting at roots[first].
+typedef struct {
+  vec3 mins, maxs;
+  s32 first; // inner node: index of the second child
+  s32 count; // 0 for inner nodes
+} CollisionNode;
+typedef struct {
+  CollisionNode *nodes;
+  s32 *roots;
+  size_t depth; // of the hierarchy, counting the root as 1
+  bool loaded;
+} CollisionWorld;
+typedef struct {
+  vec3 start, end;
+  vec3 extents; // half size of the swept box, zero for a ray
+  u32 contents; // only hit materials with one of these contentFlags, 0 = anything
+} TraceRay;
+typedef struct {
+  float fraction; // 1 when nothing was hit
+  vec3 normal;
+  s32 material; // index into LUMP_MATERIALS, -1 when nothing was hit
+  bool start_solid; // the box already overlaps a triangle at the start
+} TraceResult;
+// LUMP_NODES with each node's plane copied in. Children are node indices, or -(leaf + 1) for leafs.
+typedef struct {
+  vec3 normal;
+  float dist;
+  s32 children[2];
+  s32 type; // axis of a +x/+y/+z plane, or PLANE_NON_AXIAL
+  s32 pad;
+} BspNode;
+typedef struct {
+  BspNode *nodes;
+  size_t count;
+  size_t depth;
+  bool loaded;
+} BspTree;
+// BVH over the render triangles. Interior nodes have count 0 and their two children at first and
+// first + 1, leafs hold count triangles from first on. Triangles are stored as a corner and two edges,
+// already in leaf order.
+typedef struct {
+  vec3 mins;
+  u32 first;
+  vec3 maxs;
+  u32 count;
+} BvhNode;
+typedef struct {
+  vec3 v0, e1, e2;
+  u32 soup;
+  u32 index; // of its first index in LUMP_DRAWINDICES
+} RenderTriangle;
+typedef struct {
+  BvhNode *nodes;
+  RenderTriangle *tris;
+  size_t tri_count;
+  bool loaded;
+} RenderBvh;
+typedef struct {
+  vec3 origin, dir;
+  float tmax;
+} RenderRay;
+typedef struct {
+  float t; // distance along dir, tmax when nothing was hit
+  float u, v; // barycentrics of the hit relative to v0, e1 and e2
+  s32 triangle; // index into RenderBvh.tris, -1 when nothing was hit
+} RenderHit;
+typedef struct {
+  s32 vertex[3];
+} Triangle;
+// Layout of a .bspcache file. Sections are arrays of the fixed size records below at 8 byte
+// aligned offsets, so a mapped file is used in place.
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 reserved;
+  u64 key; // hash of the source lumps
+  u64 size; // of the whole file
+  u64 checksum; // hash_bytes of everything after the header
+  u64 brush_count, face_count, patch_count, triangle_count;
+  u64 brushes_offset, faces_offset, patches_offset, triangles_offset;
+} BrushCacheHeader;
+typedef struct {
+  u32 first_face, face_count;
+} CachedBrush;
+// A plane of a brush that polygonize_brush kept a face on. The .map output only needs the plane, so
+// the winding isn't stored.
+typedef struct {
+  vec3 normal;
+  float distance;
+  s32 material;
+} CachedFace;
+typedef struct {
+  s32 material;
+  u32 first_triangle, triangle_count;
+} CachedPatch;
+typedef struct {
+  CachedBrush *brushes;
+  CachedFace *faces;
+  CachedPatch *patches;
+  Triangle *triangles;
+  size_t brush_count, patch_count;
+  FileMapping fm;
+  void *data; // the file contents when built in this run rather than mapped
+  bool loaded;
+} BrushCache;
+typedef struct {
+  u64 *rows; // cluster_count rows of row_words words, NULL when the map has no visibility data
+  u64 *all; // a row with every cluster set
+  size_t cluster_count;
+  size_t row_words;
+  bool loaded;
+} Pvs;
+typedef struct {
+  dheader_t hdr;
+  bool use_mmap;
+  Stream stream;
+  FileMapping fm;
+  u64 declared;
+} LumpSource;
+// -profile: time spent per phase and what each phase went through. Phases nest (lumps load while
+// other phases ask for them, export contains most of the rest), and polygonize_cpu is CPU time
+// summed over the threads that ran it, so with -threads it can exceed the export's wall time.
+enum {
+  PROFILE_LUMPS,
+  PROFILE_ENTITIES,
+  PROFILE_BRUSHES,
+  PROFILE_POLYGONIZE,
+  PROFILE_PATCHES,
+  PROFILE_IO,
+  PROFILE_EXPORT,
+  PROFILE_TOTAL,
+  PROFILE_PHASES
+};
+enum {
+  PROFILE_LUMPS_LOADED,
+  PROFILE_LUMP_BYTES,
+  PROFILE_BRUSH_COUNT,
+  PROFILE_SIDE_COUNT,
+  PROFILE_POLYGON_COUNT,
+  PROFILE_TRIANGLE_COUNT,
+  PROFILE_BYTES_WRITTEN,
+  PROFILE_ALLOCATIONS,
+  PROFILE_ALLOCATED_BYTES,
+  PROFILE_COUNTERS
+};
+#ifndef BSP_LIBRARY
+static const char *profile_phase_names[PROFILE_PHASES] = {
+  "lumps", "entities", "brushes", "polygonize_cpu", "patches", "io", "export", "total"
+};
+static const char *profile_counter_names[PROFILE_COUNTERS] = {
+  "lumps_loaded", "lump_bytes", "brushes", "sides", "polygons", "triangles", "bytes_written",
+  "allocations", "allocated_bytes"
+};
+#endif
+typedef struct {
+  volatile u64 ns[PROFILE_PHASES];
+  volatile u64 counters[PROFILE_COUNTERS];
+} Profile;
+static void atomic_add_u64(volatile u64 *p, u64 v) {
+#ifdef _WIN32
+  InterlockedExchangeAdd64((volatile LONG64*)p, (LONG64)v);
+#else
+  __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+#endif
+}
+static double time_seconds();
+static void profile_time(Profile *p, int phase, double t0) {
+  atomic_add_u64(&p->ns[phase], (u64)((time_seconds() - t0) * 1e9));
+}
+static void profile_count(Profile *p, int counter, u64 n) {
+  atomic_add_u64(&p->counters[counter], n);
+}
+// Everything that belongs to one open .d3dbsp, so several maps can be processed side by side.
+struct Bsp_s {
+  LumpSource source;
+  LumpData lumps[LUMP_MAX];
+  s64 filelen;
+  Entity *entities;
+  char *entity_strings;
+  EntityIndex entity_index;
+  MapBrush *mapbrushes;
+  size_t mapbrush_count;
+  Arena arena; // brushes and their planes
+  CollisionWorld collision;
+  BspTree tree;
+  Pvs pvs;
+  RenderBvh bvh;
+  BrushCache brush_cache;
+  Profile profile;
+  size_t threads; // for work within this map, 0 = one per core
+  jmp_buf *on_error;
+  char error[256];
+};
+// Without an on_error jump target this behaves like the old fprintf + exit(1).
+static void bsp_error(Bsp *bsp, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(bsp->error, sizeof(bsp->error), fmt, args);
+  va_end(args);
+  if (bsp->on_error)
+    longjmp(*bsp->on_error, 1);
+  fprintf(stderr, "%s\n", bsp->error);
+  exit(1);
+}
+// From the map's arena, with running out of memory reported like any other error.
+static void *bsp_alloc(Bsp *bsp, size_t size) {
+  void *p = arena_alloc(&bsp->arena, size);
+  if (!p)
+    bsp_error(bsp, "Out of memory allocating %zu bytes", size);
+  return p;
+}
+// Loads the lump on first access, either by pointing into the mapping or reading it from the stream.
+static LumpData *lump(Bsp *bsp, int type) {
+  LumpSource *src = &bsp->source;
+  LumpData *ld = &bsp->lumps[type];
+  if (ld->loaded)
+    return ld;
+  assert(src->declared & LUMP_BIT(type));
+  ld->loaded = true;
+  lump_t *l = &src->hdr.lumps[type];
+  if (l->filelen == 0 || lumpsizes[type] == 0)
+    return ld;
+  double t0 = time_seconds();
+  profile_count(&bsp->profile, PROFILE_LUMPS_LOADED, 1);
+  profile_count(&bsp->profile, PROFILE_LUMP_BYTES, l->filelen);
+  if (src->use_mmap) {
+    if (!map_lump(&src->fm, l, type, ld)) {
+      ld->loaded = false;
+      bsp_error(bsp, "Lump '%s' is out of bounds", lumpnames[type]);
     }
-    break;
+    profile_time(&bsp->profile, PROFILE_LUMPS, t0);
+    return ld;
   }
-  return 0;
+  Stream *s = &src->stream;
+  ld->count = l->filelen / lumpsizes[type];
+  ld->data = calloc(ld->count, lumpsizes[type]);
+  if (!ld->data && ld->count) {
+    *ld = (LumpData) {0};
+    bsp_error(bsp, "Out of memory reading lump '%s' (%u bytes)", lumpnames[type], l->filelen);
+  }
+  s->seek(s, l->fileofs, SEEK_SET);
+  if (s->read(s, ld->data, lumpsizes[type], ld->count) != ld->count) {
+    // Left unloaded, so a library caller that catches the error doesn't see half a lump.
+    free(ld->data);
+    *ld = (LumpData) {0};
+    bsp_error(bsp, "Failed to read lump '%s'", lumpnames[type]);
+  }
+  profile_time(&bsp->profile, PROFILE_LUMPS, t0);
+  return ld;
+}
+// Reads and validates the header. Lumps are loaded later on demand, limited to the declared set.
+static void bsp_open(Bsp *bsp, const char *path, bool use_mmap, u64 declared) {
+  LumpSource *src = &bsp->source;
+  dheader_t *hdr = &src->hdr;
+  src->use_mmap = use_mmap;
+  src->declared = declared;
+  if (use_mmap) {
+    FileMapping *fm = &src->fm;
+    if (file_mapping_open(fm, path) || fm->size < sizeof(*hdr))
+      bsp_error(bsp, "Failed to map '%s'", path);
+    bsp->filelen = fm->size;
+    memcpy(hdr, fm->data, sizeof(*hdr));
+  } else {
+    Stream *s = &src->stream;
+    if (stream_open_file(s, path, "rb"))
+      bsp_error(bsp, "Failed to open '%s'", path);
+    s->seek(s, 0, SEEK_END);
+    bsp->filelen = s->tell(s);
+    s->seek(s, 0, SEEK_SET);
+    if (stream_read(*s, *hdr) != 1)
+      bsp_error(bsp, "Failed to read header of '%s'", path);
+  }
+  if (memcmp(hdr->ident, "IBSP", 4))
+    bsp_error(bsp, "Magic mismatch");
+  if (hdr->version != 4)
+    bsp_error(bsp, "Version mismatch");
+  for (size_t i = 0; i < LUMP_MAX; ++i) {
+    lump_t *l = &hdr->lumps[i];
+    if ((u64)l->fileofs + l->filelen > (u64)bsp->filelen)
+      bsp_error(bsp, "Lump '%s' is out of bounds", lumpnames[i]);
+    if (lumpsizes[i] != 0 && l->filelen % lumpsizes[i] != 0)
+      bsp_error(bsp, "Lump '%s' has a size that isn't a multiple of its element size", lumpnames[i]);
+  }
+}
+static void bsp_set_entity_strings(Bsp *bsp, char *strings) {
+  free(bsp->entity_strings);
+  bsp->entity_strings = strings;
+}
+static void bsp_load_entities(Bsp *bsp) {
+  double t0 = time_seconds();
+  bsp->entities = parse_entities(bsp);
+  entity_index_build(&bsp->entity_index, bsp->entities);
+  profile_time(&bsp->profile, PROFILE_ENTITIES, t0);
 }
-int init_stream_from_stream_buffer(Stream *s, StreamBuffer *sb) {
-  s->ctx = sb;
-  s->read = stream_read_buffer_;
-  // s->write = stream_write_buffer_;
-  s->eof = stream_eof_buffer_;
-  s->name = stream_name_buffer_;
-  s->tell = stream_tell_buffer_;
-  s->seek = stream_seek_buffer_;
+static void bsp_close(Bsp *bsp) {
+  entity_index_free(&bsp->entity_index);
+  for (size_t i = 0; i < buf_size(bsp->entities); ++i)
+    buf_free(bsp->entities[i].keyvalues);
+  buf_free(bsp->entities);
+  free(bsp->entity_strings);
+  arena_free(&bsp->arena);
+  buf_free(bsp->collision.nodes);
+  buf_free(bsp->collision.roots);
+  buf_free(bsp->bvh.nodes);
+  free(bsp->bvh.tris);
+  file_mapping_close(&bsp->brush_cache.fm);
+  free(bsp->brush_cache.data);
+  for (size_t i = 0; i < LUMP_MAX; ++i) {
+    if (!bsp->lumps[i].mapped)
+      free(bsp->lumps[i].data);
+  }
+  file_mapping_close(&bsp->source.fm);
+  stream_close_file(&bsp->source.stream);
+  memset(bsp, 0, sizeof(*bsp));
+}
+#ifdef _WIN32
+typedef HANDLE Thread;
+#else
+typedef pthread_t Thread;
+#endif
+typedef struct {
+  void (*fn)(void *ctx, size_t index);
+  void *ctx;
+  size_t count;
+  volatile s64 next;
+  volatile u64 alloc_count, alloc_bytes; // made by the workers
+} ParallelFor;
+// Takes indices until there are none left and adds what this thread allocated meanwhile to pf.
+static void parallel_for_run(ParallelFor *pf) {
+  AllocCounter before = thread_allocs;
+#ifdef _WIN32
+  for (s64 i; (i = InterlockedIncrement64((volatile LONG64*)&pf->next) - 1) < (s64)pf->count;)
+#else
+  for (s64 i; (i = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED)) < (s64)pf->count;)
+#endif
+    pf->fn(pf->ctx, (size_t)i);
+  atomic_add_u64(&pf->alloc_count, thread_allocs.count - before.count);
+  atomic_add_u64(&pf->alloc_bytes, thread_allocs.bytes - before.bytes);
+}
+#ifdef _WIN32
+static DWORD WINAPI parallel_for_worker(LPVOID arg) {
+  parallel_for_run(arg);
   return 0;
 }
-int init_stream_from_buffer(Stream *s, StreamBuffer *sb, unsigned char *buffer, size_t length) {
-  sb->offset = 0;
-  sb->length = length;
-  sb->buffer = buffer;
-  s->ctx = sb;
-  s->read = stream_read_buffer_;
-  // s->write = stream_write_buffer_;
-  s->eof = stream_eof_buffer_;
-  s->name = stream_name_buffer_;
-  s->tell = stream_tell_buffer_;
-  s->seek = stream_seek_buffer_;
+#else
+static void *parallel_for_worker(void *arg) {
+  parallel_for_run(arg);
+  return NULL;
+}
+#endif
+static double time_seconds() {
+#ifdef _WIN32
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+static size_t cpu_count() {
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+#endif
+}
+#ifndef BSP_LIBRARY
+// Of the whole process, in bytes, 0 where unknown.
+static u64 peak_rss_bytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return 0;
+  return pmc.PeakWorkingSetSize;
+#else
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+#ifdef __APPLE__
+  return ru.ru_maxrss;
+#else
+  return (u64)ru.ru_maxrss * 1024;
+#endif
+#endif
+}
+#endif
+// Calls fn(ctx, i) for every i in [0, count) on up to num_threads threads (0 = one per core).
+// Indices are handed out one at a time, so uneven work items balance themselves.
+static void parallel_for(size_t count, size_t num_threads, void (*fn)(void *ctx, size_t index), void *ctx) {
+  ParallelFor pf = { .fn = fn, .ctx = ctx, .count = count, .next = 0 };
+  if (num_threads == 0)
+    num_threads = cpu_count();
+  if (num_threads > count)
+    num_threads = count;
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < count; ++i)
+      fn(ctx, i);
+    return;
+  }
+  Thread *threads = malloc(sizeof(Thread) * num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, parallel_for_worker, &pf, 0, NULL);
+#else
+    pthread_create(&threads[i], NULL, parallel_for_worker, &pf);
+#endif
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+  free(threads);
+  thread_allocs.count += pf.alloc_count;
+  thread_allocs.bytes += pf.alloc_bytes;
+}
+// Workers that stay up between loops, for callers that run many short parallel loops in a row and
+// would otherwise spend a good part of each creating and joining threads. The calling thread works
+// on each loop too, so a pool for n threads starts n - 1 workers.
+typedef struct {
+  Thread *threads;
+  size_t count;
+  ParallelFor *job;
+  u64 generation; // bumped for every job, workers wait for it to change
+  size_t busy; // workers still on the current job
+  bool stop;
+#ifdef _WIN32
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake, done;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+#endif
+} ThreadPool;
+#ifdef _WIN32
+#define pool_lock(p) EnterCriticalSection(&(p)->lock)
+#define pool_unlock(p) LeaveCriticalSection(&(p)->lock)
+#define pool_wait(p, cond) SleepConditionVariableCS(&(p)->cond, &(p)->lock, INFINITE)
+#define pool_wake_all(p, cond) WakeAllConditionVariable(&(p)->cond)
+#else
+#define pool_lock(p) pthread_mutex_lock(&(p)->lock)
+#define pool_unlock(p) pthread_mutex_unlock(&(p)->lock)
+#define pool_wait(p, cond) pthread_cond_wait(&(p)->cond, &(p)->lock)
+#define pool_wake_all(p, cond) pthread_cond_broadcast(&(p)->cond)
+#endif
+#ifdef _WIN32
+static DWORD WINAPI thread_pool_worker(LPVOID arg) {
+#else
+static void *thread_pool_worker(void *arg) {
+#endif
+  ThreadPool *pool = arg;
+  u64 seen = 0;
+  pool_lock(pool);
+  for (;;) {
+    while (!pool->stop && pool->generation == seen)
+      pool_wait(pool, wake);
+    if (pool->stop)
+      break;
+    seen = pool->generation;
+    ParallelFor *pf = pool->job;
+    pool_unlock(pool);
+    parallel_for_run(pf);
+    pool_lock(pool);
+    if (--pool->busy == 0)
+      pool_wake_all(pool, done);
+  }
+  pool_unlock(pool);
+#ifdef _WIN32
   return 0;
+#else
+  return NULL;
+#endif
+}
+// num_threads 0 is one per core. Loops never need more than max_count threads.
+static void thread_pool_start(ThreadPool *pool, size_t num_threads, size_t max_count) {
+  memset(pool, 0, sizeof(*pool));
+  if (num_threads == 0)
+    num_threads = cpu_count();
+  if (num_threads > max_count)
+    num_threads = max_count;
+  if (num_threads <= 1)
+    return;
+#ifdef _WIN32
+  InitializeCriticalSection(&pool->lock);
+  InitializeConditionVariable(&pool->wake);
+  InitializeConditionVariable(&pool->done);
+#else
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+#endif
+  pool->threads = malloc(sizeof(Thread) * (num_threads - 1));
+  for (; pool->count < num_threads - 1; ++pool->count) {
+#ifdef _WIN32
+    pool->threads[pool->count] = CreateThread(NULL, 0, thread_pool_worker, pool, 0, NULL);
+#else
+    pthread_create(&pool->threads[pool->count], NULL, thread_pool_worker, pool);
+#endif
+  }
+}
+// parallel_for on the pool's threads.
+static void thread_pool_run(ThreadPool *pool, size_t count, void (*fn)(void *ctx, size_t index), void *ctx) {
+  ParallelFor pf = { .fn = fn, .ctx = ctx, .count = count, .next = 0 };
+  if (!pool->count) {
+    for (size_t i = 0; i < count; ++i)
+      fn(ctx, i);
+    return;
+  }
+  pool_lock(pool);
+  pool->job = &pf;
+  pool->busy = pool->count;
+  ++pool->generation;
+  pool_wake_all(pool, wake);
+  pool_unlock(pool);
+  AllocCounter before = thread_allocs;
+  parallel_for_run(&pf);
+  thread_allocs = before;
+  pool_lock(pool);
+  while (pool->busy)
+    pool_wait(pool, done);
+  pool_unlock(pool);
+  thread_allocs.count += pf.alloc_count;
+  thread_allocs.bytes += pf.alloc_bytes;
 }
+static void thread_pool_stop(ThreadPool *pool) {
+  if (!pool->threads)
+    return;
+  pool_lock(pool);
+  pool->stop = true;
+  pool_wake_all(pool, wake);
+  pool_unlock(pool);
+  for (size_t i = 0; i < pool->count; ++i) {
+#ifdef _WIN32
+    WaitForSingleObject(pool->threads[i], INFINITE);
+    CloseHandle(pool->threads[i]);
+#else
+    pthread_join(pool->threads[i], NULL);
+#endif
+  }
+  free(pool->threads);
+#ifdef _WIN32
+  DeleteCriticalSection(&pool->lock);
+#else
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+#endif
+  memset(pool, 0, sizeof(*pool));
+}
+typedef struct {
+  vec3 origin;
+  float pitch, yaw;
+  float fov_x, fov_y;
+} VisCamera;
 typedef struct {
   bool print_info;
+  bool print_pvs;
+  bool hash_lumps;
   bool export_to_map;
-  const char *input_file;
+  bool use_mmap;
+  const char **input_files;
+  bool batch;
+  size_t threads;
   const char *format;
   const char *export_file;
+  const char *cache_dir;
   bool try_fix_portals;
   bool exclude_patches;
+  const char *bench;
+  size_t bench_size;
+  const char *generate_file;
+  const char *generate_counts;
+  const char *profile_format; // table or json
+  TraceRay *trace_rays;
+  RenderRay *raycast_rays;
+  float *classify_points; // x, y, z per point
+  VisCamera *vis_cameras;
+  const char *lightmap_dir;
+  const char *mesh_file;
+  bool optimize_mesh;
+  bool meshlets;
 } ProgramOptions;
-LumpData lumpdata[LUMP_MAX];
-s64 filelen;
-Entity *entities;
-void info(dheader_t *hdr, int type, int *count) {
-  lump_t *l = &hdr->lumps[type];
+#ifndef BSP_LIBRARY
+static void info(Bsp *bsp, FILE *out, int type, int *count) {
+  lump_t *l = &bsp->source.hdr.lumps[type];
   char amount[256] = { 0 };
   if (count) {
     snprintf(amount, sizeof(amount), "%6d", *count);
@@ -612,50 +1488,113 @@ void info(dheader_t *hdr, int type, int *count) {
     }
     else if (lumpsizes[type] > 1)
     {
-      snprintf(amount, sizeof(amount), "%6d", l->filelen / lumpsizes[type]);
+      snprintf(amount, sizeof(amount), "%6zu", l->filelen / lumpsizes[type]);
     }
   }
-  printf("%s %-19s %6d B\t%2d KB %5.1f%%\n",
+  fprintf(out, "%s %-19s %6d B\t%2d KB %5.1f%%\n",
     amount,
     lumpnames[type],
     l->filelen,
     (int)ceilf((float)l->filelen / 1000.f),
-    (float)l->filelen / (float)filelen * 100.f);
+    (float)l->filelen / (float)bsp->filelen * 100.f);
 }
-void test(const char *type, size_t a, size_t b) {
+static void test(const char *type, size_t a, size_t b) {
   if (a != b) {
-    fprintf(stderr, "%d != %d, sizeof(%s) = %d\n", a, b, type, a);
+    fprintf(stderr, "%zu != %zu, sizeof(%s) = %zu\n", a, b, type, a);
     exit(1);
   }
 }
 #define TEST(a, b) test(#a, sizeof(a), b)
-void planes_from_aabb(vec3 mins, vec3 maxs, DiskPlane planes[6]) {
-  planes[0].normal[0] = -1.0f;
-  planes[0].normal[1] = 0.0f;
-  planes[0].normal[2] = 0.0f;
-  planes[0].dist = -mins[0];
-  planes[1].normal[0] = 1.0f;
-  planes[1].normal[1] = 0.0f;
-  planes[1].normal[2] = 0.0f;
-  planes[1].dist = maxs[0];
-  planes[2].normal[0] = 0.0f;
-  planes[2].normal[1] = -1.0f;
-  planes[2].normal[2] = 0.0f;
-  planes[2].dist = -mins[1];
-  planes[3].normal[0] = 0.0f;
-  planes[3].normal[1] = 1.0f;
-  planes[3].normal[2] = 0.0f;
-  planes[3].dist = maxs[1];
-  planes[4].normal[0] = 0.0f;
-  planes[4].normal[1] = 0.0f;
-  planes[4].normal[2] = -1.0f;
-  planes[4].dist = -mins[2];
-  planes[5].normal[0] = 0.0f;
-  planes[5].normal[1] = 0.0f;
-  planes[5].normal[2] = 1.0f;
-  planes[5].dist = maxs[2];
+#endif
+// Output buffer for .map text. With a FILE it flushes every WRITER_FLUSH_SIZE bytes, without one
+// it just accumulates (used for the per-brush chunks).
+typedef struct {
+  FILE *fp;
+  char *data;
+  Profile *profile; // optional, gets the time spent writing to fp
+} Writer;
+#define WRITER_FLUSH_SIZE (1 << 20)
+static void writer_flush(Writer *w) {
+  if (w->fp && buf_size(w->data)) {
+    double t0 = time_seconds();
+    fwrite(w->data, 1, buf_size(w->data), w->fp);
+    if (w->profile) {
+      profile_time(w->profile, PROFILE_IO, t0);
+      profile_count(w->profile, PROFILE_BYTES_WRITTEN, buf_size(w->data));
+    }
+    buf_clear(w->data);
+  }
+}
+static void writer_free(Writer *w) {
+  writer_flush(w);
+  buf_free(w->data);
+}
+static void writer_write(Writer *w, const void *data, size_t n) {
+  if (!n)
+    return;
+  size_t avail = buf_capacity(w->data) - buf_size(w->data);
+  if (n > avail) {
+    size_t grow = buf_capacity(w->data) > n ? buf_capacity(w->data) : n;
+    buf_grow(w->data, grow < 256 ? 256 : grow);
+  }
+  memcpy(w->data + buf_size(w->data), data, n);
+  buf_ptr(w->data)->size += n;
+  if (w->fp && buf_size(w->data) >= WRITER_FLUSH_SIZE)
+    writer_flush(w);
+}
+#define writer_literal(w, s) writer_write((w), (s), sizeof(s) - 1)
+static void writer_string(Writer *w, const char *s) {
+  writer_write(w, s, strlen(s));
+}
+static void writer_int(Writer *w, s64 v) {
+  char tmp[24];
+  char *end = tmp + sizeof(tmp);
+  char *p = end;
+  u64 u = v < 0 ? 0 - (u64)v : (u64)v;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (v < 0)
+    *--p = '-';
+  writer_write(w, p, end - p);
+}
+// Writes the same text as printf("%f", x). A float has a 24 bit mantissa and 10^6 = 15625 * 2^6,
+// so x * 10^6 is exact in a double and rounding it to an integer (to nearest, ties to even) gives
+// exactly the digits printf produces, without going through the locale aware formatter.
+static void writer_float(Writer *w, float x) {
+  double scaled = (double)x * 1e6;
+  if (!(fabs(scaled) < 9007199254740992.0)) {
+    char tmp[64];
+    int n = snprintf(tmp, sizeof(tmp), "%f", x);
+    writer_write(w, tmp, n < (int)sizeof(tmp) ? n : (int)sizeof(tmp) - 1);
+    return;
+  }
+  u64 v = (u64)nearbyint(fabs(scaled));
+  char tmp[32];
+  char *end = tmp + sizeof(tmp);
+  char *p = end;
+  for (int i = 0; i < 6; ++i) {
+    *--p = '0' + v % 10;
+    v /= 10;
+  }
+  *--p = '.';
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (signbit(x))
+    *--p = '-';
+  writer_write(w, p, end - p);
+}
+static void writer_vec3(Writer *w, float x, float y, float z) {
+  writer_float(w, x);
+  writer_literal(w, " ");
+  writer_float(w, y);
+  writer_literal(w, " ");
+  writer_float(w, z);
 }
-void write_plane(FILE *fp, const char *material, vec3 n, float dist, vec3 origin) {
+static void write_plane(Writer *w, const char *material, vec3 n, float dist, vec3 origin) {
   vec3 tangent, bitangent;
   vec3 up = { 0, 0, 1.f };
   vec3 fw = { 0, 1.f, 0 };
@@ -673,72 +1612,119 @@ void write_plane(FILE *fp, const char *material, vec3 n, float dist, vec3 origin
   vec3_add(b, a, t);
   vec3_scale(t, bitangent, 100.f);
   vec3_add(c, a, t);
-  fprintf(
-    fp,
-    " ( %f %f %f ) ( %f %f %f ) ( %f %f %f ) %s 128 128 0 0 0 0 lightmap_gray 16384 16384 0 "
-    "0 0 0\n",
-    c[0] + origin[0],
-    c[1] + origin[1],
-    c[2] + origin[2],
-    b[0] + origin[0],
-    b[1] + origin[1],
-    b[2] + origin[2],
-    a[0] + origin[0],
-    a[1] + origin[1],
-    a[2] + origin[2],
-    material ? material : "caulk"
-  );
-}
-const char *entity_key_by_value(Entity *ent, const char *key) {
-  for (size_t i = 0; i < buf_size(ent->keyvalues); ++i) {
-    if (!strcmp(ent->keyvalues[i].key, key))
-      return ent->keyvalues[i].value;
-  }
-  return "";
+  writer_literal(w, " ( ");
+  writer_vec3(w, c[0] + origin[0], c[1] + origin[1], c[2] + origin[2]);
+  writer_literal(w, " ) ( ");
+  writer_vec3(w, b[0] + origin[0], b[1] + origin[1], b[2] + origin[2]);
+  writer_literal(w, " ) ( ");
+  writer_vec3(w, a[0] + origin[0], a[1] + origin[1], a[2] + origin[2]);
+  writer_literal(w, " ) ");
+  writer_string(w, material ? material : "caulk");
+  writer_literal(w, " 128 128 0 0 0 0 lightmap_gray 16384 16384 0 0 0 0\n");
 }
-typedef struct {
-  s32 vertex[3];
-} Triangle;
 typedef struct {
   Triangle *triangles;
   s32 materialIndex;
 } Patch;
-int triangle_vertex_compare(const void *a, const void *b) {
-  return (*(int *)a - *(int *)b);
-}
-// vertices should be sorted
-bool patch_has_triangle(Patch *patch, int *vertices) {
-  for (size_t i = 0; i < buf_size(patch->triangles); ++i) {
-    Triangle *tri = &patch->triangles[i];
-    if (tri->vertex[0] == vertices[0] && tri->vertex[1] == vertices[1] && tri->vertex[2] == vertices[2])
-      return true;
-  }
-  return false;
+static void triangle_sort_vertices(s32 *v) {
+  s32 t;
+  if (v[0] > v[1]) { t = v[0]; v[0] = v[1]; v[1] = t; }
+  if (v[1] > v[2]) { t = v[1]; v[1] = v[2]; v[2] = t; }
+  if (v[0] > v[1]) { t = v[0]; v[0] = v[1]; v[1] = t; }
 }
-bool patches_has_triangle(Patch *patches, int *vertices) {
-  for (size_t i = 0; i < buf_size(patches); ++i) {
-    if (patch_has_triangle(&patches[i], vertices))
+// Open addressing set of triangles with sorted vertex indices. Sized once for the largest number
+// of triangles that can be inserted, so it never rehashes. An empty slot has vertex[0] == -1.
+typedef struct {
+  Triangle *slots;
+  size_t mask;
+} TriangleSet;
+static void triangle_set_init(TriangleSet *set, size_t max_count) {
+  size_t capacity = 16;
+  while (capacity < max_count * 2)
+    capacity <<= 1;
+  set->slots = malloc(capacity * sizeof(Triangle));
+  memset(set->slots, 0xff, capacity * sizeof(Triangle));
+  set->mask = capacity - 1;
+}
+static void triangle_set_free(TriangleSet *set) {
+  free(set->slots);
+  set->slots = NULL;
+}
+static size_t triangle_hash(const s32 *v) {
+  u64 h = ((u64)(u32)v[0] << 32 | (u32)v[1]) * 0x9E3779B97F4A7C15ull;
+  h ^= (u32)v[2] * 0xC2B2AE3D27D4EB4Full;
+  h ^= h >> 29;
+  return (size_t)h;
+}
+// Returns false if the triangle was already in the set.
+static bool triangle_set_insert(TriangleSet *set, const s32 *v) {
+  for (size_t i = triangle_hash(v) & set->mask;; i = (i + 1) & set->mask) {
+    Triangle *t = &set->slots[i];
+    if (t->vertex[0] == -1) {
+      memcpy(t->vertex, v, sizeof(t->vertex));
       return true;
+    }
+    if (t->vertex[0] == v[0] && t->vertex[1] == v[1] && t->vertex[2] == v[2])
+      return false;
   }
-  return false;
 }
-bool vec3_fuzzy_zero(float *v) {
+static bool vec3_fuzzy_zero(float *v) {
   float e = 0.0001f;
   return fabs(v[0]) < e && fabs(v[1]) < e && fabs(v[2]) < e;
 }
-void write_patches(FILE *fp) {
-  dmaterial_t *materials = (dmaterial_t*)lumpdata[LUMP_MATERIALS].data;
-  DiskCollisionVertex *vertices = lumpdata[LUMP_COLLISIONVERTS].data;
-  DiskCollisionTriangle *tris = lumpdata[LUMP_COLLISIONTRIS].data;
-  DiskCollisionAabbTree *collaabbtrees = lumpdata[LUMP_COLLISIONAABBS].data;
-  DiskCollisionPartition *collpartitions = lumpdata[LUMP_COLLISIONPARTITIONS].data;
+static void write_patch_vertex(Writer *w, DiskCollisionVertex *v) {
+  writer_literal(w, "  v ");
+  writer_vec3(w, v->xyz[0], v->xyz[1], v->xyz[2]);
+  writer_literal(w, " t -1024 1024 -4 4\n");
+}
+// Checks the partition of leaf aabb i, its triangles and their vertices.
+static void collision_leaf_check(Bsp *bsp, DiskCollisionAabbTree *tree, size_t i) {
+  LumpData *parts = lump(bsp, LUMP_COLLISIONPARTITIONS);
+  LumpData *tris = lump(bsp, LUMP_COLLISIONTRIS);
+  size_t vert_count = lump(bsp, LUMP_COLLISIONVERTS)->count;
+  if (tree->u.partitionIndex < 0 || (size_t)tree->u.partitionIndex >= parts->count)
+    bsp_error(bsp, "Collision aabb %zu has an invalid partition", i);
+  DiskCollisionPartition *part = &((DiskCollisionPartition*)parts->data)[tree->u.partitionIndex];
+  if ((size_t)part->firstTriIndex + part->triCount > tris->count)
+    bsp_error(bsp, "Collision partition %d has triangles out of bounds", tree->u.partitionIndex);
+  DiskCollisionTriangle *triangles = tris->data;
+  for (size_t j = part->firstTriIndex; j < part->firstTriIndex + part->triCount; ++j) {
+    u32 *v = triangles[j].vertIndices;
+    if (v[0] >= vert_count || v[1] >= vert_count || v[2] >= vert_count)
+      bsp_error(bsp, "Collision triangle %zu has vertices out of bounds", j);
+  }
+}
+// Everything collect_patches indexes. The export runs it before opening the .map file.
+static void patches_check(Bsp *bsp) {
+  LumpData *aabbs = lump(bsp, LUMP_COLLISIONAABBS);
+  size_t material_count = lump(bsp, LUMP_MATERIALS)->count;
+  for (size_t i = 0; i < aabbs->count; ++i) {
+    DiskCollisionAabbTree *tree = &((DiskCollisionAabbTree*)aabbs->data)[i];
+    if (tree->childCount > 0)
+      continue;
+    if (tree->materialIndex < 0 || (size_t)tree->materialIndex >= material_count)
+      bsp_error(bsp, "Collision aabb %zu has an invalid material", i);
+    collision_leaf_check(bsp, tree, i);
+  }
+}
+// Groups the collision triangles of the leaf aabbs into patches of at most 7, dropping repeats and
+// triangles touching the origin. Some patches can end up empty.
+static Patch *collect_patches(Bsp *bsp) {
+  patches_check(bsp);
+  DiskCollisionVertex *vertices = lump(bsp, LUMP_COLLISIONVERTS)->data;
+  DiskCollisionTriangle *tris = lump(bsp, LUMP_COLLISIONTRIS)->data;
+  DiskCollisionAabbTree *collaabbtrees = lump(bsp, LUMP_COLLISIONAABBS)->data;
+  DiskCollisionPartition *collpartitions = lump(bsp, LUMP_COLLISIONPARTITIONS)->data;
+  size_t aabb_count = lump(bsp, LUMP_COLLISIONAABBS)->count;
   Patch *patches = NULL;
   Patch *patch = NULL;
-  for (size_t i = 0; i < lumpdata[LUMP_COLLISIONAABBS].count; ++i) {
+  TriangleSet seen;
+  triangle_set_init(&seen, lump(bsp, LUMP_COLLISIONTRIS)->count);
+  for (size_t i = 0; i < aabb_count; ++i) {
     DiskCollisionAabbTree *tree = &collaabbtrees[i];
-    DiskCollisionPartition *part = &collpartitions[tree->u.partitionIndex];
     if (tree->childCount > 0)
       continue;
+    DiskCollisionPartition *part = &collpartitions[tree->u.partitionIndex];
     bool created_new_patch = false;
     if (part->triCount > 0) {
       for (size_t j = 0; j < part->triCount; ++j) {
@@ -757,8 +1743,8 @@ void write_patches(FILE *fp) {
           patch = &patches[buf_size(patches) - 1];
           created_new_patch = true;
         }
-        qsort(triangle.vertex, 3, sizeof(int), triangle_vertex_compare);
-        if (!patches_has_triangle(patches, triangle.vertex)) {
+        triangle_sort_vertices(triangle.vertex);
+        if (triangle_set_insert(&seen, triangle.vertex)) {
           if (!created_new_patch) {
             buf_push(patches, ((Patch) { .triangles = NULL, .materialIndex = tree->materialIndex }));
             patch = &patches[buf_size(patches) - 1];
@@ -769,89 +1755,175 @@ void write_patches(FILE *fp) {
       }
     }
   }
+  triangle_set_free(&seen);
+  return patches;
+}
+static void free_patches(Patch *patches) {
+  for (size_t i = 0; i < buf_size(patches); ++i)
+    buf_free(patches[i].triangles);
+  buf_free(patches);
+}
+static void write_patch(Writer *w, const char *material, DiskCollisionVertex *vertices, Triangle *tris, size_t count) {
+  writer_literal(w, "  {\n");
+  writer_literal(w, "   mesh\n");
+  writer_literal(w, "   {\n");
+  writer_literal(w, "   ");
+  writer_string(w, material);
+  writer_literal(w, "\n");
+  // TODO: write contentFlags and contentFlags info
+  writer_literal(w, "   lightmap_gray\n");
+  writer_literal(w, "   ");
+  writer_int(w, count * 2);
+  writer_literal(w, " 2 16 8\n");
+  for (size_t j = 0; j < count; ++j) {
+    Triangle *tri = &tris[j];
+    DiskCollisionVertex *v1 = &vertices[tri->vertex[0]];
+    DiskCollisionVertex *v2 = &vertices[tri->vertex[1]];
+    DiskCollisionVertex *v3 = &vertices[tri->vertex[2]];
+    writer_literal(w, "   (\n");
+    write_patch_vertex(w, v1);
+    write_patch_vertex(w, v2);
+    writer_literal(w, "   )\n");
+    writer_literal(w, "   (\n");
+    write_patch_vertex(w, v3);
+    write_patch_vertex(w, v1);
+    writer_literal(w, "   )\n");
+  }
+  writer_literal(w, "   }\n");
+  writer_literal(w, "  }\n");
+}
+static void write_patches(Bsp *bsp, Writer *w) {
+  double t0 = time_seconds();
+  dmaterial_t *materials = (dmaterial_t*)lump(bsp, LUMP_MATERIALS)->data;
+  DiskCollisionVertex *vertices = lump(bsp, LUMP_COLLISIONVERTS)->data;
+  Patch *patches = collect_patches(bsp);
   // TODO: better way of converting triangles into patches
   for (size_t i = 0; i < buf_size(patches); ++i) {
     Patch *patch = &patches[i];
     if (buf_size(patch->triangles) == 0)
       continue;
-    fprintf(fp, "  {\n");
-    fprintf(fp, "   mesh\n");
-    fprintf(fp, "   {\n");
-    fprintf(fp, "   %s\n", materials[patch->materialIndex].material);
-    // TODO: write contentFlags and contentFlags info
-    fprintf(fp, "   lightmap_gray\n");
-    fprintf(fp, "   %d 2 16 8\n", buf_size(patch->triangles) * 2);
-    for (size_t j = 0; j < buf_size(patch->triangles); ++j) {
-      Triangle *tri = &patch->triangles[j];
-      DiskCollisionVertex *v1 = &vertices[tri->vertex[0]];
-      DiskCollisionVertex *v2 = &vertices[tri->vertex[1]];
-      DiskCollisionVertex *v3 = &vertices[tri->vertex[2]];
-      fprintf(fp, "   (\n");
-      fprintf(fp, "  v %f %f %f t -1024 1024 -4 4\n", v1->xyz[0], v1->xyz[1], v1->xyz[2]);
-      fprintf(fp, "  v %f %f %f t -1024 1024 -4 4\n", v2->xyz[0], v2->xyz[1], v2->xyz[2]);
-      fprintf(fp, "   )\n");
-      fprintf(fp, "   (\n");
-      fprintf(fp, "  v %f %f %f t -1024 1024 -4 4\n", v3->xyz[0], v3->xyz[1], v3->xyz[2]);
-      fprintf(fp, "  v %f %f %f t -1024 1024 -4 4\n", v1->xyz[0], v1->xyz[1], v1->xyz[2]);
-      fprintf(fp,"   )\n");
-    }
-    fprintf(fp, "   }\n");
-    fprintf(fp, "  }\n");
-  }
-}
-void triangle_normal(vec3 n, const vec3 a, const vec3 b, const vec3 c) {
+    write_patch(w, materials[patch->materialIndex].material, vertices, patch->triangles, buf_size(patch->triangles));
+    profile_count(&bsp->profile, PROFILE_TRIANGLE_COUNT, buf_size(patch->triangles));
+  }
+  free_patches(patches);
+  profile_time(&bsp->profile, PROFILE_PATCHES, t0);
+}
+#ifndef BSP_LIBRARY
+static void triangle_normal(vec3 n, const vec3 a, const vec3 b, const vec3 c) {
   vec3 e1, e2;
   vec3_sub(e1, b, a);
   vec3_sub(e2, c, a);
   vec3_mul_cross(n, e1, e2);
   vec3_norm(n, n);
 }
-bool vec3_fuzzy_eq(float *a, float *b) {
+static bool vec3_fuzzy_eq(float *a, float *b) {
   for (size_t k = 0; k < 3; ++k) {
     if (fabs(a[k] - b[k]) > 0.0001)
       return false;
   }
   return true;
 }
-void write_portals(FILE *fp) {
-  DiskGfxPortal *portals = lumpdata[LUMP_PORTALS].data;
-  DiskGfxPortalVertex *vertices = lumpdata[LUMP_PORTALVERTS].data;
-  DiskPlane *planes = (DiskPlane*)lumpdata[LUMP_PLANES].data;
-  int *written = malloc(lumpdata[LUMP_PORTALS].count * sizeof(int));
-  memset(written, -1, lumpdata[LUMP_PORTALS].count * sizeof(int));
-  size_t written_count = 0;
-  for (size_t i = 0; i < lumpdata[LUMP_PORTALS].count; ++i) {
-    DiskGfxPortal *portal = &portals[i];
-    bool found = false;
-    for (size_t k = 0; k < written_count; ++k) {
-      DiskGfxPortal *other = &portals[written[k]];
-      if (other->portalVertexCount != portal->portalVertexCount)
-        continue;
-      size_t match_count = 0;
-      for (size_t g = 0; g < other->portalVertexCount; ++g) {
-        for (size_t h = 0; h < portal->portalVertexCount; ++h) {
-          if (vec3_fuzzy_eq(vertices[portal->firstPortalVertex + h].xyz, vertices[other->firstPortalVertex + g].xyz))
-            ++match_count;
+// Same test as always: every vertex of one portal is within 0.0001 of a vertex of the other.
+static bool portal_vertices_match(DiskGfxPortalVertex *vertices, DiskGfxPortal *portal, DiskGfxPortal *other) {
+  if (other->portalVertexCount != portal->portalVertexCount)
+    return false;
+  size_t match_count = 0;
+  for (size_t g = 0; g < other->portalVertexCount; ++g) {
+    for (size_t h = 0; h < portal->portalVertexCount; ++h) {
+      if (vec3_fuzzy_eq(vertices[portal->firstPortalVertex + h].xyz, vertices[other->firstPortalVertex + g].xyz))
+        ++match_count;
+    }
+  }
+  return match_count == portal->portalVertexCount;
+}
+#define PORTAL_CELL_SIZE 1.0
+// Slightly more than the vertex tolerance, for rounding in the centroid itself.
+#define PORTAL_CENTROID_EPSILON 0.0002
+static void portal_centroid(DiskGfxPortalVertex *vertices, DiskGfxPortal *portal, double *c) {
+  c[0] = c[1] = c[2] = 0.0;
+  for (size_t i = 0; i < portal->portalVertexCount; ++i) {
+    for (int k = 0; k < 3; ++k)
+      c[k] += vertices[portal->firstPortalVertex + i].xyz[k];
+  }
+  for (int k = 0; k < 3; ++k)
+    c[k] /= portal->portalVertexCount ? portal->portalVertexCount : 1;
+}
+static size_t portal_cell_hash(s64 x, s64 y, s64 z, u32 vertex_count) {
+  u64 h = (u64)x * 0x9E3779B97F4A7C15ull ^ (u64)y * 0xC2B2AE3D27D4EB4Full ^ (u64)z * 0x165667B19E3779F9ull;
+  h ^= vertex_count;
+  h ^= h >> 31;
+  return (size_t)(h * 0xD6E8FEB86659FD93ull >> 17);
+}
+// Duplicate portals have their centroids within the tolerance of each other, so written portals are
+// bucketed by quantized centroid and vertex count, and only the cells a centroid +- epsilon can
+// fall into get compared with the exact vertex test.
+typedef struct {
+  int *heads;
+  int *next;
+  size_t mask;
+} PortalHash;
+static bool portal_hash_find(PortalHash *ph, DiskGfxPortal *portals, DiskGfxPortalVertex *vertices, DiskGfxPortal *portal) {
+  double c[3];
+  s64 lo[3], hi[3];
+  portal_centroid(vertices, portal, c);
+  for (int k = 0; k < 3; ++k) {
+    lo[k] = (s64)floor((c[k] - PORTAL_CENTROID_EPSILON) / PORTAL_CELL_SIZE);
+    hi[k] = (s64)floor((c[k] + PORTAL_CENTROID_EPSILON) / PORTAL_CELL_SIZE);
+  }
+  for (s64 x = lo[0]; x <= hi[0]; ++x) {
+    for (s64 y = lo[1]; y <= hi[1]; ++y) {
+      for (s64 z = lo[2]; z <= hi[2]; ++z) {
+        size_t bucket = portal_cell_hash(x, y, z, portal->portalVertexCount) & ph->mask;
+        for (int k = ph->heads[bucket]; k != -1; k = ph->next[k]) {
+          if (portal_vertices_match(vertices, portal, &portals[k]))
+            return true;
         }
       }
-      if (match_count == portal->portalVertexCount) {
-        found = true;
-        break;
-      }
     }
+  }
+  return false;
+}
+static void portal_hash_insert(PortalHash *ph, DiskGfxPortalVertex *vertices, DiskGfxPortal *portal, int index) {
+  double c[3];
+  portal_centroid(vertices, portal, c);
+  s64 cell[3];
+  for (int k = 0; k < 3; ++k)
+    cell[k] = (s64)floor(c[k] / PORTAL_CELL_SIZE);
+  size_t bucket = portal_cell_hash(cell[0], cell[1], cell[2], portal->portalVertexCount) & ph->mask;
+  ph->next[index] = ph->heads[bucket];
+  ph->heads[bucket] = index;
+}
+// Not part of -export, so it stays out of the -profile report.
+static void write_portals(Bsp *bsp, Writer *w) {
+  DiskGfxPortal *portals = lump(bsp, LUMP_PORTALS)->data;
+  DiskGfxPortalVertex *vertices = lump(bsp, LUMP_PORTALVERTS)->data;
+  DiskPlane *planes = (DiskPlane*)lump(bsp, LUMP_PLANES)->data;
+  size_t portal_count = lump(bsp, LUMP_PORTALS)->count;
+  size_t bucket_count = 16;
+  while (bucket_count < portal_count * 2)
+    bucket_count <<= 1;
+  PortalHash ph = {
+    .heads = malloc(bucket_count * sizeof(int)),
+    .next = malloc((portal_count ? portal_count : 1) * sizeof(int)),
+    .mask = bucket_count - 1
+  };
+  memset(ph.heads, -1, bucket_count * sizeof(int));
+  for (size_t i = 0; i < portal_count; ++i) {
+    DiskGfxPortal *portal = &portals[i];
+    bool found = portal_hash_find(&ph, portals, vertices, portal);
     if (found)
       continue;
-    fprintf(fp, "{\n");
-    written[written_count++] = i;
+    writer_literal(w, "{\n");
+    portal_hash_insert(&ph, vertices, portal, i);
     DiskPlane *plane = &planes[portal->planeIndex];
     vec3 portal_normal;
     triangle_normal(portal_normal, vertices[portal->firstPortalVertex].xyz, vertices[portal->firstPortalVertex + 1].xyz, vertices[portal->firstPortalVertex + 2].xyz);
     float portal_distance = vec3_mul_inner(portal_normal, vertices[portal->firstPortalVertex].xyz);
-    write_plane(fp, "portal", portal_normal, portal_distance, (vec3) { 0.f, 0.f, 0.f });
+    write_plane(w, "portal", portal_normal, portal_distance, (vec3) { 0.f, 0.f, 0.f });
     for (int k = 0; k < 3; ++k) {
       portal_normal[k] = -portal_normal[k];
     }
-    write_plane(fp, "portal_nodraw", portal_normal, -portal_distance + 8.f, (vec3) { 0.f, 0.f, 0.f });
+    write_plane(w, "portal_nodraw", portal_normal, -portal_distance + 8.f, (vec3) { 0.f, 0.f, 0.f });
     for (size_t i = 0; i < portal->portalVertexCount; ++i) {
       DiskGfxPortalVertex *a = &vertices[portal->firstPortalVertex + i];
       int next_idx = i + 1 >= portal->portalVertexCount ? 0 : i + 1;
@@ -864,36 +1936,15 @@ void write_portals(FILE *fp) {
       float d = vec3_mul_inner(n, a->xyz);
       for (int k = 0; k < 3; ++k)
         n[k] = -n[k];
-      write_plane(fp, "portal_nodraw", n, -d, (vec3) { 0.f, 0.f, 0.f });
+      write_plane(w, "portal_nodraw", n, -d, (vec3) { 0.f, 0.f, 0.f });
     }
-    fprintf(fp, "}\n");
-  }
-}
-bool ignore_material(const char *material) {
-  static const char *ignored[] = {"portal", "portal_nodraw", NULL};
-  for (size_t i = 0; ignored[i]; ++i) {
-    if (!strcmp(material, ignored[i]))
-      return true;
+    writer_literal(w, "}\n");
   }
-  return false;
+  free(ph.heads);
+  free(ph.next);
 }
-typedef struct {
-  vec3 normal;
-  float distance;
-  char material[256];
-} MapPlane;
-typedef struct {
-  vec3 mins, maxs;
-  MapPlane *planes;
-} MapBrush;
-typedef struct {
-  vec3 *points;
-  uint32_t *indices;
-  vec2 *uvs;
-  MapPlane *plane;
-} Polygon;
-MapBrush *mapbrushes = NULL;
-void map_planes_from_aabb(vec3 mins, vec3 maxs, MapPlane planes[6]) {
+#endif
+static void map_planes_from_aabb(vec3 mins, vec3 maxs, MapPlane planes[6]) {
   planes[0].normal[0] = -1.0f;
   planes[0].normal[1] = 0.0f;
   planes[0].normal[2] = 0.0f;
@@ -919,16 +1970,142 @@ void map_planes_from_aabb(vec3 mins, vec3 maxs, MapPlane planes[6]) {
   planes[5].normal[2] = 1.0f;
   planes[5].distance = maxs[2];
 }
-void load_map_brushes() {
+#ifndef BSP_LIBRARY
+// Half-space test of a point against every plane of a brush: inside when no plane has the point
+// more than epsilon in front of it. All versions stop at the first group of planes that rejects.
+static bool brush_contains_point_scalar(BrushPlanes *bp, const float *p, float epsilon) {
+  for (size_t i = 0; i < bp->count; ++i) {
+    if (bp->nx[i] * p[0] + bp->ny[i] * p[1] + bp->nz[i] * p[2] - bp->d[i] > epsilon)
+      return false;
+  }
+  return true;
+}
+#ifdef BSP_X86
+static bool brush_contains_point_sse(BrushPlanes *bp, const float *p, float epsilon) {
+  __m128 x = _mm_set1_ps(p[0]), y = _mm_set1_ps(p[1]), z = _mm_set1_ps(p[2]);
+  __m128 eps = _mm_set1_ps(epsilon);
+  for (size_t i = 0; i < bp->count; i += 4) {
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(bp->nx + i), x), _mm_mul_ps(_mm_loadu_ps(bp->ny + i), y)),
+                          _mm_mul_ps(_mm_loadu_ps(bp->nz + i), z));
+    d = _mm_sub_ps(d, _mm_loadu_ps(bp->d + i));
+    if (_mm_movemask_ps(_mm_cmpgt_ps(d, eps)))
+      return false;
+  }
+  return true;
+}
+static TARGET_AVX2 bool brush_contains_point_avx2(BrushPlanes *bp, const float *p, float epsilon) {
+  __m256 x = _mm256_set1_ps(p[0]), y = _mm256_set1_ps(p[1]), z = _mm256_set1_ps(p[2]);
+  __m256 eps = _mm256_set1_ps(epsilon);
+  for (size_t i = 0; i < bp->count; i += 8) {
+    __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(bp->nx + i), x),
+                                           _mm256_mul_ps(_mm256_loadu_ps(bp->ny + i), y)),
+                             _mm256_mul_ps(_mm256_loadu_ps(bp->nz + i), z));
+    d = _mm256_sub_ps(d, _mm256_loadu_ps(bp->d + i));
+    if (_mm256_movemask_ps(_mm256_cmp_ps(d, eps, _CMP_GT_OQ)))
+      return false;
+  }
+  return true;
+}
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+  int r[4];
+  __cpuid(r, 1);
+  // The OS has to save the ymm registers too.
+  if (!(r[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(r, 7, 0);
+  return (r[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+// cpu_has_avx2 detected once. Threads racing on the first call store the same answer, the atomics only
+// keep that from being a data race.
+static bool cpu_avx2() {
+  static volatile s32 avx2 = -1;
+#ifdef _WIN32
+  s32 v = InterlockedCompareExchange((volatile LONG*)&avx2, -1, -1);
+  if (v == -1) {
+    v = cpu_has_avx2();
+    InterlockedExchange((volatile LONG*)&avx2, v);
+  }
+#else
+  s32 v = __atomic_load_n(&avx2, __ATOMIC_RELAXED);
+  if (v == -1) {
+    v = cpu_has_avx2();
+    __atomic_store_n(&avx2, v, __ATOMIC_RELAXED);
+  }
+#endif
+  return v;
+}
+#endif
+typedef bool (*BrushContainsPoint)(BrushPlanes *bp, const float *p, float epsilon);
+static BrushContainsPoint brush_contains_point_kernel() {
+#ifdef BSP_X86
+  return cpu_avx2() ? brush_contains_point_avx2 : brush_contains_point_sse;
+#else
+  return brush_contains_point_scalar;
+#endif
+}
+// Needs map_brush_planes_load first.
+static bool brush_contains_point(MapBrush *brush, const float *p, float epsilon) {
+  assert(brush->soa.nx);
+  return brush_contains_point_kernel()(&brush->soa, p, epsilon);
+}
+static void brush_planes_build(Bsp *bsp, BrushPlanes *bp, MapPlane *planes, size_t count) {
+  bp->count = (count + BRUSH_PLANE_LANES - 1) / BRUSH_PLANE_LANES * BRUSH_PLANE_LANES;
+  float *soa = bsp_alloc(bsp, sizeof(float) * bp->count * 4);
+  memset(soa, 0, sizeof(float) * bp->count * 4);
+  bp->nx = soa;
+  bp->ny = soa + bp->count;
+  bp->nz = soa + bp->count * 2;
+  bp->d = soa + bp->count * 3;
+  for (size_t i = 0; i < count; ++i) {
+    bp->nx[i] = planes[i].normal[0];
+    bp->ny[i] = planes[i].normal[1];
+    bp->nz[i] = planes[i].normal[2];
+    bp->d[i] = planes[i].distance;
+  }
+}
+#endif
+// Every brush has its 6 axial sides first, then planes from the planes lump. Checked before
+// anything is loaded, so a bad map fails without a half-built brush list.
+static void map_brushes_check(Bsp *bsp) {
+  LumpData *brushes = lump(bsp, LUMP_BRUSHES);
+  LumpData *sides = lump(bsp, LUMP_BRUSHSIDES);
+  size_t plane_count = lump(bsp, LUMP_PLANES)->count;
+  size_t material_count = lump(bsp, LUMP_MATERIALS)->count;
   size_t side_offset = 0;
-  LumpData *brushes = &lumpdata[LUMP_BRUSHES];
-  cbrushside_t *brushsides = (cbrushside_t*)lumpdata[LUMP_BRUSHSIDES].data;
-  dmaterial_t *materials = (dmaterial_t*)lumpdata[LUMP_MATERIALS].data;
-  DiskPlane *diskplanes = (DiskPlane*)lumpdata[LUMP_PLANES].data;
   for (size_t i = 0; i < brushes->count; ++i) {
-    MapBrush dst = { 0 };
+    DiskBrush *brush = &((DiskBrush*)brushes->data)[i];
+    if (brush->numSides < 6)
+      bsp_error(bsp, "Brush %zu has %d sides, fewer than its 6 axial ones", i, brush->numSides);
+    if (side_offset + brush->numSides > sides->count)
+      bsp_error(bsp, "Brush %zu has sides out of bounds", i);
+    for (size_t k = 0; k < brush->numSides; ++k) {
+      cbrushside_t *side = &((cbrushside_t*)sides->data)[side_offset + k];
+      if (side->materialNum < 0 || (size_t)side->materialNum >= material_count)
+        bsp_error(bsp, "Brush side %zu has an invalid material", side_offset + k);
+      if (k >= 6 && (side->plane < 0 || (size_t)side->plane >= plane_count))
+        bsp_error(bsp, "Brush side %zu has an invalid plane", side_offset + k);
+    }
+    side_offset += brush->numSides;
+  }
+}
+static void load_map_brushes(Bsp *bsp) {
+  double t0 = time_seconds();
+  map_brushes_check(bsp);
+  size_t side_offset = 0;
+  LumpData *brushes = lump(bsp, LUMP_BRUSHES);
+  cbrushside_t *brushsides = (cbrushside_t*)lump(bsp, LUMP_BRUSHSIDES)->data;
+  DiskPlane *diskplanes = (DiskPlane*)lump(bsp, LUMP_PLANES)->data;
+  bsp->mapbrushes = bsp_alloc(bsp, sizeof(MapBrush) * brushes->count);
+  bsp->mapbrush_count = brushes->count;
+  for (size_t i = 0; i < brushes->count; ++i) {
+    MapBrush *dst = &bsp->mapbrushes[i];
     DiskBrush *src = &((DiskBrush*)brushes->data)[i];
-    cbrushside_t *sides = &brushsides[side_offset];
+    dst->soa = (BrushPlanes) {0};
     size_t numsides = src->numSides - 6;
     s32 axialMaterialNum[6] = {0};
     for (size_t axis = 0; axis < 3; axis++) {
@@ -941,268 +2118,3358 @@ void load_map_brushes() {
         axialMaterialNum[sign + axis * 2] = brushsides[side_offset].materialNum;
         float f = u.f;
         if (sign) {
-          dst.maxs[axis] = f;
+          dst->maxs[axis] = f;
         } else {
-          dst.mins[axis] = f;
+          dst->mins[axis] = f;
         }
         ++side_offset;
       }
     }
-    MapPlane axial_planes[6];
-    map_planes_from_aabb(dst.mins, dst.maxs, axial_planes);
-    for (size_t h = 0; h < 6; ++h) {
-      MapPlane *plane = &axial_planes[h];
-      snprintf(plane->material, sizeof(plane->material), "%s", materials[axialMaterialNum[h]].material);
-      buf_push(dst.planes, *plane);
+    dst->plane_count = 6 + numsides;
+    dst->planes = bsp_alloc(bsp, sizeof(MapPlane) * dst->plane_count);
+    map_planes_from_aabb(dst->mins, dst->maxs, dst->planes);
+    for (size_t h = 0; h < 6; ++h)
+      dst->planes[h].material = axialMaterialNum[h];
+    for (size_t k = 0; k < numsides; ++k) {
+      cbrushside_t *side = &brushsides[side_offset + k];
+      DiskPlane *diskplane = &diskplanes[side->plane];
+      MapPlane *plane = &dst->planes[6 + k];
+      plane->distance = diskplane->dist;
+      plane->material = side->materialNum;
+      vec3_dup(plane->normal, diskplane->normal);
+    }
+    side_offset += numsides;
+  }
+  profile_count(&bsp->profile, PROFILE_BRUSH_COUNT, brushes->count);
+  profile_count(&bsp->profile, PROFILE_SIDE_COUNT, side_offset);
+  profile_time(&bsp->profile, PROFILE_BRUSHES, t0);
+}
+#ifndef BSP_LIBRARY
+// The SoA planes are only for the point queries of -classify, so exporting doesn't pay for them.
+static void map_brush_planes_load(Bsp *bsp) {
+  if (!bsp->mapbrushes)
+    load_map_brushes(bsp);
+  for (size_t i = 0; i < bsp->mapbrush_count; ++i) {
+    MapBrush *brush = &bsp->mapbrushes[i];
+    if (!brush->soa.nx)
+      brush_planes_build(bsp, &brush->soa, brush->planes, brush->plane_count);
+  }
+}
+#endif
+#define WINDING_EXTENT 262144.0
+#define CLIP_EPSILON 0.008
+#define POINT_EPSILON 0.001
+enum {
+  SIDE_FRONT,
+  SIDE_BACK,
+  SIDE_ON
+};
+typedef double dvec3[3];
+// A quad on the plane that is larger than any map, to be cut down to the face by the other planes.
+static void base_winding(dvec3 *w, vec3 normal, float dist) {
+  int axis = 0;
+  for (int k = 1; k < 3; ++k) {
+    if (fabs(normal[k]) > fabs(normal[axis]))
+      axis = k;
+  }
+  dvec3 n = { normal[0], normal[1], normal[2] };
+  dvec3 up = { 0, 0, 0 };
+  up[axis == 2 ? 0 : 2] = 1.0;
+  double d = up[0] * n[0] + up[1] * n[1] + up[2] * n[2];
+  for (int k = 0; k < 3; ++k)
+    up[k] -= n[k] * d;
+  double len = sqrt(up[0] * up[0] + up[1] * up[1] + up[2] * up[2]);
+  dvec3 right = {
+    up[1] * n[2] - up[2] * n[1],
+    up[2] * n[0] - up[0] * n[2],
+    up[0] * n[1] - up[1] * n[0]
+  };
+  for (int k = 0; k < 3; ++k) {
+    double org = n[k] * dist;
+    double u = up[k] / len * WINDING_EXTENT;
+    double r = right[k] / len * WINDING_EXTENT;
+    w[0][k] = org - r + u;
+    w[1][k] = org + r + u;
+    w[2][k] = org + r - u;
+    w[3][k] = org - r - u;
+  }
+}
+// Keeps the part of the winding behind the plane (inside the brush). Points within CLIP_EPSILON
+// of the plane count as on it, matching the tolerance the vertex test used to have.
+static size_t clip_winding(dvec3 *out, dvec3 *in, size_t count, MapPlane *plane, double *dists, int *sides) {
+  size_t counts[3] = { 0 };
+  for (size_t i = 0; i < count; ++i) {
+    double d = plane->normal[0] * in[i][0] + plane->normal[1] * in[i][1] + plane->normal[2] * in[i][2] - plane->distance;
+    dists[i] = d;
+    sides[i] = d > CLIP_EPSILON ? SIDE_FRONT : (d < -CLIP_EPSILON ? SIDE_BACK : SIDE_ON);
+    ++counts[sides[i]];
+  }
+  if (!counts[SIDE_FRONT]) {
+    memcpy(out, in, sizeof(dvec3) * count);
+    return count;
+  }
+  if (!counts[SIDE_BACK])
+    return 0;
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t next = i + 1 == count ? 0 : i + 1;
+    if (sides[i] != SIDE_FRONT)
+      memcpy(out[n++], in[i], sizeof(dvec3));
+    if (sides[i] == SIDE_ON || sides[next] == SIDE_ON || sides[i] == sides[next])
+      continue;
+    double t = dists[i] / (dists[i] - dists[next]);
+    for (int k = 0; k < 3; ++k) {
+      // Keep axial coordinates exact.
+      if (plane->normal[k] == 1.f)
+        out[n][k] = plane->distance;
+      else if (plane->normal[k] == -1.f)
+        out[n][k] = -plane->distance;
+      else
+        out[n][k] = in[i][k] + t * (in[next][k] - in[i][k]);
+    }
+    ++n;
+  }
+  return n;
+}
+// Builds each face by clipping a base winding for its plane by all the other planes of the brush,
+// O(n^2) per brush. The points of each polygon come out in winding order, with fan triangle indices.
+// Polygons, their points and the scratch windings all come from the arena. Returns the polygon count,
+// or POLYGONIZE_OUT_OF_MEMORY when the arena runs out.
+#define POLYGONIZE_OUT_OF_MEMORY SIZE_MAX
+static size_t polygonize_brush(MapBrush *brush, Arena *arena, Polygon **polygons_out) {
+  size_t plane_count = brush->plane_count;
+  Polygon *polygons = arena_alloc(arena, sizeof(Polygon) * plane_count);
+  size_t polygon_count = 0;
+  // Every clip adds at most one point to a winding.
+  size_t max_points = plane_count + 4;
+  dvec3 *windings = arena_alloc(arena, sizeof(dvec3) * max_points * 2);
+  double *dists = arena_alloc(arena, sizeof(double) * max_points);
+  int *sides = arena_alloc(arena, sizeof(int) * max_points);
+  if (!polygons || !windings || !dists || !sides)
+    return POLYGONIZE_OUT_OF_MEMORY;
+  for (size_t i = 0; i < plane_count; ++i) {
+    MapPlane *p0 = &brush->planes[i];
+    dvec3 *w = windings;
+    dvec3 *tmp = windings + max_points;
+    base_winding(w, p0->normal, p0->distance);
+    size_t count = 4;
+    for (size_t j = 0; j < plane_count && count; ++j) {
+      if (j == i)
+        continue;
+      count = clip_winding(tmp, w, count, &brush->planes[j], dists, sides);
+      dvec3 *swap = w;
+      w = tmp;
+      tmp = swap;
+    }
+    if (count < 3)
+      continue;
+    Polygon *polygon = &polygons[polygon_count];
+    memset(polygon, 0, sizeof(*polygon));
+    polygon->plane = p0;
+    polygon->points = arena_alloc(arena, sizeof(vec3) * count);
+    if (!polygon->points)
+      return POLYGONIZE_OUT_OF_MEMORY;
+    size_t n = 0;
+    for (size_t k = 0; k < count; ++k) {
+      if (n > 0) {
+        float *prev = polygon->points[n - 1];
+        double dx = w[k][0] - prev[0], dy = w[k][1] - prev[1], dz = w[k][2] - prev[2];
+        if (dx * dx + dy * dy + dz * dz < POINT_EPSILON * POINT_EPSILON)
+          continue;
+      }
+      for (int m = 0; m < 3; ++m)
+        polygon->points[n][m] = (float)w[k][m];
+      ++n;
+    }
+    if (n > 1) {
+      vec3 v;
+      vec3_sub(v, polygon->points[0], polygon->points[n - 1]);
+      if (vec3_len(v) < POINT_EPSILON)
+        --n;
+    }
+    if (n < 3)
+      continue;
+    polygon->point_count = n;
+    polygon->index_count = (n - 2) * 3;
+    polygon->indices = arena_alloc(arena, sizeof(uint32_t) * polygon->index_count);
+    if (!polygon->indices)
+      return POLYGONIZE_OUT_OF_MEMORY;
+    for (uint32_t k = 1; k + 1 < n; ++k) {
+      polygon->indices[(k - 1) * 3 + 0] = 0;
+      polygon->indices[(k - 1) * 3 + 1] = k;
+      polygon->indices[(k - 1) * 3 + 2] = k + 1;
+    }
+    ++polygon_count;
+  }
+  *polygons_out = polygons;
+  return polygon_count;
+}
+typedef struct {
+  Bsp *bsp;
+  dmaterial_t *materials;
+  dmodel_t *model;
+  float *origin;
+  size_t first;
+  Writer *chunks;
+  bool *failed; // per chunk, out of memory
+} BrushChunks;
+// Small enough that a brush's scratch block stays below malloc's mmap threshold.
+#define BRUSH_ARENA_BLOCK_SIZE (64 << 10)
+static void write_brush_chunk(void *ctx, size_t index) {
+  BrushChunks *bc = ctx;
+  Writer *out = &bc->chunks[index];
+  size_t brush_index = bc->model->firstBrush + bc->first + index;
+  writer_literal(out, "{\n");
+  BrushCache *cache = &bc->bsp->brush_cache;
+  if (cache->loaded) {
+    CachedBrush *brush = &cache->brushes[brush_index];
+    for (size_t j = 0; j < brush->face_count; ++j) {
+      CachedFace *face = &cache->faces[brush->first_face + j];
+      write_plane(out, bc->materials[face->material].material, face->normal, face->distance, bc->origin);
+    }
+    writer_literal(out, "}\n");
+    return;
+  }
+  MapBrush *brush = &bc->bsp->mapbrushes[brush_index];
+  Arena scratch = { .block_size = BRUSH_ARENA_BLOCK_SIZE };
+  Polygon *polys;
+  double t0 = time_seconds();
+  size_t count = polygonize_brush(brush, &scratch, &polys);
+  profile_time(&bc->bsp->profile, PROFILE_POLYGONIZE, t0);
+  if (count == POLYGONIZE_OUT_OF_MEMORY) {
+    bc->failed[index] = true;
+    arena_free(&scratch);
+    return;
+  }
+  profile_count(&bc->bsp->profile, PROFILE_POLYGON_COUNT, count);
+  for (size_t j = 0; j < count; ++j) {
+    MapPlane *plane = polys[j].plane;
+    write_plane(out, bc->materials[plane->material].material, plane->normal, plane->distance, bc->origin);
+  }
+  arena_free(&scratch);
+  writer_literal(out, "}\n");
+}
+#define BRUSH_CHUNK_WINDOW 4096
+// Brushes are polygonized and formatted in parallel, each into its own chunk. The chunks are
+// written out in brush order, so the output matches a serial export byte for byte. Working
+// through a window of brushes at a time keeps the number of chunks held in memory bounded.
+// Returns false, with nothing written past the last whole window, when a brush runs out of memory.
+static bool write_brushes(Bsp *bsp, Writer *w, dmodel_t *model, vec3 origin) {
+  Writer chunks[BRUSH_CHUNK_WINDOW];
+  bool failed[BRUSH_CHUNK_WINDOW];
+  BrushChunks bc = { .bsp = bsp, .model = model, .origin = origin, .chunks = chunks, .failed = failed };
+  bc.materials = lump(bsp, LUMP_MATERIALS)->data;
+  // One set of threads for all the windows.
+  ThreadPool pool;
+  thread_pool_start(&pool, bsp->threads, model->numBrushes < BRUSH_CHUNK_WINDOW ? model->numBrushes : BRUSH_CHUNK_WINDOW);
+  bool ok = true;
+  for (bc.first = 0; ok && bc.first < model->numBrushes; bc.first += BRUSH_CHUNK_WINDOW) {
+    size_t count = model->numBrushes - bc.first;
+    if (count > BRUSH_CHUNK_WINDOW)
+      count = BRUSH_CHUNK_WINDOW;
+    memset(chunks, 0, sizeof(Writer) * count);
+    memset(failed, 0, sizeof(bool) * count);
+    thread_pool_run(&pool, count, write_brush_chunk, &bc);
+    for (size_t i = 0; i < count; ++i)
+      ok = ok && !failed[i];
+    for (size_t i = 0; i < count; ++i) {
+      if (ok)
+        writer_write(w, chunks[i].data, buf_size(chunks[i].data));
+      writer_free(&chunks[i]);
+    }
+  }
+  thread_pool_stop(&pool);
+  return ok;
+}
+// 64-bit hash of a byte range, 8 bytes per step with a murmur style finalizer. Not cryptographic,
+// only meant to tell maps apart by content.
+static u64 hash_bytes(const void *data, size_t size, u64 seed) {
+  const u8 *p = data;
+  u64 h = seed ^ (size * 0x9E3779B97F4A7C15ull);
+  for (; size >= 8; p += 8, size -= 8) {
+    u64 k;
+    memcpy(&k, p, 8);
+    k *= 0x87C37B91114253D5ull;
+    k = (k << 31) | (k >> 33);
+    h ^= k * 0x4CF5AD432745937Full;
+    h = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+  }
+  if (size) {
+    u64 k = 0;
+    memcpy(&k, p, size);
+    k *= 0x87C37B91114253D5ull;
+    k = (k << 31) | (k >> 33);
+    h ^= k * 0x4CF5AD432745937Full;
+  }
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return h;
+}
+// Big ranges are hashed in HASH_CHUNK_SIZE chunks, in parallel, and the hash of a range is the hash
+// of its chunk hashes. Any chunk aligned part of a range, like a lightmap page, can then be hashed
+// from the same chunk hashes, and equal chunks can be counted across files.
+#define HASH_CHUNK_SIZE (64 << 10)
+typedef struct {
+  const u8 *data;
+  size_t size;
+} ByteRange;
+typedef struct {
+  ByteRange *chunks;
+  u64 *hashes;
+} HashChunkJobs;
+static void hash_chunk_job(void *ctx, size_t index) {
+  HashChunkJobs *jobs = ctx;
+  jobs->hashes[index] = hash_bytes(jobs->chunks[index].data, jobs->chunks[index].size, 0);
+}
+static size_t hash_chunk_count(size_t size) {
+  return (size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+}
+static u64 hash_chunk_hashes(const u64 *chunk_hashes, size_t count, u64 size) {
+  return hash_bytes(chunk_hashes, count * sizeof(u64), size);
+}
+// Hashes ranges[i] into hashes[i], with the chunks of all ranges spread over the threads. Returns
+// the chunk hashes of all ranges in order, to be freed by the caller.
+static u64 *hash_ranges(const ByteRange *ranges, size_t count, u64 *hashes, size_t threads) {
+  size_t chunk_count = 0;
+  for (size_t i = 0; i < count; ++i)
+    chunk_count += hash_chunk_count(ranges[i].size);
+  HashChunkJobs jobs = { malloc(sizeof(ByteRange) * chunk_count + 1), malloc(sizeof(u64) * chunk_count + 1) };
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t offset = 0; offset < ranges[i].size; offset += HASH_CHUNK_SIZE) {
+      size_t size = ranges[i].size - offset;
+      jobs.chunks[n++] = (ByteRange) { ranges[i].data + offset, size < HASH_CHUNK_SIZE ? size : HASH_CHUNK_SIZE };
+    }
+  }
+  parallel_for(chunk_count, threads, hash_chunk_job, &jobs);
+  n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t chunks = hash_chunk_count(ranges[i].size);
+    hashes[i] = hash_chunk_hashes(&jobs.hashes[n], chunks, ranges[i].size);
+    n += chunks;
+  }
+  free(jobs.chunks);
+  return jobs.hashes;
+}
+// Brushes are polygonized and patch triangles deduplicated once per distinct set of source lumps,
+// and kept in <dir>/<key>.bspcache. Later exports of the same map map that file and only format it.
+#define BRUSH_CACHE_MAGIC "BSPCACHE"
+#define BRUSH_CACHE_VERSION 2
+#define BRUSH_CACHE_ALIGN(x) (((x) + 7) & ~(u64)7)
+// Patches are always cached, so a cache written with -exclude_patches also serves exports without it.
+static const u64 brush_cache_lumps = brush_lumps | patch_lumps;
+static u64 brush_cache_key(Bsp *bsp) {
+  ByteRange ranges[LUMP_MAX];
+  u64 hashes[LUMP_MAX];
+  size_t count = 0;
+  for (int type = 0; type < LUMP_MAX; ++type) {
+    if (!(brush_cache_lumps & LUMP_BIT(type)))
+      continue;
+    LumpData *ld = lump(bsp, type);
+    ranges[count++] = (ByteRange) { ld->data, ld->count * lumpsizes[type] };
+  }
+  free(hash_ranges(ranges, count, hashes, bsp->threads));
+  return hash_bytes(hashes, sizeof(u64) * count, BRUSH_CACHE_VERSION);
+}
+static void brush_cache_attach(BrushCache *c, u8 *data) {
+  BrushCacheHeader *h = (BrushCacheHeader*)data;
+  c->brushes = (CachedBrush*)(data + h->brushes_offset);
+  c->faces = (CachedFace*)(data + h->faces_offset);
+  c->patches = (CachedPatch*)(data + h->patches_offset);
+  c->triangles = (Triangle*)(data + h->triangles_offset);
+  c->brush_count = h->brush_count;
+  c->patch_count = h->patch_count;
+}
+static bool brush_cache_section(const BrushCacheHeader *h, u64 offset, u64 count, size_t stride) {
+  return offset % 8 == 0 && offset <= h->size && count <= (h->size - offset) / stride;
+}
+// Checks the checksum and everything the export is going to index, so a stale or damaged file gets
+// rebuilt rather than read out of bounds.
+static bool brush_cache_validate(Bsp *bsp, BrushCache *c, u8 *data, size_t size, u64 key) {
+  BrushCacheHeader *h = (BrushCacheHeader*)data;
+  if (size < sizeof(*h) || memcmp(h->magic, BRUSH_CACHE_MAGIC, 8) || h->version != BRUSH_CACHE_VERSION
+     || h->key != key || h->size != size)
+    return false;
+  if (hash_bytes(data + sizeof(*h), size - sizeof(*h), key) != h->checksum)
+    return false;
+  if (!brush_cache_section(h, h->brushes_offset, h->brush_count, sizeof(CachedBrush))
+     || !brush_cache_section(h, h->faces_offset, h->face_count, sizeof(CachedFace))
+     || !brush_cache_section(h, h->patches_offset, h->patch_count, sizeof(CachedPatch))
+     || !brush_cache_section(h, h->triangles_offset, h->triangle_count, sizeof(Triangle)))
+    return false;
+  if (h->brush_count != lump(bsp, LUMP_BRUSHES)->count)
+    return false;
+  brush_cache_attach(c, data);
+  size_t material_count = lump(bsp, LUMP_MATERIALS)->count;
+  size_t vertex_count = lump(bsp, LUMP_COLLISIONVERTS)->count;
+  for (size_t i = 0; i < h->brush_count; ++i) {
+    if ((u64)c->brushes[i].first_face + c->brushes[i].face_count > h->face_count)
+      return false;
+  }
+  for (size_t i = 0; i < h->face_count; ++i) {
+    CachedFace *f = &c->faces[i];
+    if ((u32)f->material >= material_count)
+      return false;
+  }
+  for (size_t i = 0; i < h->patch_count; ++i) {
+    CachedPatch *p = &c->patches[i];
+    if ((u64)p->first_triangle + p->triangle_count > h->triangle_count || (u32)p->material >= material_count)
+      return false;
+  }
+  for (size_t i = 0; i < h->triangle_count; ++i) {
+    s32 *v = c->triangles[i].vertex;
+    if ((u32)v[0] >= vertex_count || (u32)v[1] >= vertex_count || (u32)v[2] >= vertex_count)
+      return false;
+  }
+  return true;
+}
+typedef struct {
+  Bsp *bsp;
+  CachedFace **faces; // per brush
+  u32 *face_counts;
+} BrushCacheJobs;
+static void brush_cache_job(void *ctx, size_t index) {
+  BrushCacheJobs *jobs = ctx;
+  Arena scratch = { .block_size = BRUSH_ARENA_BLOCK_SIZE };
+  Polygon *polys;
+  double t0 = time_seconds();
+  size_t count = polygonize_brush(&jobs->bsp->mapbrushes[index], &scratch, &polys);
+  profile_time(&jobs->bsp->profile, PROFILE_POLYGONIZE, t0);
+  // A brush left without faces tells brush_cache_build it ran out of memory.
+  if (count == POLYGONIZE_OUT_OF_MEMORY) {
+    arena_free(&scratch);
+    return;
+  }
+  profile_count(&jobs->bsp->profile, PROFILE_POLYGON_COUNT, count);
+  CachedFace *faces = malloc(sizeof(CachedFace) * count + 1);
+  for (size_t i = 0; i < count; ++i) {
+    MapPlane *plane = polys[i].plane;
+    CachedFace *f = &faces[i];
+    vec3_dup(f->normal, plane->normal);
+    f->distance = plane->distance;
+    f->material = plane->material;
+  }
+  arena_free(&scratch);
+  jobs->faces[index] = faces;
+  jobs->face_counts[index] = count;
+}
+// Does the work a cold export would, in parallel across brushes, and lays the result out as the file.
+static void brush_cache_build(Bsp *bsp, BrushCache *c, u64 key) {
+  if (!bsp->mapbrushes)
+    load_map_brushes(bsp);
+  size_t brush_count = bsp->mapbrush_count;
+  BrushCacheJobs jobs = { .bsp = bsp };
+  jobs.faces = calloc(brush_count + 1, sizeof(CachedFace*));
+  jobs.face_counts = calloc(brush_count + 1, sizeof(u32));
+  parallel_for(brush_count, bsp->threads, brush_cache_job, &jobs);
+  for (size_t i = 0; i < brush_count; ++i) {
+    if (!jobs.faces[i]) {
+      for (size_t j = 0; j < brush_count; ++j)
+        free(jobs.faces[j]);
+      free(jobs.faces);
+      free(jobs.face_counts);
+      bsp_error(bsp, "Out of memory polygonizing brush %zu", i);
+    }
+  }
+  Patch *patches = collect_patches(bsp);
+  BrushCacheHeader h = { .version = BRUSH_CACHE_VERSION, .key = key, .brush_count = brush_count };
+  memcpy(h.magic, BRUSH_CACHE_MAGIC, 8);
+  for (size_t i = 0; i < brush_count; ++i)
+    h.face_count += jobs.face_counts[i];
+  for (size_t i = 0; i < buf_size(patches); ++i) {
+    if (buf_size(patches[i].triangles) == 0)
+      continue;
+    ++h.patch_count;
+    h.triangle_count += buf_size(patches[i].triangles);
+  }
+  h.brushes_offset = BRUSH_CACHE_ALIGN(sizeof(h));
+  h.faces_offset = BRUSH_CACHE_ALIGN(h.brushes_offset + h.brush_count * sizeof(CachedBrush));
+  h.patches_offset = BRUSH_CACHE_ALIGN(h.faces_offset + h.face_count * sizeof(CachedFace));
+  h.triangles_offset = BRUSH_CACHE_ALIGN(h.patches_offset + h.patch_count * sizeof(CachedPatch));
+  h.size = BRUSH_CACHE_ALIGN(h.triangles_offset + h.triangle_count * sizeof(Triangle));
+  u8 *data = calloc(1, h.size);
+  memcpy(data, &h, sizeof(h));
+  brush_cache_attach(c, data);
+  u32 first_face = 0;
+  for (size_t i = 0; i < brush_count; ++i) {
+    c->brushes[i] = (CachedBrush) { first_face, jobs.face_counts[i] };
+    memcpy(&c->faces[first_face], jobs.faces[i], sizeof(CachedFace) * jobs.face_counts[i]);
+    first_face += jobs.face_counts[i];
+    free(jobs.faces[i]);
+  }
+  u32 first_triangle = 0;
+  CachedPatch *patch = c->patches;
+  for (size_t i = 0; i < buf_size(patches); ++i) {
+    u32 count = buf_size(patches[i].triangles);
+    if (count == 0)
+      continue;
+    *patch++ = (CachedPatch) { patches[i].materialIndex, first_triangle, count };
+    memcpy(&c->triangles[first_triangle], patches[i].triangles, sizeof(Triangle) * count);
+    first_triangle += count;
+  }
+  free_patches(patches);
+  h.checksum = hash_bytes(data + sizeof(h), h.size - sizeof(h), key);
+  memcpy(data, &h, sizeof(h));
+  free(jobs.faces);
+  free(jobs.face_counts);
+  c->data = data;
+  c->loaded = true;
+}
+// Written under a temporary name and renamed, so nobody maps a partially written file.
+static bool brush_cache_save(BrushCache *c, const char *path) {
+  BrushCacheHeader *h = c->data;
+  char tmp[1024 + 32]; // path and a pid
+#ifdef _WIN32
+  snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+#else
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+#endif
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp)
+    return false;
+  bool ok = fwrite(c->data, 1, h->size, fp) == h->size;
+  ok = !fclose(fp) && ok;
+#ifdef _WIN32
+  ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && !rename(tmp, path);
+#endif
+  if (!ok)
+    remove(tmp);
+  return ok;
+}
+// Maps <dir>/<key>.bspcache, or builds the brushes and patches and writes it when it's missing or
+// doesn't match. Either way the export then reads everything from bsp->brush_cache.
+static void brush_cache_load(Bsp *bsp, FILE *out, const char *dir) {
+  BrushCache *c = &bsp->brush_cache;
+  u64 key = brush_cache_key(bsp);
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%016llx.bspcache", dir, (unsigned long long)key);
+  if (!file_mapping_open(&c->fm, path)) {
+    if (brush_cache_validate(bsp, c, c->fm.data, c->fm.size, key)) {
+      c->loaded = true;
+      fprintf(out, "Using brush cache '%s'\n", path);
+      return;
+    }
+    file_mapping_close(&c->fm);
+  }
+  brush_cache_build(bsp, c, key);
+  if (brush_cache_save(c, path))
+    fprintf(out, "Wrote brush cache '%s'\n", path);
+  else
+    fprintf(out, "Failed to write brush cache '%s'\n", path);
+}
+static void write_world_patches(Bsp *bsp, Writer *w) {
+  BrushCache *cache = &bsp->brush_cache;
+  if (!cache->loaded) {
+    write_patches(bsp, w);
+    return;
+  }
+  double t0 = time_seconds();
+  dmaterial_t *materials = lump(bsp, LUMP_MATERIALS)->data;
+  DiskCollisionVertex *vertices = lump(bsp, LUMP_COLLISIONVERTS)->data;
+  for (size_t i = 0; i < cache->patch_count; ++i) {
+    CachedPatch *patch = &cache->patches[i];
+    write_patch(w, materials[patch->material].material, vertices, &cache->triangles[patch->first_triangle],
+                patch->triangle_count);
+    profile_count(&bsp->profile, PROFILE_TRIANGLE_COUNT, patch->triangle_count);
+  }
+  profile_time(&bsp->profile, PROFILE_PATCHES, t0);
+}
+static void write_keyvalue(Writer *w, KeyValuePair *kvp) {
+  writer_literal(w, "\"");
+  writer_string(w, kvp->key);
+  writer_literal(w, "\" \"");
+  writer_string(w, kvp->value);
+  writer_literal(w, "\"\n");
+}
+// The model of each entity with brushes, from its "*N" model key, -1 for entities without. Fails
+// on models the export would index out of bounds, before any output exists. A brush entity
+// without a valid model key, like a trigger_radius, is exported as a point entity.
+static s32 *export_entity_models(Bsp *bsp, FILE *out) {
+  Entity *entities = bsp->entities;
+  size_t entity_count = buf_size(entities);
+  LumpData *models = lump(bsp, LUMP_MODELS);
+  size_t brush_count = lump(bsp, LUMP_BRUSHES)->count;
+  if (!entity_count)
+    bsp_error(bsp, "No entities to export");
+  if (!models->count)
+    bsp_error(bsp, "No models to export");
+  for (size_t i = 0; i < models->count; ++i) {
+    dmodel_t *model = &((dmodel_t*)models->data)[i];
+    if ((u64)model->firstBrush + model->numBrushes > brush_count)
+      bsp_error(bsp, "Model %zu has brushes out of bounds", i);
+  }
+  EntityIndex *ix = &bsp->entity_index;
+  s32 model_key = entity_key_id(ix, "model");
+  // Decided once per distinct classname rather than once per entity.
+  bool *brush_classes = calloc(buf_size(ix->classnames.strings) + 1, sizeof(bool));
+  const s32 *triggers;
+  size_t trigger_count = classnames_with_prefix(ix, "trigger_", &triggers);
+  for (size_t i = 0; i < trigger_count; ++i)
+    brush_classes[triggers[i]] = true;
+  s32 script_brushmodel = string_table_find(&ix->classnames, "script_brushmodel");
+  if (script_brushmodel != -1)
+    brush_classes[script_brushmodel] = true;
+  s32 *entity_models = malloc(sizeof(s32) * entity_count);
+  entity_models[0] = 0;
+  for (size_t i = 1; i < entity_count; ++i) {
+    entity_models[i] = -1;
+    if (!brush_classes[ix->classname_of[i]])
+      continue;
+    const char *modelstr = entity_value(ix, i, model_key);
+    int modelidx = -1, end = 0;
+    if (sscanf(modelstr, "*%d%n", &modelidx, &end) != 1 || modelstr[end] || modelidx < 0
+        || (size_t)modelidx >= models->count) {
+      if (*modelstr)
+        fprintf(out, "Entity %zu has model '%s', not one of the %zu models, exporting it without brushes\n",
+                i, modelstr, models->count);
+      continue;
+    }
+    entity_models[i] = modelidx;
+  }
+  free(brush_classes);
+  return entity_models;
+}
+static bool export_to_map(Bsp *bsp, FILE *out, ProgramOptions *opts, const char *path) {
+  double t0 = time_seconds();
+  Entity *entities = bsp->entities;
+  if (!opts->exclude_patches && !bsp->brush_cache.loaded)
+    patches_check(bsp);
+  s32 *entity_models = export_entity_models(bsp, out);
+  FILE *mapfile = NULL;
+  mapfile = fopen(path, "w");
+  if (!mapfile) {
+    fprintf(out, "Failed to open '%s'\n", path);
+    free(entity_models);
+    return false;
+  }
+  fprintf(out, "Exporting to '%s'\n", path);
+  Writer w = { .fp = mapfile, .profile = &bsp->profile };
+  Entity *worldspawn = &entities[0];
+  writer_literal(&w, "iwmap 4\n");
+  writer_literal(&w, "// entity 0\n{\n");
+  for (size_t i = 0; i < buf_size(worldspawn->keyvalues); ++i) {
+    KeyValuePair *kvp = &worldspawn->keyvalues[i];
+    write_keyvalue(&w, kvp);
+  }
+  dmodel_t *models = lump(bsp, LUMP_MODELS)->data;
+  bool written = write_brushes(bsp, &w, &models[0], (vec3) { 0.f, 0.f, 0.f });
+  if (written && !opts->exclude_patches) {
+    write_world_patches(bsp, &w);
+  }
+  writer_literal(&w, "}\n");
+  EntityIndex *ix = &bsp->entity_index;
+  s32 model_key = entity_key_id(ix, "model");
+  s32 origin_key = entity_key_id(ix, "origin");
+  for (size_t i = 1; written && i < buf_size(entities); ++i) {
+    Entity *e = &entities[i];
+    writer_literal(&w, "// entity ");
+    writer_int(&w, i);
+    writer_literal(&w, "\n{\n");
+    bool has_brushes = entity_models[i] >= 0;
+    for (size_t j = 0; j < buf_size(e->keyvalues); ++j) {
+      KeyValuePair *kvp = &e->keyvalues[j];
+      if (has_brushes) {
+        if (kvp->key_id == origin_key || kvp->key_id == model_key)
+          continue;
+      }
+      write_keyvalue(&w, kvp);
+    }
+    if (has_brushes) {
+      vec3 origin = {0};
+      const char *originstr = entity_value(ix, i, origin_key);
+      if (originstr) {
+        sscanf(originstr, "%f %f %f", &origin[0], &origin[1], &origin[2]);
+      }
+      written = write_brushes(bsp, &w, &models[entity_models[i]], origin);
+    }
+    writer_literal(&w, "}\n");
+  }
+  free(entity_models);
+  writer_free(&w);
+  double t1 = time_seconds();
+  fclose(mapfile);
+  profile_time(&bsp->profile, PROFILE_IO, t1);
+  profile_time(&bsp->profile, PROFILE_EXPORT, t0);
+  if (!written)
+    bsp_error(bsp, "Out of memory polygonizing brushes for '%s'", path);
+  return true;
+}
+static u64 export_lump_set(ProgramOptions *opts) {
+  return export_lumps | (opts->exclude_patches && !opts->cache_dir ? 0 : patch_lumps);
+}
+// Loads what the export needs that isn't loaded yet, then exports. Each step only runs once per
+// Bsp, so a map can be exported again without leaking the first run's brushes or cache.
+static bool export_map_file(Bsp *bsp, FILE *out, ProgramOptions *opts, const char *path) {
+  if (!bsp->entities)
+    bsp_load_entities(bsp);
+  if (!bsp->brush_cache.loaded) {
+    if (opts->cache_dir)
+      brush_cache_load(bsp, out, opts->cache_dir);
+    else if (!bsp->mapbrushes)
+      load_map_brushes(bsp);
+  }
+  return export_to_map(bsp, out, opts, path);
+}
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+// The library API from bsp.h. Each call catches errors for its duration through on_error and puts
+// back whatever target was there before, so the tool's own setjmp in process_map keeps working.
+#define D3DBSP_ALL_LUMPS (LUMP_BIT(LUMP_MAX) - 1)
+Bsp *d3dbsp_open(const char *path, const BspOpenOptions *options, char *error, size_t error_size) {
+  Bsp *volatile bsp = calloc(1, sizeof(Bsp));
+  jmp_buf on_error;
+  bsp->on_error = &on_error;
+  bsp->threads = options ? options->threads : 0;
+  if (setjmp(on_error)) {
+    if (error && error_size)
+      snprintf(error, error_size, "%s", bsp->error);
+    bsp_close(bsp);
+    free(bsp);
+    return NULL;
+  }
+  bsp_open(bsp, path, options && options->use_mmap, D3DBSP_ALL_LUMPS);
+  bsp->on_error = NULL;
+  return bsp;
+}
+const void *d3dbsp_lump(Bsp *bsp, int type, size_t *count, size_t *element_size) {
+  *count = 0;
+  if (element_size)
+    *element_size = type >= 0 && type < LUMP_MAX ? lumpsizes[type] : 0;
+  if (type < 0 || type >= LUMP_MAX) {
+    snprintf(bsp->error, sizeof(bsp->error), "No lump %d", type);
+    return NULL;
+  }
+  jmp_buf on_error;
+  jmp_buf *outer = bsp->on_error;
+  bsp->on_error = &on_error;
+  if (setjmp(on_error)) {
+    bsp->on_error = outer;
+    return NULL;
+  }
+  LumpData *ld = lump(bsp, type);
+  bsp->on_error = outer;
+  *count = ld->count;
+  return ld->data;
+}
+const char *d3dbsp_lump_name(int type) {
+  return type >= 0 && type < LUMP_MAX ? lumpnames[type] : NULL;
+}
+static bool export_map_catching(Bsp *bsp, const char *path, ProgramOptions *opts, FILE *log) {
+  FILE *null_log = log ? NULL : fopen(NULL_DEVICE, "w");
+  if (!log && !null_log) {
+    snprintf(bsp->error, sizeof(bsp->error), "Failed to open '%s'", NULL_DEVICE);
+    return false;
+  }
+  jmp_buf on_error;
+  jmp_buf *outer = bsp->on_error;
+  bsp->on_error = &on_error;
+  if (setjmp(on_error)) {
+    bsp->on_error = outer;
+    if (null_log)
+      fclose(null_log);
+    return false;
+  }
+  // Everything that can fail is loaded before the output file is opened, so an error never
+  // leaves it open.
+  u64 needed = export_lump_set(opts);
+  for (int type = 0; type < LUMP_MAX; ++type) {
+    if (needed & LUMP_BIT(type))
+      lump(bsp, type);
+  }
+  bool ok = export_map_file(bsp, log ? log : null_log, opts, path);
+  if (!ok)
+    snprintf(bsp->error, sizeof(bsp->error), "Failed to open '%s'", path);
+  bsp->on_error = outer;
+  if (null_log)
+    fclose(null_log);
+  return ok;
+}
+bool d3dbsp_export_map(Bsp *bsp, const char *path, const BspExportOptions *options, FILE *log) {
+  ProgramOptions opts = {0};
+  if (options) {
+    opts.exclude_patches = options->exclude_patches;
+    opts.cache_dir = options->cache_dir;
+  }
+  return export_map_catching(bsp, path, &opts, log);
+}
+const char *d3dbsp_error(Bsp *bsp) {
+  return bsp->error;
+}
+void d3dbsp_close(Bsp *bsp) {
+  if (!bsp)
+    return;
+  bsp_close(bsp);
+  free(bsp);
+}
+// The rest is the tool's: traces, the bsp tree, pvs and vis, lightmaps, meshes, the benchmarks and the
+// command line.
+#ifndef BSP_LIBRARY
+// Traces against the collision aabb trees. Each leaf of a tree points at a partition of triangles
+// whose plane and barycentric s/t vectors were precomputed by the compiler. A map has many separate
+// trees, so collision_load puts a small hierarchy over their roots and a trace walks both with a stack.
+// Hits are pulled back this far along the normal so the end position stays in front of the surface.
+#define TRACE_EPSILON 0.125f
+#define TRACE_TRI_EPSILON 0.0001f
+// Boxes are grown by this much on every axis so they can't slip through the seam between two triangles.
+#define TRACE_BOX_PAD 0.001f
+#define TRACE_STACK_SIZE 256
+#define COLLISION_LEAF_ROOTS 4
+typedef struct {
+  s32 index;
+  float enter; // fraction where the ray enters the node's bounds
+} TraceStackEntry;
+static void aabb_tree_bounds(DiskCollisionAabbTree *tree, vec3 mins, vec3 maxs) {
+  for (int k = 0; k < 3; ++k) {
+    mins[k] = tree->origin[k] - tree->halfSize[k];
+    maxs[k] = tree->origin[k] + tree->halfSize[k];
+  }
+}
+static s32 collision_build_node(CollisionWorld *cw, DiskCollisionAabbTree *trees, size_t first, size_t count, size_t depth) {
+  s32 index = buf_size(cw->nodes);
+  if (depth > cw->depth)
+    cw->depth = depth;
+  CollisionNode node = { .mins = { FLT_MAX, FLT_MAX, FLT_MAX }, .maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+  vec3 cmins = { FLT_MAX, FLT_MAX, FLT_MAX }, cmaxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (size_t i = first; i < first + count; ++i) {
+    DiskCollisionAabbTree *tree = &trees[cw->roots[i]];
+    vec3 mins, maxs;
+    aabb_tree_bounds(tree, mins, maxs);
+    for (int k = 0; k < 3; ++k) {
+      node.mins[k] = fminf(node.mins[k], mins[k]);
+      node.maxs[k] = fmaxf(node.maxs[k], maxs[k]);
+      cmins[k] = fminf(cmins[k], tree->origin[k]);
+      cmaxs[k] = fmaxf(cmaxs[k], tree->origin[k]);
+    }
+  }
+  buf_push(cw->nodes, node);
+  if (count <= COLLISION_LEAF_ROOTS) {
+    cw->nodes[index].first = first;
+    cw->nodes[index].count = count;
+    return index;
+  }
+  // Split at the middle of the centers along their widest axis, or in half if that leaves a side empty.
+  int axis = 0;
+  for (int k = 1; k < 3; ++k) {
+    if (cmaxs[k] - cmins[k] > cmaxs[axis] - cmins[axis])
+      axis = k;
+  }
+  float mid = (cmins[axis] + cmaxs[axis]) * 0.5f;
+  size_t left = first;
+  for (size_t i = first; i < first + count; ++i) {
+    if (trees[cw->roots[i]].origin[axis] < mid) {
+      s32 tmp = cw->roots[i];
+      cw->roots[i] = cw->roots[left];
+      cw->roots[left++] = tmp;
+    }
+  }
+  size_t left_count = left - first;
+  if (left_count == 0 || left_count == count)
+    left_count = count / 2;
+  collision_build_node(cw, trees, first, left_count, depth + 1);
+  s32 right = collision_build_node(cw, trees, first + left_count, count - left_count, depth + 1);
+  cw->nodes[index].first = right;
+  cw->nodes[index].count = 0;
+  return index;
+}
+// Validates the trees so a trace can index without checks, then builds the hierarchy over their roots.
+// A node referenced by two parents is rejected, which also rules out cycles. Trees and a hierarchy that
+// would overflow the fixed size stacks of trace are rejected too.
+static void collision_load(Bsp *bsp) {
+  CollisionWorld *cw = &bsp->collision;
+  if (cw->loaded)
+    return;
+  buf_clear(cw->nodes);
+  buf_clear(cw->roots);
+  cw->depth = 0;
+  LumpData *aabbs = lump(bsp, LUMP_COLLISIONAABBS);
+  size_t material_count = lump(bsp, LUMP_MATERIALS)->count;
+  DiskCollisionAabbTree *trees = aabbs->data;
+  bool *has_parent = calloc(aabbs->count + 1, sizeof(bool));
+  for (size_t i = 0; i < aabbs->count; ++i) {
+    DiskCollisionAabbTree *tree = &trees[i];
+    if (tree->materialIndex < 0 || (size_t)tree->materialIndex >= material_count)
+      bsp_error(bsp, "Collision aabb %zu has an invalid material", i);
+    if (tree->childCount > 0) {
+      if (tree->u.firstChildIndex < 0 || (size_t)tree->u.firstChildIndex + tree->childCount > aabbs->count)
+        bsp_error(bsp, "Collision aabb %zu has children out of bounds", i);
+      for (s32 j = tree->u.firstChildIndex; j < tree->u.firstChildIndex + tree->childCount; ++j) {
+        if (has_parent[j])
+          bsp_error(bsp, "Collision aabb %d has more than one parent", j);
+        has_parent[j] = true;
+      }
+      continue;
+    }
+    collision_leaf_check(bsp, tree, i);
+  }
+  for (size_t i = 0; i < aabbs->count; ++i) {
+    if (!has_parent[i])
+      buf_push(cw->roots, i);
+  }
+  free(has_parent);
+  // Stack entries a trace needs below each node: all children of a node go on the stack and are
+  // opened one at a time. 0 = not visited yet, children are finished before their parent.
+  u32 *need = calloc(aabbs->count + 1, sizeof(u32));
+  s32 *stack = NULL;
+  for (size_t r = 0; r < buf_size(cw->roots); ++r) {
+    buf_push(stack, cw->roots[r]);
+    while (buf_size(stack)) {
+      s32 index = stack[buf_size(stack) - 1];
+      DiskCollisionAabbTree *tree = &trees[index];
+      if (tree->childCount <= 0) {
+        need[index] = 1;
+        (void)buf_pop(stack);
+        continue;
+      }
+      if (!need[index]) {
+        need[index] = 1;
+        for (s32 c = 0; c < tree->childCount; ++c)
+          buf_push(stack, tree->u.firstChildIndex + c);
+        continue;
+      }
+      u32 deepest = 0;
+      for (s32 c = 0; c < tree->childCount; ++c)
+        deepest = need[tree->u.firstChildIndex + c] > deepest ? need[tree->u.firstChildIndex + c] : deepest;
+      need[index] = tree->childCount - 1 + deepest;
+      (void)buf_pop(stack);
+    }
+    if (need[cw->roots[r]] > TRACE_STACK_SIZE) {
+      u32 n = need[cw->roots[r]];
+      buf_free(stack);
+      free(need);
+      bsp_error(bsp, "Collision aabb %d needs a trace stack of %u entries", cw->roots[r], n);
+    }
+  }
+  buf_free(stack);
+  free(need);
+  if (buf_size(cw->roots))
+    collision_build_node(cw, trees, 0, buf_size(cw->roots), 1);
+  // A trace holds at most one entry per level plus the sibling of the last one.
+  if (cw->depth + 1 > TRACE_STACK_SIZE)
+    bsp_error(bsp, "Collision hierarchy is %zu levels deep", cw->depth);
+  cw->loaded = true;
+}
+// Entry fraction of the segment into the box grown by the trace extents, or a value past 1 on a miss.
+static float trace_box_enter(const TraceRay *ray, const vec3 inv_delta, const vec3 mins, const vec3 maxs) {
+  float enter = 0.f, leave = 1.f;
+  for (int k = 0; k < 3; ++k) {
+    float lo = mins[k] - ray->extents[k] - ray->start[k];
+    float hi = maxs[k] + ray->extents[k] - ray->start[k];
+    if (inv_delta[k] == INFINITY || inv_delta[k] == -INFINITY) {
+      if (lo > 0.f || hi < 0.f)
+        return 2.f;
+      continue;
+    }
+    float t0 = lo * inv_delta[k], t1 = hi * inv_delta[k];
+    if (t0 > t1) {
+      float tmp = t0;
+      t0 = t1;
+      t1 = tmp;
+    }
+    enter = fmaxf(enter, t0);
+    leave = fminf(leave, t1);
+    if (enter > leave)
+      return 2.f;
+  }
+  return enter;
+}
+// Rays only need the plane crossing and the s/t coordinates of the crossing point. Triangles are one
+// sided like in the game, so only a ray going from the front to the back hits.
+static bool trace_ray_triangle(const TraceRay *ray, const vec3 delta, DiskCollisionTriangle *tri, TraceResult *tr) {
+  float d0 = vec3_mul_inner(tri->plane, ray->start) - tri->plane[3];
+  float d1 = vec3_mul_inner(tri->plane, ray->end) - tri->plane[3];
+  if (d0 < 0.f || d1 >= 0.f)
+    return false;
+  float f = d0 / (d0 - d1);
+  if (f >= tr->fraction)
+    return false;
+  vec3 p = { ray->start[0] + delta[0] * f, ray->start[1] + delta[1] * f, ray->start[2] + delta[2] * f };
+  float s = vec3_mul_inner(tri->svec, p) - tri->svec[3];
+  float t = vec3_mul_inner(tri->tvec, p) - tri->tvec[3];
+  if (s < -TRACE_TRI_EPSILON || t < -TRACE_TRI_EPSILON || s + t > 1.f + TRACE_TRI_EPSILON)
+    return false;
+  tr->fraction = fmaxf(0.f, (d0 - TRACE_EPSILON) / (d0 - d1));
+  vec3_dup(tr->normal, tri->plane);
+  tr->start_solid = false;
+  return true;
+}
+// Swept box against triangle by separating axes: the triangle normal, the three box axes and the
+// cross products of the edges with the box axes. The box first touches the triangle at the latest
+// time it enters the overlap range on any axis, and that axis is the contact normal.
+static bool trace_box_triangle(const TraceRay *ray, const vec3 delta, DiskCollisionTriangle *tri,
+                        DiskCollisionVertex *verts, TraceResult *tr) {
+  if (vec3_mul_inner(tri->plane, delta) > 0.f)
+    return false;
+  vec3 v[3], e[3];
+  for (int i = 0; i < 3; ++i)
+    vec3_sub(v[i], verts[tri->vertIndices[i]].xyz, ray->start);
+  for (int i = 0; i < 3; ++i)
+    vec3_sub(e[i], v[(i + 1) % 3], v[i]);
+  vec3 axes[13];
+  vec3_dup(axes[0], tri->plane);
+  size_t axis_count = 1;
+  // The box axes come before the edge axes since they reject most misses and are cheap.
+  for (int k = 0; k < 3; ++k) {
+    vec3 box_axis = { k == 0, k == 1, k == 2 };
+    vec3_dup(axes[axis_count++], box_axis);
+  }
+  for (int k = 0; k < 3; ++k) {
+    for (int i = 0; i < 3; ++i)
+      vec3_mul_cross(axes[axis_count++], e[i], axes[1 + k]);
+  }
+  float enter = -FLT_MAX, leave = FLT_MAX;
+  float *normal = NULL;
+  for (size_t a = 0; a < axis_count; ++a) {
+    float *L = axes[a];
+    if (vec3_mul_inner(L, L) < 1e-12f)
+      continue;
+    float r = fabsf(L[0]) * (ray->extents[0] + TRACE_BOX_PAD) + fabsf(L[1]) * (ray->extents[1] + TRACE_BOX_PAD)
+            + fabsf(L[2]) * (ray->extents[2] + TRACE_BOX_PAD);
+    float p0 = vec3_mul_inner(L, v[0]), p1 = vec3_mul_inner(L, v[1]), p2 = vec3_mul_inner(L, v[2]);
+    float lo = fminf(p0, fminf(p1, p2)) - r, hi = fmaxf(p0, fmaxf(p1, p2)) + r;
+    float speed = vec3_mul_inner(L, delta);
+    if (fabsf(speed) < 1e-12f) {
+      if (lo > 0.f || hi < 0.f)
+        return false;
+      continue;
+    }
+    float t0 = lo / speed, t1 = hi / speed;
+    if (t0 > t1) {
+      float tmp = t0;
+      t0 = t1;
+      t1 = tmp;
+    }
+    if (t0 > enter) {
+      enter = t0;
+      normal = L;
+      // Face the normal against the motion.
+      if (speed > 0.f)
+        vec3_scale(L, L, -1.f);
+    }
+    leave = fminf(leave, t1);
+    if (enter > leave || leave < 0.f || enter >= tr->fraction)
+      return false;
+  }
+  if (enter <= 0.f) {
+    // Already overlapping at the start, which includes a box that isn't moving at all.
+    tr->fraction = 0.f;
+    tr->start_solid = true;
+    vec3_dup(tr->normal, tri->plane);
+    return true;
+  }
+  vec3_norm(tr->normal, normal);
+  float approach = -vec3_mul_inner(tr->normal, delta);
+  tr->fraction = fmaxf(0.f, enter - (approach > 0.f ? TRACE_EPSILON / approach : 0.f));
+  tr->start_solid = false;
+  return true;
+}
+// Closest hit along the ray, or fraction 1 and material -1. Boxes that are already stuck in a
+// triangle return fraction 0 with start_solid set.
+static void trace(Bsp *bsp, const TraceRay *ray, TraceResult *tr) {
+  CollisionWorld *cw = &bsp->collision;
+  dmaterial_t *materials = bsp->lumps[LUMP_MATERIALS].data;
+  DiskCollisionVertex *verts = bsp->lumps[LUMP_COLLISIONVERTS].data;
+  DiskCollisionTriangle *tris = bsp->lumps[LUMP_COLLISIONTRIS].data;
+  DiskCollisionPartition *partitions = bsp->lumps[LUMP_COLLISIONPARTITIONS].data;
+  DiskCollisionAabbTree *trees = bsp->lumps[LUMP_COLLISIONAABBS].data;
+  assert(cw->loaded);
+  tr->fraction = 1.f;
+  tr->material = -1;
+  tr->start_solid = false;
+  vec3_dup(tr->normal, (vec3) { 0.f, 0.f, 0.f });
+  if (!buf_size(cw->nodes))
+    return;
+  vec3 delta, inv_delta;
+  vec3_sub(delta, ray->end, ray->start);
+  for (int k = 0; k < 3; ++k)
+    inv_delta[k] = 1.f / delta[k];
+  bool is_box = ray->extents[0] != 0.f || ray->extents[1] != 0.f || ray->extents[2] != 0.f;
+  // The hierarchy over the roots first, then each tree it reaches. Children are pushed farthest first
+  // so the nearest is opened first, and whatever the closest hit so far already hides gets skipped.
+  TraceStackEntry stack[TRACE_STACK_SIZE];
+  size_t sp = 0;
+  stack[sp++] = (TraceStackEntry) { 0, trace_box_enter(ray, inv_delta, cw->nodes[0].mins, cw->nodes[0].maxs) };
+  TraceStackEntry tree_stack[TRACE_STACK_SIZE];
+  while (sp) {
+    TraceStackEntry top = stack[--sp];
+    if (top.enter > tr->fraction)
+      continue;
+    CollisionNode *node = &cw->nodes[top.index];
+    if (!node->count) {
+      TraceStackEntry a = { top.index + 1, trace_box_enter(ray, inv_delta, cw->nodes[top.index + 1].mins, cw->nodes[top.index + 1].maxs) };
+      TraceStackEntry b = { node->first, trace_box_enter(ray, inv_delta, cw->nodes[node->first].mins, cw->nodes[node->first].maxs) };
+      assert(sp + 2 <= TRACE_STACK_SIZE);
+      stack[sp++] = a.enter > b.enter ? a : b;
+      stack[sp++] = a.enter > b.enter ? b : a;
+      continue;
+    }
+    for (s32 r = 0; r < node->count; ++r) {
+      size_t tsp = 0;
+      tree_stack[tsp++] = (TraceStackEntry) { cw->roots[node->first + r], 0.f };
+      while (tsp) {
+        TraceStackEntry top = tree_stack[--tsp];
+        DiskCollisionAabbTree *tree = &trees[top.index];
+        if (top.enter > tr->fraction)
+          continue;
+        if (ray->contents && !(materials[tree->materialIndex].contentFlags & ray->contents))
+          continue;
+        if (tree->childCount > 0) {
+          size_t first = tsp;
+          assert(tsp + tree->childCount <= TRACE_STACK_SIZE);
+          for (s32 c = 0; c < tree->childCount; ++c) {
+            vec3 mins, maxs;
+            aabb_tree_bounds(&trees[tree->u.firstChildIndex + c], mins, maxs);
+            TraceStackEntry e = { tree->u.firstChildIndex + c, trace_box_enter(ray, inv_delta, mins, maxs) };
+            if (e.enter > tr->fraction)
+              continue;
+            size_t k = tsp++;
+            for (; k > first && tree_stack[k - 1].enter < e.enter; --k)
+              tree_stack[k] = tree_stack[k - 1];
+            tree_stack[k] = e;
+          }
+          continue;
+        }
+        DiskCollisionPartition *part = &partitions[tree->u.partitionIndex];
+        for (size_t i = part->firstTriIndex; i < part->firstTriIndex + part->triCount; ++i) {
+          bool hit = is_box ? trace_box_triangle(ray, delta, &tris[i], verts, tr) : trace_ray_triangle(ray, delta, &tris[i], tr);
+          if (hit)
+            tr->material = tree->materialIndex;
+        }
+      }
+    }
+  }
+}
+typedef struct {
+  Bsp *bsp;
+  const TraceRay *rays;
+  TraceResult *results;
+  size_t count;
+} TraceBatch;
+#define TRACE_BATCH_CHUNK 1024
+static void trace_batch_chunk(void *ctx, size_t index) {
+  TraceBatch *tb = ctx;
+  size_t end = (index + 1) * TRACE_BATCH_CHUNK;
+  if (end > tb->count)
+    end = tb->count;
+  for (size_t i = index * TRACE_BATCH_CHUNK; i < end; ++i)
+    trace(tb->bsp, &tb->rays[i], &tb->results[i]);
+}
+// Traces every ray on the map's worker threads, handed out in chunks so the counter isn't contended.
+static void trace_batch(Bsp *bsp, const TraceRay *rays, TraceResult *results, size_t count) {
+  collision_load(bsp);
+  TraceBatch tb = { .bsp = bsp, .rays = rays, .results = results, .count = count };
+  parallel_for((count + TRACE_BATCH_CHUNK - 1) / TRACE_BATCH_CHUNK, bsp->threads, trace_batch_chunk, &tb);
+}
+// Point and box queries over LUMP_NODES. The nodes are copied once into 32 byte records, two to a
+// cache line, with the plane inlined so a descent touches one line per level instead of a node and a
+// plane. Planes along +x, +y or +z skip the dot product.
+#define PLANE_NON_AXIAL 3
+#define BSP_NODE_ALIGN 64
+#define BSP_STACK_SIZE 1024
+#define LEAF_BATCH_LANES 8
+#define LEAF_BATCH_CHUNK 4096
+static s32 plane_type(const vec3 normal) {
+  for (s32 k = 0; k < 3; ++k) {
+    if (normal[k] == 1.f)
+      return k;
+  }
+  return PLANE_NON_AXIAL;
+}
+// Copies and validates the nodes. The walk from the root rejects any node reached twice, so the
+// queries can't loop, and it measures the depth so their fixed size stacks are known to be enough.
+// The tree only counts as loaded once all of that passed. Scratch memory comes from the arena, so
+// an error doesn't leak it.
+static void bsp_tree_load(Bsp *bsp) {
+  BspTree *tree = &bsp->tree;
+  if (tree->loaded)
+    return;
+  tree->depth = 0;
+  LumpData *nodes = lump(bsp, LUMP_NODES);
+  LumpData *planes = lump(bsp, LUMP_PLANES);
+  size_t leaf_count = lump(bsp, LUMP_LEAFS)->count;
+  dnode_t *src = nodes->data;
+  DiskPlane *diskplanes = planes->data;
+  if (!leaf_count)
+    bsp_error(bsp, "Map has no leafs");
+  if (!nodes->count) {
+    tree->loaded = true;
+    return;
+  }
+  u8 *p = bsp_alloc(bsp, sizeof(BspNode) * nodes->count + BSP_NODE_ALIGN);
+  tree->nodes = (BspNode*)(((uintptr_t)p + BSP_NODE_ALIGN - 1) & ~(uintptr_t)(BSP_NODE_ALIGN - 1));
+  tree->count = nodes->count;
+  for (size_t i = 0; i < nodes->count; ++i) {
+    BspNode *dst = &tree->nodes[i];
+    if (src[i].planeNum < 0 || (size_t)src[i].planeNum >= planes->count)
+      bsp_error(bsp, "Node %zu has an invalid plane", i);
+    DiskPlane *plane = &diskplanes[src[i].planeNum];
+    vec3_dup(dst->normal, plane->normal);
+    dst->dist = plane->dist;
+    dst->type = plane_type(plane->normal);
+    for (int side = 0; side < 2; ++side) {
+      s32 child = src[i].children[side];
+      if (child >= 0 ? (size_t)child >= nodes->count : (size_t)-(child + 1) >= leaf_count)
+        bsp_error(bsp, "Node %zu has a child out of bounds", i);
+      dst->children[side] = child;
+    }
+  }
+  // 0 = not reached yet, otherwise the node's depth counting the root as 1.
+  // Every node is pushed at most once.
+  size_t *depth = bsp_alloc(bsp, sizeof(size_t) * nodes->count);
+  memset(depth, 0, sizeof(size_t) * nodes->count);
+  s32 *stack = bsp_alloc(bsp, sizeof(s32) * nodes->count);
+  size_t top = 0;
+  stack[top++] = 0;
+  depth[0] = 1;
+  while (top) {
+    s32 index = stack[--top];
+    if (depth[index] > tree->depth)
+      tree->depth = depth[index];
+    for (int side = 0; side < 2; ++side) {
+      s32 child = tree->nodes[index].children[side];
+      if (child < 0)
+        continue;
+      if (depth[child])
+        bsp_error(bsp, "Node %d is reached twice", child);
+      depth[child] = depth[index] + 1;
+      stack[top++] = child;
+    }
+  }
+  if (tree->depth > BSP_STACK_SIZE)
+    bsp_error(bsp, "Node tree is %zu levels deep", tree->depth);
+  tree->loaded = true;
+}
+static s32 bsp_node_side(BspNode *node, const float *p) {
+  float d = (node->type < PLANE_NON_AXIAL ? p[node->type] : vec3_mul_inner(node->normal, p)) - node->dist;
+  return d < 0.f;
+}
+// Leaf index the point falls in. A point exactly on a plane goes to the front child.
+static s32 point_leaf(Bsp *bsp, const vec3 p) {
+  BspTree *tree = &bsp->tree;
+  assert(tree->loaded);
+  if (!tree->count)
+    return 0;
+  s32 index = 0;
+  while (index >= 0)
+    index = tree->nodes[index].children[bsp_node_side(&tree->nodes[index], p)];
+  return -(index + 1);
+}
+// Descends LEAF_BATCH_LANES points side by side, so the cache misses of one point overlap with the
+// work on the others instead of each level waiting for its node.
+static void point_leafs_lanes(BspTree *tree, const vec3 *points, s32 *leafs, size_t count) {
+  for (size_t i = 0; i < count; i += LEAF_BATCH_LANES) {
+    size_t n = count - i < LEAF_BATCH_LANES ? count - i : LEAF_BATCH_LANES;
+    s32 index[LEAF_BATCH_LANES];
+    bool active = tree->count > 0;
+    for (size_t j = 0; j < n; ++j)
+      index[j] = active ? 0 : -1;
+    while (active) {
+      active = false;
+      for (size_t j = 0; j < n; ++j) {
+        if (index[j] < 0)
+          continue;
+        BspNode *node = &tree->nodes[index[j]];
+        index[j] = node->children[bsp_node_side(node, points[i + j])];
+        active |= index[j] >= 0;
+      }
+    }
+    for (size_t j = 0; j < n; ++j)
+      leafs[i + j] = -(index[j] + 1);
+  }
+}
+typedef struct {
+  BspTree *tree;
+  const vec3 *points;
+  s32 *leafs;
+  size_t count;
+} PointLeafBatch;
+static void point_leafs_chunk(void *ctx, size_t index) {
+  PointLeafBatch *batch = ctx;
+  size_t first = index * LEAF_BATCH_CHUNK;
+  size_t n = batch->count - first < LEAF_BATCH_CHUNK ? batch->count - first : LEAF_BATCH_CHUNK;
+  point_leafs_lanes(batch->tree, &batch->points[first], &batch->leafs[first], n);
+}
+// point_leaf for every point, on the map's worker threads.
+static void point_leafs(Bsp *bsp, const vec3 *points, s32 *leafs, size_t count) {
+  bsp_tree_load(bsp);
+  PointLeafBatch batch = { .tree = &bsp->tree, .points = points, .leafs = leafs, .count = count };
+  parallel_for((count + LEAF_BATCH_CHUNK - 1) / LEAF_BATCH_CHUNK, bsp->threads, point_leafs_chunk, &batch);
+}
+// Writes up to max_count indices of the leafs the box touches and returns how many there are in
+// total, which can be more than max_count.
+static size_t box_leafs(Bsp *bsp, const vec3 mins, const vec3 maxs, s32 *leafs, size_t max_count) {
+  BspTree *tree = &bsp->tree;
+  assert(tree->loaded);
+  if (!tree->count) {
+    if (max_count)
+      leafs[0] = 0;
+    return 1;
+  }
+  s32 stack[BSP_STACK_SIZE + 1];
+  size_t sp = 0, count = 0;
+  stack[sp++] = 0;
+  while (sp) {
+    s32 index = stack[--sp];
+    if (index < 0) {
+      if (count < max_count)
+        leafs[count] = -(index + 1);
+      ++count;
+      continue;
+    }
+    BspNode *node = &tree->nodes[index];
+    float lo, hi;
+    if (node->type < PLANE_NON_AXIAL) {
+      lo = mins[node->type];
+      hi = maxs[node->type];
+    } else {
+      lo = hi = 0.f;
+      for (int k = 0; k < 3; ++k) {
+        float a = node->normal[k] * mins[k], b = node->normal[k] * maxs[k];
+        lo += fminf(a, b);
+        hi += fmaxf(a, b);
+      }
+    }
+    // Back child pushed first, so leafs come out front to back like the recursive version.
+    if (lo - node->dist < 0.f)
+      stack[sp++] = node->children[1];
+    if (hi - node->dist >= 0.f)
+      stack[sp++] = node->children[0];
+  }
+  return count;
+}
+// The cluster PVS from LUMP_VISIBILITY: a cluster count and a row size, then one row of bits per
+// cluster saying which clusters it can see. Rows are copied into 64 byte aligned bitsets padded to
+// PVS_ROW_ALIGN bytes, with the bits past the last cluster cleared, so the row kernels below work on
+// whole vectors and popcounts need no masking.
+#define PVS_ROW_ALIGN 32
+#define PVS_WORD_BITS 64
+static u64 *pvs_row(Bsp *bsp, s32 cluster) {
+  return &bsp->pvs.rows[cluster * bsp->pvs.row_words];
+}
+// Sizes the rows from cluster_count and fills in all.
+static void pvs_all_load(Bsp *bsp) {
+  Pvs *pvs = &bsp->pvs;
+  size_t row_bytes = (pvs->cluster_count + 7) / 8;
+  pvs->row_words = (row_bytes + PVS_ROW_ALIGN - 1) / PVS_ROW_ALIGN * (PVS_ROW_ALIGN / sizeof(u64));
+  u8 *p = bsp_alloc(bsp, sizeof(u64) * pvs->row_words + 64);
+  pvs->all = (u64*)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+  memset(pvs->all, 0, sizeof(u64) * pvs->row_words);
+  for (size_t i = 0; i < pvs->cluster_count; ++i)
+    pvs->all[i / PVS_WORD_BITS] |= 1ull << (i % PVS_WORD_BITS);
+}
+// Clusters the visibility data doesn't cover, which is all of them when a map has none, see every
+// cluster like in the game. Their row is all.
+static void pvs_load(Bsp *bsp) {
+  Pvs *pvs = &bsp->pvs;
+  if (pvs->loaded)
+    return;
+  LumpData *vis = lump(bsp, LUMP_VISIBILITY);
+  if (vis->count == 0) {
+    LumpData *leafs = lump(bsp, LUMP_LEAFS);
+    pvs->cluster_count = 0;
+    for (size_t i = 0; i < leafs->count; ++i) {
+      s32 cluster = ((dleaf_t*)leafs->data)[i].cluster;
+      if (cluster >= 0 && (size_t)cluster >= pvs->cluster_count)
+        pvs->cluster_count = cluster + 1;
+    }
+    pvs_all_load(bsp);
+    pvs->loaded = true;
+    return;
+  }
+  s32 header[2];
+  if (vis->count < sizeof(header))
+    bsp_error(bsp, "Visibility lump is too small");
+  memcpy(header, vis->data, sizeof(header));
+  if (header[0] < 0 || header[1] < 0 || (u64)header[1] * 8 < (u64)header[0]
+      || (u64)header[0] * header[1] > vis->count - sizeof(header))
+    bsp_error(bsp, "Visibility lump has %d clusters of %d bytes", header[0], header[1]);
+  size_t row_bytes = (header[0] + 7) / 8;
+  pvs->cluster_count = header[0];
+  pvs->row_words = (row_bytes + PVS_ROW_ALIGN - 1) / PVS_ROW_ALIGN * (PVS_ROW_ALIGN / sizeof(u64));
+  size_t size = sizeof(u64) * pvs->row_words * pvs->cluster_count;
+  u8 *p = bsp_alloc(bsp, size + 64);
+  pvs->rows = (u64*)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+  memset(pvs->rows, 0, size);
+  u8 *src = (u8*)vis->data + sizeof(header);
+  for (size_t i = 0; i < pvs->cluster_count; ++i) {
+    u64 *row = pvs_row(bsp, i);
+    memcpy(row, src + i * header[1], row_bytes);
+    if (pvs->cluster_count % PVS_WORD_BITS)
+      row[pvs->cluster_count / PVS_WORD_BITS] &= (1ull << (pvs->cluster_count % PVS_WORD_BITS)) - 1;
+  }
+  pvs_all_load(bsp);
+  pvs->loaded = true;
+}
+// The row of a cluster that isn't negative.
+static const u64 *pvs_cluster_row(Bsp *bsp, s32 cluster) {
+  Pvs *pvs = &bsp->pvs;
+  return pvs->rows && (size_t)cluster < pvs->cluster_count ? pvs_row(bsp, cluster) : pvs->all;
+}
+// Negative clusters are outside the map and see nothing.
+static bool pvs_cluster_visible(Bsp *bsp, s32 from, s32 to) {
+  Pvs *pvs = &bsp->pvs;
+  assert(pvs->loaded);
+  if (from < 0 || to < 0)
+    return false;
+  if ((size_t)to >= pvs->cluster_count)
+    return true;
+  return (pvs_cluster_row(bsp, from)[to / PVS_WORD_BITS] >> (to % PVS_WORD_BITS)) & 1;
+}
+static u32 popcount64(u64 x) {
+#ifdef _MSC_VER
+  x = x - ((x >> 1) & 0x5555555555555555ull);
+  x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (u32)((x * 0x0101010101010101ull) >> 56);
+#else
+  return __builtin_popcountll(x);
+#endif
+}
+// Row kernels. words is always a multiple of PVS_ROW_ALIGN / 8 and rows are aligned to that.
+static void pvs_rows_and_scalar(u64 *dst, const u64 *a, const u64 *b, size_t words) {
+  for (size_t i = 0; i < words; ++i)
+    dst[i] = a[i] & b[i];
+}
+static void pvs_rows_or_scalar(u64 *dst, const u64 *a, const u64 *b, size_t words) {
+  for (size_t i = 0; i < words; ++i)
+    dst[i] = a[i] | b[i];
+}
+static size_t pvs_popcount_scalar(const u64 *row, size_t words) {
+  size_t count = 0;
+  for (size_t i = 0; i < words; ++i)
+    count += popcount64(row[i]);
+  return count;
+}
+#ifdef BSP_X86
+static void pvs_rows_and_sse(u64 *dst, const u64 *a, const u64 *b, size_t words) {
+  for (size_t i = 0; i < words; i += 2)
+    _mm_store_si128((__m128i*)(dst + i), _mm_and_si128(_mm_load_si128((__m128i*)(a + i)), _mm_load_si128((__m128i*)(b + i))));
+}
+static void pvs_rows_or_sse(u64 *dst, const u64 *a, const u64 *b, size_t words) {
+  for (size_t i = 0; i < words; i += 2)
+    _mm_store_si128((__m128i*)(dst + i), _mm_or_si128(_mm_load_si128((__m128i*)(a + i)), _mm_load_si128((__m128i*)(b + i))));
+}
+static TARGET_AVX2 void pvs_rows_and_avx2(u64 *dst, const u64 *a, const u64 *b, size_t words) {
+  for (size_t i = 0; i < words; i += 4)
+    _mm256_store_si256((__m256i*)(dst + i), _mm256_and_si256(_mm256_load_si256((__m256i*)(a + i)), _mm256_load_si256((__m256i*)(b + i))));
+}
+static TARGET_AVX2 void pvs_rows_or_avx2(u64 *dst, const u64 *a, const u64 *b, size_t words) {
+  for (size_t i = 0; i < words; i += 4)
+    _mm256_store_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_load_si256((__m256i*)(a + i)), _mm256_load_si256((__m256i*)(b + i))));
+}
+// Counts each nibble with a shuffle lookup and adds the bytes up with sad, four words at a time.
+static TARGET_AVX2 size_t pvs_popcount_avx2(const u64 *row, size_t words) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i sum = _mm256_setzero_si256();
+  for (size_t i = 0; i < words; i += 4) {
+    __m256i v = _mm256_load_si256((__m256i*)(row + i));
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+    __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  u64 lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+typedef struct {
+  void (*rows_and)(u64 *dst, const u64 *a, const u64 *b, size_t words);
+  void (*rows_or)(u64 *dst, const u64 *a, const u64 *b, size_t words);
+  size_t (*popcount)(const u64 *row, size_t words);
+} PvsKernels;
+static PvsKernels pvs_kernels() {
+#ifdef BSP_X86
+  if (cpu_avx2())
+    return (PvsKernels) { pvs_rows_and_avx2, pvs_rows_or_avx2, pvs_popcount_avx2 };
+  return (PvsKernels) { pvs_rows_and_sse, pvs_rows_or_sse, pvs_popcount_scalar };
+#else
+  return (PvsKernels) { pvs_rows_and_scalar, pvs_rows_or_scalar, pvs_popcount_scalar };
+#endif
+}
+// Number of clusters visible from the cluster.
+static size_t pvs_cluster_count(Bsp *bsp, s32 cluster) {
+  Pvs *pvs = &bsp->pvs;
+  assert(pvs->loaded);
+  if (cluster < 0)
+    return 0;
+  return pvs_kernels().popcount(pvs_cluster_row(bsp, cluster), pvs->row_words);
+}
+// The clusters visible from both a and b, or from either, as a row written to out: pvs->row_words words
+// aligned to PVS_ROW_ALIGN bytes. Returns how many clusters that is.
+static size_t pvs_rows_combine(Bsp *bsp, s32 a, s32 b, u64 *out, bool both) {
+  Pvs *pvs = &bsp->pvs;
+  PvsKernels k = pvs_kernels();
+  assert(pvs->loaded && ((uintptr_t)out & (PVS_ROW_ALIGN - 1)) == 0);
+  if (a < 0 || b < 0) {
+    s32 other = a < 0 ? b : a;
+    if (both || other < 0) {
+      memset(out, 0, sizeof(u64) * pvs->row_words);
+      return 0;
+    }
+    memcpy(out, pvs_cluster_row(bsp, other), sizeof(u64) * pvs->row_words);
+  } else if (both) {
+    k.rows_and(out, pvs_cluster_row(bsp, a), pvs_cluster_row(bsp, b), pvs->row_words);
+  } else {
+    k.rows_or(out, pvs_cluster_row(bsp, a), pvs_cluster_row(bsp, b), pvs->row_words);
+  }
+  return k.popcount(out, pvs->row_words);
+}
+static size_t pvs_rows_and(Bsp *bsp, s32 a, s32 b, u64 *out) {
+  return pvs_rows_combine(bsp, a, b, out, true);
+}
+static size_t pvs_rows_or(Bsp *bsp, s32 a, s32 b, u64 *out) {
+  return pvs_rows_combine(bsp, a, b, out, false);
+}
+// Writes up to max_count clusters visible from the leaf and returns how many there are in total.
+static size_t pvs_leaf_clusters(Bsp *bsp, s32 leaf, s32 *clusters, size_t max_count) {
+  Pvs *pvs = &bsp->pvs;
+  LumpData *leafs = lump(bsp, LUMP_LEAFS);
+  assert(pvs->loaded);
+  if (leaf < 0 || (size_t)leaf >= leafs->count)
+    return 0;
+  s32 cluster = ((dleaf_t*)leafs->data)[leaf].cluster;
+  if (cluster < 0)
+    return 0;
+  size_t count = 0;
+  const u64 *row = pvs_cluster_row(bsp, cluster);
+  for (size_t w = 0; w < pvs->row_words; ++w) {
+    for (u64 bits = row[w]; bits; bits &= bits - 1, ++count) {
+      if (count < max_count)
+        clusters[count] = w * PVS_WORD_BITS + popcount64((bits & -bits) - 1);
+    }
+  }
+  return count;
+}
+typedef struct {
+  size_t min, max;
+  double mean;
+  size_t pairs; // visible (from, to) pairs in total
+} PvsStats;
+// Popcount of every row, written to counts when it isn't NULL.
+static void pvs_stats(Bsp *bsp, PvsStats *stats, u32 *counts) {
+  Pvs *pvs = &bsp->pvs;
+  PvsKernels k = pvs_kernels();
+  assert(pvs->loaded);
+  memset(stats, 0, sizeof(*stats));
+  if (!pvs->cluster_count)
+    return;
+  stats->min = SIZE_MAX;
+  for (size_t i = 0; i < pvs->cluster_count; ++i) {
+    size_t n = k.popcount(pvs_cluster_row(bsp, i), pvs->row_words);
+    if (counts)
+      counts[i] = n;
+    stats->min = n < stats->min ? n : stats->min;
+    stats->max = n > stats->max ? n : stats->max;
+    stats->pairs += n;
+  }
+  stats->mean = (double)stats->pairs / pvs->cluster_count;
+}
+// Cell and portal visibility. From the camera's cell every portal is clipped against the current
+// frustum, and whatever is left of it narrows the frustum for the cell behind it, recursively. The
+// context owns every buffer a query needs, so after vis_context_init queries don't allocate. A context
+// is for one thread at a time; make one per thread (init loads the lumps, so do that up front).
+#define VIS_MAX_DEPTH 64
+#define VIS_MAX_PLANES 32
+#define VIS_MAX_POINTS 64
+// Closer to a portal than this the camera is treated as standing in it, and the frustum passes through
+// unchanged instead of degenerating.
+#define VIS_PORTAL_NEAR 1.f
+typedef struct {
+  vec4 planes[VIS_MAX_PLANES]; // a point is inside when dot(plane, p) >= plane[3] for all of them
+  size_t count;
+} VisFrustum;
+typedef struct {
+  Bsp *bsp;
+  DiskGfxCell *cells_lump;
+  DiskGfxPortal *portals;
+  DiskGfxPortalVertex *vertices;
+  DiskPlane *planes;
+  DiskGfxCullGroup *cullgroups_lump;
+  size_t cells_total, cullgroups_total;
+  // Stamps instead of flags, so a query doesn't clear anything.
+  u32 stamp;
+  u32 *cell_stamps, *cullgroup_stamps;
+  bool *on_path;
+  vec3 origin;
+  VisFrustum frustums[VIS_MAX_DEPTH];
+  vec3 clip[2][VIS_MAX_POINTS];
+  // Results of the last query.
+  s32 *cells;
+  size_t cell_count;
+  s32 *cullgroups;
+  size_t cullgroup_count;
+} VisContext;
+// Planes of a view pyramid looking along pitch and yaw (degrees, like the game's angles), with the
+// given full field of view angles.
+static void vis_frustum_from_camera(VisFrustum *f, const vec3 origin, float pitch, float yaw, float fov_x, float fov_y) {
+  const float to_rad = 3.14159265f / 180.f;
+  float sp = sinf(pitch * to_rad), cp = cosf(pitch * to_rad);
+  float sy = sinf(yaw * to_rad), cy = cosf(yaw * to_rad);
+  vec3 forward = { cp * cy, cp * sy, -sp };
+  vec3 right = { sy, -cy, 0.f };
+  vec3 up = { sp * cy, sp * sy, cp };
+  float sx = sinf(fov_x * 0.5f * to_rad), cx = cosf(fov_x * 0.5f * to_rad);
+  float sz = sinf(fov_y * 0.5f * to_rad), cz = cosf(fov_y * 0.5f * to_rad);
+  const float side[4][2] = { { cx, sx }, { -cx, sx }, { cz, sz }, { -cz, sz } };
+  for (int i = 0; i < 4; ++i) {
+    float *axis = i < 2 ? right : up;
+    for (int k = 0; k < 3; ++k)
+      f->planes[i][k] = axis[k] * side[i][0] + forward[k] * side[i][1];
+    f->planes[i][3] = vec3_mul_inner(f->planes[i], origin);
+  }
+  f->count = 4;
+}
+static void vis_context_init(VisContext *ctx, Bsp *bsp) {
+  memset(ctx, 0, sizeof(*ctx));
+  LumpData *cells = lump(bsp, LUMP_CELLS);
+  LumpData *portals = lump(bsp, LUMP_PORTALS);
+  LumpData *cullgroups = lump(bsp, LUMP_CULLGROUPS);
+  size_t vertex_count = lump(bsp, LUMP_PORTALVERTS)->count;
+  size_t plane_count = lump(bsp, LUMP_PLANES)->count;
+  ctx->bsp = bsp;
+  ctx->cells_lump = cells->data;
+  ctx->portals = portals->data;
+  ctx->vertices = lump(bsp, LUMP_PORTALVERTS)->data;
+  ctx->planes = lump(bsp, LUMP_PLANES)->data;
+  ctx->cullgroups_lump = cullgroups->data;
+  ctx->cells_total = cells->count;
+  ctx->cullgroups_total = cullgroups->count;
+  for (size_t i = 0; i < cells->count; ++i) {
+    DiskGfxCell *cell = &ctx->cells_lump[i];
+    if (cell->firstPortal < 0 || cell->portalCount < 0 || (size_t)cell->firstPortal + cell->portalCount > portals->count)
+      bsp_error(bsp, "Cell %zu has portals out of bounds", i);
+    if (cell->firstCullGroup < 0 || cell->cullGroupCount < 0
+        || (size_t)cell->firstCullGroup + cell->cullGroupCount > cullgroups->count)
+      bsp_error(bsp, "Cell %zu has cull groups out of bounds", i);
+  }
+  for (size_t i = 0; i < portals->count; ++i) {
+    DiskGfxPortal *portal = &ctx->portals[i];
+    if (portal->cellIndex >= cells->count || portal->planeIndex >= plane_count
+        || (u64)portal->firstPortalVertex + portal->portalVertexCount > vertex_count)
+      bsp_error(bsp, "Portal %zu is out of bounds", i);
+  }
+  if (lump(bsp, LUMP_NODES)->count)
+    bsp_tree_load(bsp);
+  ctx->cell_stamps = calloc(cells->count + 1, sizeof(u32));
+  ctx->cullgroup_stamps = calloc(cullgroups->count + 1, sizeof(u32));
+  ctx->on_path = calloc(cells->count + 1, sizeof(bool));
+  ctx->cells = malloc(sizeof(s32) * (cells->count + 1));
+  ctx->cullgroups = malloc(sizeof(s32) * (cullgroups->count + 1));
+}
+static void vis_context_free(VisContext *ctx) {
+  free(ctx->cell_stamps);
+  free(ctx->cullgroup_stamps);
+  free(ctx->on_path);
+  free(ctx->cells);
+  free(ctx->cullgroups);
+}
+// The cell the point is in: the leaf's cell when the map has a node tree, otherwise the first cell
+// whose bounds contain it. -1 when it's in none.
+static s32 vis_cell_at_point(VisContext *ctx, const vec3 p) {
+  Bsp *bsp = ctx->bsp;
+  if (bsp->tree.count) {
+    dleaf_t *leaf = &((dleaf_t*)bsp->lumps[LUMP_LEAFS].data)[point_leaf(bsp, p)];
+    return leaf->cellNum >= 0 && (size_t)leaf->cellNum < ctx->cells_total ? leaf->cellNum : -1;
+  }
+  for (size_t i = 0; i < ctx->cells_total; ++i) {
+    DiskGfxCell *cell = &ctx->cells_lump[i];
+    if (p[0] >= cell->mins[0] && p[1] >= cell->mins[1] && p[2] >= cell->mins[2]
+        && p[0] <= cell->maxs[0] && p[1] <= cell->maxs[1] && p[2] <= cell->maxs[2])
+      return i;
+  }
+  return -1;
+}
+static bool vis_box_in_frustum(const VisFrustum *f, const vec3 mins, const vec3 maxs) {
+  for (size_t i = 0; i < f->count; ++i) {
+    const float *n = f->planes[i];
+    vec3 corner = { n[0] >= 0.f ? maxs[0] : mins[0], n[1] >= 0.f ? maxs[1] : mins[1], n[2] >= 0.f ? maxs[2] : mins[2] };
+    if (vec3_mul_inner(n, corner) < n[3])
+      return false;
+  }
+  return true;
+}
+static size_t vis_clip_polygon(vec3 *out, const vec3 *in, size_t count, const float *plane) {
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const float *a = in[i], *b = in[(i + 1) % count];
+    float da = vec3_mul_inner(plane, a) - plane[3], db = vec3_mul_inner(plane, b) - plane[3];
+    if (da >= 0.f)
+      vec3_dup(out[n++], a);
+    if ((da >= 0.f) != (db >= 0.f)) {
+      float t = da / (da - db);
+      for (int k = 0; k < 3; ++k)
+        out[n][k] = a[k] + (b[k] - a[k]) * t;
+      ++n;
+    }
+  }
+  return n;
+}
+// Planes from the camera through each edge of the clipped portal, facing its center.
+static void vis_frustum_from_polygon(VisFrustum *f, const vec3 origin, vec3 *points, size_t count) {
+  vec3 center = {0};
+  for (size_t i = 0; i < count; ++i)
+    vec3_add(center, center, points[i]);
+  vec3_scale(center, center, 1.f / count);
+  vec3_sub(center, center, origin);
+  f->count = 0;
+  for (size_t i = 0; i < count && f->count < VIS_MAX_PLANES; ++i) {
+    vec3 a, b, n;
+    vec3_sub(a, points[i], origin);
+    vec3_sub(b, points[(i + 1) % count], origin);
+    vec3_mul_cross(n, a, b);
+    float len = vec3_len(n);
+    if (len < 1e-6f)
+      continue;
+    vec3_scale(n, n, (vec3_mul_inner(n, center) < 0.f ? -1.f : 1.f) / len);
+    float *plane = f->planes[f->count++];
+    vec3_dup(plane, n);
+    plane[3] = vec3_mul_inner(n, origin);
+  }
+}
+static void vis_flood(VisContext *ctx, s32 cell_index, size_t depth) {
+  VisFrustum *f = &ctx->frustums[depth];
+  DiskGfxCell *cell = &ctx->cells_lump[cell_index];
+  if (ctx->cell_stamps[cell_index] != ctx->stamp) {
+    ctx->cell_stamps[cell_index] = ctx->stamp;
+    ctx->cells[ctx->cell_count++] = cell_index;
+  }
+  for (s32 i = cell->firstCullGroup; i < cell->firstCullGroup + cell->cullGroupCount; ++i) {
+    DiskGfxCullGroup *cg = &ctx->cullgroups_lump[i];
+    if (ctx->cullgroup_stamps[i] == ctx->stamp || !vis_box_in_frustum(f, cg->mins, cg->maxs))
+      continue;
+    ctx->cullgroup_stamps[i] = ctx->stamp;
+    ctx->cullgroups[ctx->cullgroup_count++] = i;
+  }
+  if (depth + 1 >= VIS_MAX_DEPTH)
+    return;
+  ctx->on_path[cell_index] = true;
+  for (s32 i = cell->firstPortal; i < cell->firstPortal + cell->portalCount; ++i) {
+    DiskGfxPortal *portal = &ctx->portals[i];
+    if (ctx->on_path[portal->cellIndex] || portal->portalVertexCount < 3)
+      continue;
+    VisFrustum *next = &ctx->frustums[depth + 1];
+    DiskPlane *plane = &ctx->planes[portal->planeIndex];
+    if (fabsf(vec3_mul_inner(plane->normal, ctx->origin) - plane->dist) < VIS_PORTAL_NEAR
+        || portal->portalVertexCount + f->count > VIS_MAX_POINTS) {
+      *next = *f;
+      vis_flood(ctx, portal->cellIndex, depth + 1);
+      continue;
+    }
+    size_t count = portal->portalVertexCount;
+    for (size_t j = 0; j < count; ++j)
+      vec3_dup(ctx->clip[0][j], ctx->vertices[portal->firstPortalVertex + j].xyz);
+    int src = 0;
+    for (size_t j = 0; j < f->count && count >= 3; ++j, src ^= 1)
+      count = vis_clip_polygon(ctx->clip[src ^ 1], ctx->clip[src], count, f->planes[j]);
+    if (count < 3)
+      continue;
+    vis_frustum_from_polygon(next, ctx->origin, ctx->clip[src], count);
+    if (next->count < 3)
+      continue;
+    vis_flood(ctx, portal->cellIndex, depth + 1);
+  }
+  ctx->on_path[cell_index] = false;
+}
+// Fills ctx->cells and ctx->cullgroups with what the camera can see. A camera outside every cell sees
+// nothing. Returns the number of visible cells.
+static size_t vis_query(VisContext *ctx, const vec3 origin, const VisFrustum *frustum) {
+  ctx->cell_count = 0;
+  ctx->cullgroup_count = 0;
+  if (++ctx->stamp == 0) {
+    memset(ctx->cell_stamps, 0, sizeof(u32) * ctx->cells_total);
+    memset(ctx->cullgroup_stamps, 0, sizeof(u32) * ctx->cullgroups_total);
+    ctx->stamp = 1;
+  }
+  s32 cell = vis_cell_at_point(ctx, origin);
+  if (cell < 0)
+    return 0;
+  vec3_dup(ctx->origin, origin);
+  ctx->frustums[0] = *frustum;
+  vis_flood(ctx, cell, 0);
+  return ctx->cell_count;
+}
+// Lightmap pages. Each page keeps the red, green and blue of four lightmap tiles in separate planes:
+// byte k of r[i], g[i] and b[i] is texel i of tile k. Extraction turns a page into one interleaved
+// 512x2048 RGBA image, the four tiles stacked, plus the 1024x1024 shadow map as a gray image.
+#define LIGHTMAP_SIZE 512
+#define LIGHTMAP_TEXELS (LIGHTMAP_SIZE * LIGHTMAP_SIZE)
+#define LIGHTMAP_TILES 4
+#define SHADOWMAP_SIZE 1024
+// At most this many pages are held in memory at once, whatever the thread count.
+#define LIGHTMAP_WINDOW_MAX 16
+static void lightmap_interleave_scalar(const DiskGfxLightmap *lm, RGBA *out) {
+  for (size_t i = 0; i < LIGHTMAP_TEXELS; ++i) {
+    const u8 *r = &lm->r[i].r, *g = &lm->g[i].r, *b = &lm->b[i].r;
+    for (int k = 0; k < LIGHTMAP_TILES; ++k)
+      out[k * LIGHTMAP_TEXELS + i] = (RGBA) { r[k], g[k], b[k], 255 };
+  }
+}
+#ifdef BSP_X86
+// Four texels at a time: the byte unpacks pair up r with g and b with opaque alpha, the word unpacks
+// make one RGBA pixel per tile for each texel, and a 4x4 transpose of those gives each tile its row.
+static void lightmap_interleave_sse(const DiskGfxLightmap *lm, RGBA *out) {
+  const __m128i alpha = _mm_set1_epi8((char)255);
+  for (size_t i = 0; i < LIGHTMAP_TEXELS; i += 4) {
+    __m128i r = _mm_loadu_si128((__m128i*)&lm->r[i]);
+    __m128i g = _mm_loadu_si128((__m128i*)&lm->g[i]);
+    __m128i b = _mm_loadu_si128((__m128i*)&lm->b[i]);
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g), rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i ba_lo = _mm_unpacklo_epi8(b, alpha), ba_hi = _mm_unpackhi_epi8(b, alpha);
+    __m128i t0 = _mm_unpacklo_epi16(rg_lo, ba_lo), t1 = _mm_unpackhi_epi16(rg_lo, ba_lo);
+    __m128i t2 = _mm_unpacklo_epi16(rg_hi, ba_hi), t3 = _mm_unpackhi_epi16(rg_hi, ba_hi);
+    __m128i a01 = _mm_unpacklo_epi32(t0, t1), a23 = _mm_unpacklo_epi32(t2, t3);
+    __m128i b01 = _mm_unpackhi_epi32(t0, t1), b23 = _mm_unpackhi_epi32(t2, t3);
+    _mm_storeu_si128((__m128i*)&out[i], _mm_unpacklo_epi64(a01, a23));
+    _mm_storeu_si128((__m128i*)&out[LIGHTMAP_TEXELS + i], _mm_unpackhi_epi64(a01, a23));
+    _mm_storeu_si128((__m128i*)&out[LIGHTMAP_TEXELS * 2 + i], _mm_unpacklo_epi64(b01, b23));
+    _mm_storeu_si128((__m128i*)&out[LIGHTMAP_TEXELS * 3 + i], _mm_unpackhi_epi64(b01, b23));
+  }
+}
+// The same unpacks work within each 128 bit half, and the halves hold texels 0-3 and 4-7, so every
+// result is already eight consecutive texels of one tile.
+static TARGET_AVX2 void lightmap_interleave_avx2(const DiskGfxLightmap *lm, RGBA *out) {
+  const __m256i alpha = _mm256_set1_epi8((char)255);
+  for (size_t i = 0; i < LIGHTMAP_TEXELS; i += 8) {
+    __m256i r = _mm256_loadu_si256((__m256i*)&lm->r[i]);
+    __m256i g = _mm256_loadu_si256((__m256i*)&lm->g[i]);
+    __m256i b = _mm256_loadu_si256((__m256i*)&lm->b[i]);
+    __m256i rg_lo = _mm256_unpacklo_epi8(r, g), rg_hi = _mm256_unpackhi_epi8(r, g);
+    __m256i ba_lo = _mm256_unpacklo_epi8(b, alpha), ba_hi = _mm256_unpackhi_epi8(b, alpha);
+    __m256i t0 = _mm256_unpacklo_epi16(rg_lo, ba_lo), t1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);
+    __m256i t2 = _mm256_unpacklo_epi16(rg_hi, ba_hi), t3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);
+    __m256i a01 = _mm256_unpacklo_epi32(t0, t1), a23 = _mm256_unpacklo_epi32(t2, t3);
+    __m256i b01 = _mm256_unpackhi_epi32(t0, t1), b23 = _mm256_unpackhi_epi32(t2, t3);
+    _mm256_storeu_si256((__m256i*)&out[i], _mm256_unpacklo_epi64(a01, a23));
+    _mm256_storeu_si256((__m256i*)&out[LIGHTMAP_TEXELS + i], _mm256_unpackhi_epi64(a01, a23));
+    _mm256_storeu_si256((__m256i*)&out[LIGHTMAP_TEXELS * 2 + i], _mm256_unpacklo_epi64(b01, b23));
+    _mm256_storeu_si256((__m256i*)&out[LIGHTMAP_TEXELS * 3 + i], _mm256_unpackhi_epi64(b01, b23));
+  }
+}
+#endif
+typedef void (*LightmapInterleave)(const DiskGfxLightmap *lm, RGBA *out);
+static LightmapInterleave lightmap_interleave_kernel() {
+#ifdef BSP_X86
+  return cpu_avx2() ? lightmap_interleave_avx2 : lightmap_interleave_sse;
+#else
+  return lightmap_interleave_scalar;
+#endif
+}
+// CRC-32 (polynomial 0xedb88320) of every byte value, for PNG chunks.
+static const u32 crc32_table[256] = {
+  0x00000000u, 0x77073096u, 0xee0e612cu, 0x990951bau, 0x076dc419u, 0x706af48fu,
+  0xe963a535u, 0x9e6495a3u, 0x0edb8832u, 0x79dcb8a4u, 0xe0d5e91eu, 0x97d2d988u,
+  0x09b64c2bu, 0x7eb17cbdu, 0xe7b82d07u, 0x90bf1d91u, 0x1db71064u, 0x6ab020f2u,
+  0xf3b97148u, 0x84be41deu, 0x1adad47du, 0x6ddde4ebu, 0xf4d4b551u, 0x83d385c7u,
+  0x136c9856u, 0x646ba8c0u, 0xfd62f97au, 0x8a65c9ecu, 0x14015c4fu, 0x63066cd9u,
+  0xfa0f3d63u, 0x8d080df5u, 0x3b6e20c8u, 0x4c69105eu, 0xd56041e4u, 0xa2677172u,
+  0x3c03e4d1u, 0x4b04d447u, 0xd20d85fdu, 0xa50ab56bu, 0x35b5a8fau, 0x42b2986cu,
+  0xdbbbc9d6u, 0xacbcf940u, 0x32d86ce3u, 0x45df5c75u, 0xdcd60dcfu, 0xabd13d59u,
+  0x26d930acu, 0x51de003au, 0xc8d75180u, 0xbfd06116u, 0x21b4f4b5u, 0x56b3c423u,
+  0xcfba9599u, 0xb8bda50fu, 0x2802b89eu, 0x5f058808u, 0xc60cd9b2u, 0xb10be924u,
+  0x2f6f7c87u, 0x58684c11u, 0xc1611dabu, 0xb6662d3du, 0x76dc4190u, 0x01db7106u,
+  0x98d220bcu, 0xefd5102au, 0x71b18589u, 0x06b6b51fu, 0x9fbfe4a5u, 0xe8b8d433u,
+  0x7807c9a2u, 0x0f00f934u, 0x9609a88eu, 0xe10e9818u, 0x7f6a0dbbu, 0x086d3d2du,
+  0x91646c97u, 0xe6635c01u, 0x6b6b51f4u, 0x1c6c6162u, 0x856530d8u, 0xf262004eu,
+  0x6c0695edu, 0x1b01a57bu, 0x8208f4c1u, 0xf50fc457u, 0x65b0d9c6u, 0x12b7e950u,
+  0x8bbeb8eau, 0xfcb9887cu, 0x62dd1ddfu, 0x15da2d49u, 0x8cd37cf3u, 0xfbd44c65u,
+  0x4db26158u, 0x3ab551ceu, 0xa3bc0074u, 0xd4bb30e2u, 0x4adfa541u, 0x3dd895d7u,
+  0xa4d1c46du, 0xd3d6f4fbu, 0x4369e96au, 0x346ed9fcu, 0xad678846u, 0xda60b8d0u,
+  0x44042d73u, 0x33031de5u, 0xaa0a4c5fu, 0xdd0d7cc9u, 0x5005713cu, 0x270241aau,
+  0xbe0b1010u, 0xc90c2086u, 0x5768b525u, 0x206f85b3u, 0xb966d409u, 0xce61e49fu,
+  0x5edef90eu, 0x29d9c998u, 0xb0d09822u, 0xc7d7a8b4u, 0x59b33d17u, 0x2eb40d81u,
+  0xb7bd5c3bu, 0xc0ba6cadu, 0xedb88320u, 0x9abfb3b6u, 0x03b6e20cu, 0x74b1d29au,
+  0xead54739u, 0x9dd277afu, 0x04db2615u, 0x73dc1683u, 0xe3630b12u, 0x94643b84u,
+  0x0d6d6a3eu, 0x7a6a5aa8u, 0xe40ecf0bu, 0x9309ff9du, 0x0a00ae27u, 0x7d079eb1u,
+  0xf00f9344u, 0x8708a3d2u, 0x1e01f268u, 0x6906c2feu, 0xf762575du, 0x806567cbu,
+  0x196c3671u, 0x6e6b06e7u, 0xfed41b76u, 0x89d32be0u, 0x10da7a5au, 0x67dd4accu,
+  0xf9b9df6fu, 0x8ebeeff9u, 0x17b7be43u, 0x60b08ed5u, 0xd6d6a3e8u, 0xa1d1937eu,
+  0x38d8c2c4u, 0x4fdff252u, 0xd1bb67f1u, 0xa6bc5767u, 0x3fb506ddu, 0x48b2364bu,
+  0xd80d2bdau, 0xaf0a1b4cu, 0x36034af6u, 0x41047a60u, 0xdf60efc3u, 0xa867df55u,
+  0x316e8eefu, 0x4669be79u, 0xcb61b38cu, 0xbc66831au, 0x256fd2a0u, 0x5268e236u,
+  0xcc0c7795u, 0xbb0b4703u, 0x220216b9u, 0x5505262fu, 0xc5ba3bbeu, 0xb2bd0b28u,
+  0x2bb45a92u, 0x5cb36a04u, 0xc2d7ffa7u, 0xb5d0cf31u, 0x2cd99e8bu, 0x5bdeae1du,
+  0x9b64c2b0u, 0xec63f226u, 0x756aa39cu, 0x026d930au, 0x9c0906a9u, 0xeb0e363fu,
+  0x72076785u, 0x05005713u, 0x95bf4a82u, 0xe2b87a14u, 0x7bb12baeu, 0x0cb61b38u,
+  0x92d28e9bu, 0xe5d5be0du, 0x7cdcefb7u, 0x0bdbdf21u, 0x86d3d2d4u, 0xf1d4e242u,
+  0x68ddb3f8u, 0x1fda836eu, 0x81be16cdu, 0xf6b9265bu, 0x6fb077e1u, 0x18b74777u,
+  0x88085ae6u, 0xff0f6a70u, 0x66063bcau, 0x11010b5cu, 0x8f659effu, 0xf862ae69u,
+  0x616bffd3u, 0x166ccf45u, 0xa00ae278u, 0xd70dd2eeu, 0x4e048354u, 0x3903b3c2u,
+  0xa7672661u, 0xd06016f7u, 0x4969474du, 0x3e6e77dbu, 0xaed16a4au, 0xd9d65adcu,
+  0x40df0b66u, 0x37d83bf0u, 0xa9bcae53u, 0xdebb9ec5u, 0x47b2cf7fu, 0x30b5ffe9u,
+  0xbdbdf21cu, 0xcabac28au, 0x53b39330u, 0x24b4a3a6u, 0xbad03605u, 0xcdd70693u,
+  0x54de5729u, 0x23d967bfu, 0xb3667a2eu, 0xc4614ab8u, 0x5d681b02u, 0x2a6f2b94u,
+  0xb40bbe37u, 0xc30c8ea1u, 0x5a05df1bu, 0x2d02ef8du
+};
+static u32 crc32_update(u32 crc, const u8 *data, size_t n) {
+  crc = ~crc;
+  for (size_t i = 0; i < n; ++i)
+    crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+static void writer_u32_be(Writer *w, u32 v) {
+  u8 b[4] = { v >> 24, v >> 16, v >> 8, v };
+  writer_write(w, b, 4);
+}
+static void png_chunk(Writer *w, const char *type, const u8 *data, size_t n) {
+  writer_u32_be(w, n);
+  writer_write(w, type, 4);
+  writer_write(w, data, n);
+  writer_u32_be(w, crc32_update(crc32_update(0, (const u8*)type, 4), data, n));
+}
+// An 8 bit gray (channels = 1) or RGBA (channels = 4) PNG. The image data goes into stored deflate
+// blocks, since there's no zlib here to compress it.
+static void write_png(Writer *w, const u8 *pixels, u32 width, u32 height, int channels) {
+  size_t row = (size_t)width * channels + 1;
+  size_t raw = row * height;
+  size_t blocks = (raw + 65534) / 65535;
+  u8 *z = malloc(2 + raw + blocks * 5 + 4);
+  size_t n = 0;
+  z[n++] = 0x78;
+  z[n++] = 0x01;
+  u32 a = 1, b = 0;
+  size_t left = raw, y = 0, x = 0;
+  while (left) {
+    u16 len = left > 65535 ? 65535 : (u16)left;
+    left -= len;
+    z[n++] = left ? 0 : 1;
+    z[n++] = len & 0xff;
+    z[n++] = len >> 8;
+    z[n++] = ~len & 0xff;
+    z[n++] = (u16)~len >> 8;
+    // Each row is a filter byte (0, none) followed by the pixels.
+    for (u16 i = 0; i < len; ++i) {
+      u8 v = x == 0 ? 0 : pixels[y * (row - 1) + x - 1];
+      if (++x == row) {
+        x = 0;
+        ++y;
+      }
+      z[n++] = v;
+      a = (a + v) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  u32 adler = b << 16 | a;
+  z[n++] = adler >> 24;
+  z[n++] = adler >> 16;
+  z[n++] = adler >> 8;
+  z[n++] = adler;
+  u8 ihdr[13] = { width >> 24, width >> 16, width >> 8, width, height >> 24, height >> 16, height >> 8, height,
+                  8, channels == 4 ? 6 : 0, 0, 0, 0 };
+  writer_write(w, "\x89PNG\r\n\x1a\n", 8);
+  png_chunk(w, "IHDR", ihdr, sizeof(ihdr));
+  png_chunk(w, "IDAT", z, n);
+  png_chunk(w, "IEND", NULL, 0);
+  free(z);
+}
+// Reads part of a lump straight from the file without loading the rest of it.
+static void lump_read_range(Bsp *bsp, int type, size_t offset, void *dst, size_t size) {
+  LumpSource *src = &bsp->source;
+  lump_t *l = &src->hdr.lumps[type];
+  assert(src->declared & LUMP_BIT(type));
+  assert(offset + size <= l->filelen);
+  if (src->use_mmap) {
+    if ((u64)l->fileofs + offset + size > src->fm.size)
+      bsp_error(bsp, "Lump '%s' is out of bounds", lumpnames[type]);
+    memcpy(dst, (u8*)src->fm.data + l->fileofs + offset, size);
+    return;
+  }
+  Stream *s = &src->stream;
+  s->seek(s, (s64)l->fileofs + offset, SEEK_SET);
+  if (s->read(s, dst, 1, size) != size)
+    bsp_error(bsp, "Failed to read lump '%s'", lumpnames[type]);
+}
+typedef struct {
+  DiskGfxLightmap *pages;
+  size_t first;
+  const char *prefix;
+  bool raw;
+  bool *failed;
+} LightmapJobs;
+static bool write_image(const char *path, const u8 *pixels, u32 width, u32 height, int channels, bool raw) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+  Writer w = { .fp = fp };
+  if (raw)
+    writer_write(&w, pixels, (size_t)width * height * channels);
+  else
+    write_png(&w, pixels, width, height, channels);
+  writer_free(&w);
+  return fclose(fp) == 0;
+}
+static void lightmap_job(void *ctx, size_t index) {
+  LightmapJobs *jobs = ctx;
+  DiskGfxLightmap *lm = &jobs->pages[index];
+  size_t page = jobs->first + index;
+  char path[1024];
+  RGBA *color = malloc(sizeof(RGBA) * LIGHTMAP_TEXELS * LIGHTMAP_TILES);
+  lightmap_interleave_kernel()(lm, color);
+  snprintf(path, sizeof(path), "%s_lm%zu.%s", jobs->prefix, page, jobs->raw ? "rgba" : "png");
+  if (!write_image(path, (u8*)color, LIGHTMAP_SIZE, LIGHTMAP_SIZE * LIGHTMAP_TILES, 4, jobs->raw))
+    jobs->failed[index] = true;
+  free(color);
+  snprintf(path, sizeof(path), "%s_shadow%zu.%s", jobs->prefix, page, jobs->raw ? "gray" : "png");
+  if (!write_image(path, lm->shadowMap, SHADOWMAP_SIZE, SHADOWMAP_SIZE, 1, jobs->raw))
+    jobs->failed[index] = true;
+}
+// Streams the pages a window at a time: one thread reads the window from the file, then the workers
+// convert and write it. Memory stays at a window of pages however many the map has.
+static void extract_lightmaps(Bsp *bsp, FILE *out, const char *prefix, bool raw) {
+  size_t count = bsp->source.hdr.lumps[LUMP_LIGHTBYTES].filelen / sizeof(DiskGfxLightmap);
+  size_t window = bsp->threads ? bsp->threads : cpu_count();
+  if (window > LIGHTMAP_WINDOW_MAX)
+    window = LIGHTMAP_WINDOW_MAX;
+  if (window > count)
+    window = count;
+  LightmapJobs jobs = {
+    .pages = malloc(sizeof(DiskGfxLightmap) * (window + 1)),
+    .prefix = prefix,
+    .raw = raw,
+    .failed = calloc(window + 1, sizeof(bool))
+  };
+  size_t failed = 0;
+  for (jobs.first = 0; jobs.first < count; jobs.first += window) {
+    size_t n = count - jobs.first < window ? count - jobs.first : window;
+    for (size_t i = 0; i < n; ++i)
+      lump_read_range(bsp, LUMP_LIGHTBYTES, (jobs.first + i) * sizeof(DiskGfxLightmap), &jobs.pages[i], sizeof(DiskGfxLightmap));
+    memset(jobs.failed, 0, sizeof(bool) * n);
+    parallel_for(n, bsp->threads, lightmap_job, &jobs);
+    for (size_t i = 0; i < n; ++i)
+      failed += jobs.failed[i];
+  }
+  fprintf(out, "Extracted %zu lightmap pages to '%s_*' as %s", count - failed, prefix, raw ? "raw" : "png");
+  if (failed)
+    fprintf(out, ", %zu failed to write", failed);
+  fprintf(out, "\n");
+  free(jobs.pages);
+  free(jobs.failed);
+}
+// Draw batches: the soups merged by material and lightmap, so each pair is one draw instead of one per
+// soup, with the triangles reordered for the post transform vertex cache (Tipsify, Sander et al. 2007)
+// and optionally cut into meshlets.
+#define MESH_CACHE_SIZE 16
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+typedef struct {
+  u16 material, lightmap;
+  u32 first_index, index_count; // into DrawBatches.indices
+  u32 vertex_count; // distinct vertices
+  u32 first_meshlet, meshlet_count;
+} DrawBatch;
+typedef struct {
+  u32 first_vertex, vertex_count; // into DrawBatches.meshlet_vertices
+  u32 first_triangle, triangle_count; // into DrawBatches.meshlet_triangles, three local indices each
+  vec3 mins, maxs;
+  vec3 center;
+  float radius;
+} Meshlet;
+typedef struct {
+  DrawBatch *batches;
+  u32 *indices; // drawvert indices
+  u32 *local; // the same triangles numbered 0..vertex_count - 1 within their batch
+  u32 *vertices; // per batch, local index to drawvert index
+  u32 *vertex_first; // per batch offset into vertices
+  Meshlet *meshlets;
+  u32 *meshlet_vertices;
+  u8 *meshlet_triangles;
+} DrawBatches;
+// The render geometry: triangle soups index into their own run of drawverts, starting at firstVertex.
+// The soups are bucketed by material so each material is written as a single draw.
+typedef struct {
+  DiskTriangleSoup *soups;
+  DiskGfxVertex *verts;
+  u16 *indices;
+  dmaterial_t *materials;
+  size_t soup_count, vert_count, index_count, material_count;
+  u32 *order; // soup indices, grouped by material
+  u32 *material_first; // material_count + 1 offsets into order
+  u32 *material_indices; // number of indices per material
+  DrawBatches *draws; // set once optimize_mesh has run
+} RenderMesh;
+#define MESH_INDEX_CHUNK 4096
+static void render_mesh_load(Bsp *bsp, RenderMesh *m) {
+  LumpData *soups = lump(bsp, LUMP_TRIANGLES);
+  LumpData *verts = lump(bsp, LUMP_DRAWVERTS);
+  LumpData *indices = lump(bsp, LUMP_DRAWINDICES);
+  LumpData *materials = lump(bsp, LUMP_MATERIALS);
+  *m = (RenderMesh) {
+    .soups = soups->data, .soup_count = soups->count,
+    .verts = verts->data, .vert_count = verts->count,
+    .indices = indices->data, .index_count = indices->count,
+    .materials = materials->data, .material_count = materials->count
+  };
+  m->material_first = calloc(m->material_count + 1, sizeof(u32));
+  m->material_indices = calloc(m->material_count + 1, sizeof(u32));
+  m->order = malloc(sizeof(u32) * (m->soup_count + 1));
+  for (size_t i = 0; i < m->soup_count; ++i) {
+    DiskTriangleSoup *s = &m->soups[i];
+    if (s->materialIndex >= m->material_count)
+      bsp_error(bsp, "Triangle soup %zu has an invalid material", i);
+    if ((u64)s->firstVertex + s->vertexCount > m->vert_count || (u64)s->firstIndex + s->indexCount > m->index_count)
+      bsp_error(bsp, "Triangle soup %zu is out of bounds", i);
+    for (size_t j = 0; j < s->indexCount; ++j) {
+      if (m->indices[s->firstIndex + j] >= s->vertexCount)
+        bsp_error(bsp, "Triangle soup %zu has an index past its vertices", i);
+    }
+    m->material_first[s->materialIndex + 1]++;
+    // A trailing partial triangle can't be drawn, leave it out.
+    m->material_indices[s->materialIndex] += s->indexCount - s->indexCount % 3;
+  }
+  for (size_t i = 0; i < m->material_count; ++i)
+    m->material_first[i + 1] += m->material_first[i];
+  u32 *next = malloc(sizeof(u32) * (m->material_count + 1));
+  memcpy(next, m->material_first, sizeof(u32) * (m->material_count + 1));
+  for (size_t i = 0; i < m->soup_count; ++i)
+    m->order[next[m->soups[i].materialIndex]++] = i;
+  free(next);
+}
+static void render_mesh_free(RenderMesh *m) {
+  free(m->order);
+  free(m->material_first);
+  free(m->material_indices);
+}
+// Average cache miss ratio of a FIFO cache: vertices transformed per triangle, with the cache emptied
+// at the start of each draw. Stamps hold the miss count at which a vertex entered the cache, plus one.
+typedef struct {
+  u32 *stamps;
+  u64 misses, base;
+} CacheSim;
+static void cache_sim_draw(CacheSim *c) {
+  c->base = c->misses;
+}
+static void cache_sim_vertex(CacheSim *c, u32 v) {
+  u64 stamp = c->stamps[v];
+  if (stamp > c->base && c->misses - (stamp - 1) < MESH_CACHE_SIZE)
+    return;
+  c->stamps[v] = ++c->misses;
+}
+// Tipsify over one batch. Fans around the current vertex, then moves to the neighbour that will still
+// be in the cache after its remaining triangles are emitted, falling back to recently used vertices
+// and finally to the next vertex with triangles left.
+static void tipsify(const u32 *in, size_t tri_count, size_t vertex_count, u32 *out) {
+  u32 *offsets = calloc(vertex_count + 1, sizeof(u32));
+  u32 *live = calloc(vertex_count, sizeof(u32));
+  u32 *stamps = calloc(vertex_count, sizeof(u32));
+  u32 *adjacency = malloc(sizeof(u32) * tri_count * 3);
+  u32 *dead_end = malloc(sizeof(u32) * tri_count * 3);
+  u32 *candidates = malloc(sizeof(u32) * tri_count * 3);
+  u8 *emitted = calloc(tri_count, 1);
+  for (size_t i = 0; i < tri_count * 3; ++i)
+    live[in[i]]++;
+  for (size_t v = 0; v < vertex_count; ++v)
+    offsets[v + 1] = offsets[v] + live[v];
+  u32 *fill = malloc(sizeof(u32) * (vertex_count + 1));
+  memcpy(fill, offsets, sizeof(u32) * (vertex_count + 1));
+  for (size_t i = 0; i < tri_count * 3; ++i)
+    adjacency[fill[in[i]]++] = i / 3;
+  free(fill);
+  size_t dead_count = 0, cursor = 0, written = 0;
+  u32 time = MESH_CACHE_SIZE + 1;
+  s64 fan = 0;
+  while (fan >= 0) {
+    size_t candidate_count = 0;
+    for (u32 j = offsets[fan]; j < offsets[fan + 1]; ++j) {
+      u32 t = adjacency[j];
+      if (emitted[t])
+        continue;
+      emitted[t] = 1;
+      for (int k = 0; k < 3; ++k) {
+        u32 v = in[t * 3 + k];
+        out[written++] = v;
+        dead_end[dead_count++] = v;
+        candidates[candidate_count++] = v;
+        live[v]--;
+        if (time - stamps[v] > MESH_CACHE_SIZE)
+          stamps[v] = time++;
+      }
+    }
+    // Only a neighbour that stays in the cache counts, anything else falls back to the dead-end stack.
+    fan = -1;
+    s64 best_priority = 0;
+    for (size_t j = 0; j < candidate_count; ++j) {
+      u32 v = candidates[j];
+      if (!live[v])
+        continue;
+      s64 priority = 0;
+      if (time - stamps[v] + 2 * live[v] <= MESH_CACHE_SIZE)
+        priority = time - stamps[v];
+      if (priority > best_priority) {
+        best_priority = priority;
+        fan = v;
+      }
+    }
+    while (fan < 0 && dead_count) {
+      u32 v = dead_end[--dead_count];
+      if (live[v])
+        fan = v;
+    }
+    while (fan < 0 && cursor < vertex_count) {
+      if (live[cursor])
+        fan = cursor;
+      ++cursor;
+    }
+  }
+  free(offsets);
+  free(live);
+  free(stamps);
+  free(adjacency);
+  free(dead_end);
+  free(candidates);
+  free(emitted);
+}
+// Greedy meshlets over the optimized order: a meshlet is closed when the next triangle would take it
+// past MESHLET_MAX_VERTICES or MESHLET_MAX_TRIANGLES. Each gets its box and a sphere around the box
+// center for culling. slots maps the batch's local vertices to meshlet slots and must start out -1.
+static void build_meshlets(DrawBatches *d, size_t batch, DiskGfxVertex *verts, s32 *slots) {
+  DrawBatch *b = &d->batches[batch];
+  const u32 *local = &d->local[b->first_index];
+  const u32 *vertices = &d->vertices[d->vertex_first[batch]];
+  size_t tri_count = b->index_count / 3;
+  u32 members[MESHLET_MAX_VERTICES];
+  Meshlet cur = {0};
+  b->first_meshlet = buf_size(d->meshlets);
+  for (size_t t = 0; t <= tri_count; ++t) {
+    bool full = t == tri_count || cur.triangle_count == MESHLET_MAX_TRIANGLES;
+    if (!full) {
+      size_t added = 0;
+      for (int k = 0; k < 3; ++k)
+        added += slots[local[t * 3 + k]] < 0;
+      full = cur.vertex_count + added > MESHLET_MAX_VERTICES;
+    }
+    if (full && cur.triangle_count) {
+      vec3 mins = { FLT_MAX, FLT_MAX, FLT_MAX }, maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+      for (u32 j = 0; j < cur.vertex_count; ++j) {
+        for (int k = 0; k < 3; ++k) {
+          mins[k] = fminf(mins[k], verts[vertices[members[j]]].xyz[k]);
+          maxs[k] = fmaxf(maxs[k], verts[vertices[members[j]]].xyz[k]);
+        }
+      }
+      vec3_dup(cur.mins, mins);
+      vec3_dup(cur.maxs, maxs);
+      vec3_add(cur.center, mins, maxs);
+      vec3_scale(cur.center, cur.center, 0.5f);
+      for (u32 j = 0; j < cur.vertex_count; ++j) {
+        vec3 delta;
+        vec3_sub(delta, verts[vertices[members[j]]].xyz, cur.center);
+        cur.radius = fmaxf(cur.radius, vec3_len(delta));
+        slots[members[j]] = -1;
+      }
+      buf_push(d->meshlets, cur);
+      cur = (Meshlet) {0};
+    }
+    if (t == tri_count)
+      break;
+    if (!cur.triangle_count) {
+      cur.first_vertex = buf_size(d->meshlet_vertices);
+      cur.first_triangle = buf_size(d->meshlet_triangles) / 3;
+    }
+    for (int k = 0; k < 3; ++k) {
+      u32 v = local[t * 3 + k];
+      if (slots[v] < 0) {
+        slots[v] = cur.vertex_count;
+        members[cur.vertex_count++] = v;
+        buf_push(d->meshlet_vertices, vertices[v]);
+      }
+      buf_push(d->meshlet_triangles, (u8)slots[v]);
+    }
+    cur.triangle_count++;
+  }
+  b->meshlet_count = buf_size(d->meshlets) - b->first_meshlet;
+}
+// Orders the soups by material, then lightmap (two stable counting sorts, soup order kept within a
+// batch) and concatenates each run into one batch, numbering its vertices in order of first use.
+static void draw_batches_merge(RenderMesh *m, DrawBatches *d) {
+  memset(d, 0, sizeof(*d));
+  u32 *by_lightmap = malloc(sizeof(u32) * (m->soup_count + 1));
+  u32 *order = malloc(sizeof(u32) * (m->soup_count + 1));
+  u32 *counts = calloc(65536 + 1, sizeof(u32));
+  for (size_t i = 0; i < m->soup_count; ++i)
+    counts[m->soups[i].lightmapIndex + 1]++;
+  for (size_t i = 0; i < 65536; ++i)
+    counts[i + 1] += counts[i];
+  for (size_t i = 0; i < m->soup_count; ++i)
+    by_lightmap[counts[m->soups[i].lightmapIndex]++] = i;
+  memset(counts, 0, sizeof(u32) * (65536 + 1));
+  for (size_t i = 0; i < m->soup_count; ++i)
+    counts[m->soups[i].materialIndex + 1]++;
+  for (size_t i = 0; i < 65536; ++i)
+    counts[i + 1] += counts[i];
+  for (size_t i = 0; i < m->soup_count; ++i)
+    order[counts[m->soups[by_lightmap[i]].materialIndex]++] = by_lightmap[i];
+  free(counts);
+  free(by_lightmap);
+  size_t index_total = 0;
+  for (size_t i = 0; i < m->material_count; ++i)
+    index_total += m->material_indices[i];
+  buf_grow(d->indices, index_total);
+  buf_grow(d->local, index_total);
+  s32 *remap = malloc(sizeof(s32) * (m->vert_count + 1));
+  memset(remap, 0xff, sizeof(s32) * (m->vert_count + 1));
+  for (size_t i = 0; i < m->soup_count;) {
+    DiskTriangleSoup *first = &m->soups[order[i]];
+    DrawBatch b = { .material = first->materialIndex, .lightmap = first->lightmapIndex,
+                    .first_index = buf_size(d->indices) };
+    u32 vertex_first = buf_size(d->vertices);
+    for (; i < m->soup_count; ++i) {
+      DiskTriangleSoup *s = &m->soups[order[i]];
+      if (s->materialIndex != b.material || s->lightmapIndex != b.lightmap)
+        break;
+      for (size_t j = 0; j < (size_t)(s->indexCount - s->indexCount % 3); ++j) {
+        u32 v = s->firstVertex + m->indices[s->firstIndex + j];
+        if (remap[v] < 0) {
+          remap[v] = b.vertex_count++;
+          buf_push(d->vertices, v);
+        }
+        buf_push(d->indices, v);
+        buf_push(d->local, remap[v]);
+      }
+    }
+    for (size_t j = vertex_first; j < buf_size(d->vertices); ++j)
+      remap[d->vertices[j]] = -1;
+    b.index_count = buf_size(d->indices) - b.first_index;
+    if (b.index_count) {
+      buf_push(d->batches, b);
+      buf_push(d->vertex_first, vertex_first);
+    }
+  }
+  free(remap);
+  free(order);
+}
+static void tipsify_job(void *ctx, size_t index) {
+  DrawBatches *d = ctx;
+  DrawBatch *b = &d->batches[index];
+  u32 *local = &d->local[b->first_index];
+  const u32 *vertices = &d->vertices[d->vertex_first[index]];
+  u32 *out = malloc(sizeof(u32) * b->index_count);
+  tipsify(local, b->index_count / 3, b->vertex_count, out);
+  memcpy(local, out, sizeof(u32) * b->index_count);
+  for (size_t i = 0; i < b->index_count; ++i)
+    d->indices[b->first_index + i] = vertices[local[i]];
+  free(out);
+}
+static void draw_batches_free(DrawBatches *d) {
+  buf_free(d->batches);
+  buf_free(d->indices);
+  buf_free(d->local);
+  buf_free(d->vertices);
+  buf_free(d->vertex_first);
+  buf_free(d->meshlets);
+  buf_free(d->meshlet_vertices);
+  buf_free(d->meshlet_triangles);
+}
+static double soups_acmr(RenderMesh *m, CacheSim *c) {
+  size_t triangles = 0;
+  c->misses = 0;
+  memset(c->stamps, 0, sizeof(u32) * m->vert_count);
+  for (size_t i = 0; i < m->soup_count; ++i) {
+    DiskTriangleSoup *s = &m->soups[i];
+    cache_sim_draw(c);
+    for (size_t j = 0; j < (size_t)(s->indexCount - s->indexCount % 3); ++j)
+      cache_sim_vertex(c, s->firstVertex + m->indices[s->firstIndex + j]);
+    triangles += s->indexCount / 3;
+  }
+  return triangles ? (double)c->misses / triangles : 0.0;
+}
+static double draw_batches_acmr(RenderMesh *m, DrawBatches *d, CacheSim *c) {
+  c->misses = 0;
+  memset(c->stamps, 0, sizeof(u32) * m->vert_count);
+  for (size_t i = 0; i < buf_size(d->batches); ++i) {
+    DrawBatch *b = &d->batches[i];
+    cache_sim_draw(c);
+    for (size_t j = 0; j < b->index_count; ++j)
+      cache_sim_vertex(c, d->indices[b->first_index + j]);
+  }
+  return buf_size(d->indices) ? (double)c->misses / (buf_size(d->indices) / 3) : 0.0;
+}
+// Merges and reorders the soups, reporting draw count and ACMR at each step. Afterwards exports
+// write the batches instead of one draw per material.
+static void optimize_mesh(Bsp *bsp, FILE *out, RenderMesh *m, DrawBatches *d, bool meshlets) {
+  CacheSim cache = { .stamps = malloc(sizeof(u32) * (m->vert_count + 1)) };
+  double soups = soups_acmr(m, &cache);
+  double t0 = time_seconds();
+  draw_batches_merge(m, d);
+  double merge_time = time_seconds() - t0;
+  double merged = draw_batches_acmr(m, d, &cache);
+  t0 = time_seconds();
+  parallel_for(buf_size(d->batches), bsp->threads, tipsify_job, d);
+  double tipsify_time = time_seconds() - t0;
+  double optimized = draw_batches_acmr(m, d, &cache);
+  free(cache.stamps);
+  fprintf(out, "Draws: %zu soups, %zu batches (material and lightmap)\n", m->soup_count, buf_size(d->batches));
+  fprintf(out, "ACMR (FIFO %d): %.3f per soup, %.3f merged, %.3f optimized\n", MESH_CACHE_SIZE, soups, merged, optimized);
+  fprintf(out, "Merged in %.3f ms, reordered in %.3f ms\n", merge_time * 1000.0, tipsify_time * 1000.0);
+  if (meshlets) {
+    t0 = time_seconds();
+    s32 *slots = malloc(sizeof(s32) * (m->vert_count + 1));
+    memset(slots, 0xff, sizeof(s32) * (m->vert_count + 1));
+    for (size_t i = 0; i < buf_size(d->batches); ++i)
+      build_meshlets(d, i, m->verts, slots);
+    free(slots);
+    size_t count = buf_size(d->meshlets);
+    fprintf(out, "Meshlets: %zu (at most %d vertices, %d triangles), %.1f vertices and %.1f triangles on average, %.3f ms\n",
+            count, MESHLET_MAX_VERTICES, MESHLET_MAX_TRIANGLES, count ? (double)buf_size(d->meshlet_vertices) / count : 0.0,
+            count ? (double)buf_size(d->meshlet_triangles) / 3 / count : 0.0, (time_seconds() - t0) * 1000.0);
+  }
+  m->draws = d;
+}
+static void writer_json_string(Writer *w, const char *s) {
+  writer_literal(w, "\"");
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      writer_literal(w, "\\");
+      writer_write(w, s, 1);
+    } else if ((u8)*s < 0x20) {
+      char tmp[8];
+      snprintf(tmp, sizeof(tmp), "\\u%04x", (u8)*s);
+      writer_string(w, tmp);
+    } else {
+      writer_write(w, s, 1);
+    }
+  }
+  writer_literal(w, "\"");
+}
+// glTF wants the position bounds to match the data exactly, so these get all nine significant digits.
+static void writer_json_float(Writer *w, float x) {
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), "%.9g", x);
+  writer_string(w, tmp);
+}
+static void writer_u32_le(Writer *w, u32 v) {
+  u8 b[4] = { v, v >> 8, v >> 16, v >> 24 };
+  writer_write(w, b, 4);
+}
+// The draws an export writes: one per material, or the batches once the mesh has been optimized.
+// Returns the index count of draw i, which is zero for materials nothing uses.
+static size_t render_mesh_draw_count(RenderMesh *m) {
+  return m->draws ? buf_size(m->draws->batches) : m->material_count;
+}
+static u32 render_mesh_draw(RenderMesh *m, size_t i, u32 *material) {
+  if (m->draws) {
+    *material = m->draws->batches[i].material;
+    return m->draws->batches[i].index_count;
+  }
+  *material = i;
+  return m->material_indices[i];
+}
+// Binary glTF. The drawverts lump goes into the buffer as it is, one interleaved buffer view with
+// the position, normal, color and both texture coordinates as strided accessors into it, followed by
+// 32 bit indices per draw, rebased onto each soup's first vertex. The map is z up, the node turns
+// it to glTF's y up.
+// Meshlets have no core glTF representation, so they go in as extras: the mesh's extras name three
+// more buffer views, the Meshlet records as they are in memory, their u32 drawvert indices and their
+// u8 local triangle indices, and each primitive's extras give its [first, count] meshlets.
+static void write_glb(RenderMesh *m, Writer *w) {
+  size_t vert_bytes = sizeof(DiskGfxVertex) * m->vert_count;
+  DrawBatches *d = m->draws;
+  size_t meshlet_count = d ? buf_size(d->meshlets) : 0;
+  size_t meshlet_bytes = sizeof(Meshlet) * meshlet_count;
+  size_t meshlet_vertex_bytes = meshlet_count ? sizeof(u32) * buf_size(d->meshlet_vertices) : 0;
+  size_t meshlet_triangle_bytes = meshlet_count ? buf_size(d->meshlet_triangles) : 0;
+  size_t meshlet_padding = (4 - meshlet_triangle_bytes % 4) % 4;
+  vec3 mins = { FLT_MAX, FLT_MAX, FLT_MAX }, maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (size_t i = 0; i < m->vert_count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      mins[k] = fminf(mins[k], m->verts[i].xyz[k]);
+      maxs[k] = fmaxf(maxs[k], m->verts[i].xyz[k]);
+    }
+  }
+  size_t index_total = 0;
+  for (size_t i = 0; i < m->material_count; ++i)
+    index_total += m->material_indices[i];
+  Writer json = {0};
+  writer_literal(&json, "{\"asset\":{\"version\":\"2.0\",\"generator\":\"bsp.c\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],");
+  writer_literal(&json, "\"nodes\":[{\"mesh\":0,\"rotation\":[-0.70710678,0,0,0.70710678]}],\"meshes\":[{\"primitives\":[");
+  // Only the materials something uses are written, slots holds their glTF index.
+  u32 *slots = malloc(sizeof(u32) * (m->material_count + 1));
+  size_t used = 0;
+  for (size_t i = 0; i < m->material_count; ++i)
+    slots[i] = m->material_indices[i] ? used++ : 0;
+  size_t primitives = 0;
+  for (size_t i = 0; i < render_mesh_draw_count(m); ++i) {
+    u32 material;
+    if (!render_mesh_draw(m, i, &material))
+      continue;
+    if (primitives)
+      writer_literal(&json, ",");
+    writer_literal(&json, "{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"COLOR_0\":2,\"TEXCOORD_0\":3,\"TEXCOORD_1\":4},\"indices\":");
+    writer_int(&json, 5 + primitives);
+    writer_literal(&json, ",\"material\":");
+    writer_int(&json, slots[material]);
+    if (meshlet_count) {
+      writer_literal(&json, ",\"extras\":{\"meshlets\":[");
+      writer_int(&json, d->batches[i].first_meshlet);
+      writer_literal(&json, ",");
+      writer_int(&json, d->batches[i].meshlet_count);
+      writer_literal(&json, "]}");
+    }
+    writer_literal(&json, "}");
+    ++primitives;
+  }
+  free(slots);
+  if (meshlet_count)
+    writer_literal(&json, "],\"extras\":{\"meshlets\":{\"meshlets\":2,\"vertices\":3,\"triangles\":4}}}],\"materials\":[");
+  else
+    writer_literal(&json, "]}],\"materials\":[");
+  primitives = 0;
+  for (size_t i = 0; i < m->material_count; ++i) {
+    if (!m->material_indices[i])
+      continue;
+    char name[sizeof(m->materials[i].material) + 1] = {0};
+    memcpy(name, m->materials[i].material, sizeof(m->materials[i].material));
+    writer_string(&json, primitives++ ? ",{\"name\":" : "{\"name\":");
+    writer_json_string(&json, name);
+    writer_literal(&json, ",\"doubleSided\":true}");
+  }
+  size_t bin_bytes = vert_bytes + index_total * 4 + meshlet_bytes + meshlet_vertex_bytes + meshlet_triangle_bytes
+                   + meshlet_padding;
+  writer_literal(&json, "],\"buffers\":[{\"byteLength\":");
+  writer_int(&json, bin_bytes);
+  writer_literal(&json, "}],\"bufferViews\":[{\"buffer\":0,\"byteLength\":");
+  writer_int(&json, vert_bytes);
+  writer_literal(&json, ",\"byteStride\":");
+  writer_int(&json, sizeof(DiskGfxVertex));
+  writer_literal(&json, ",\"target\":34962},{\"buffer\":0,\"byteOffset\":");
+  writer_int(&json, vert_bytes);
+  writer_literal(&json, ",\"byteLength\":");
+  writer_int(&json, index_total * 4);
+  writer_literal(&json, ",\"target\":34963}");
+  if (meshlet_count) {
+    size_t sections[3] = { meshlet_bytes, meshlet_vertex_bytes, meshlet_triangle_bytes };
+    size_t offset = vert_bytes + index_total * 4;
+    for (int k = 0; k < 3; ++k) {
+      writer_literal(&json, ",{\"buffer\":0,\"byteOffset\":");
+      writer_int(&json, offset);
+      writer_literal(&json, ",\"byteLength\":");
+      writer_int(&json, sections[k]);
+      writer_literal(&json, "}");
+      offset += sections[k];
+    }
+  }
+  writer_literal(&json, "],\"accessors\":[");
+  struct {
+    size_t offset;
+    int component;
+    const char *type;
+    bool normalized;
+  } attributes[] = {
+    { offsetof(DiskGfxVertex, xyz), 5126, "VEC3", false },
+    { offsetof(DiskGfxVertex, normal), 5126, "VEC3", false },
+    { offsetof(DiskGfxVertex, color), 5121, "VEC4", true },
+    { offsetof(DiskGfxVertex, texCoord), 5126, "VEC2", false },
+    { offsetof(DiskGfxVertex, lmapCoord), 5126, "VEC2", false },
+  };
+  for (size_t i = 0; i < sizeof(attributes) / sizeof(attributes[0]); ++i) {
+    writer_string(&json, i ? ",{\"bufferView\":0,\"byteOffset\":" : "{\"bufferView\":0,\"byteOffset\":");
+    writer_int(&json, attributes[i].offset);
+    writer_literal(&json, ",\"componentType\":");
+    writer_int(&json, attributes[i].component);
+    if (attributes[i].normalized)
+      writer_literal(&json, ",\"normalized\":true");
+    writer_literal(&json, ",\"count\":");
+    writer_int(&json, m->vert_count);
+    writer_literal(&json, ",\"type\":\"");
+    writer_string(&json, attributes[i].type);
+    writer_literal(&json, "\"");
+    if (i == 0) {
+      for (int k = 0; k < 3; ++k) {
+        writer_string(&json, k ? "," : ",\"min\":[");
+        writer_json_float(&json, mins[k]);
+      }
+      for (int k = 0; k < 3; ++k) {
+        writer_string(&json, k ? "," : "],\"max\":[");
+        writer_json_float(&json, maxs[k]);
+      }
+      writer_literal(&json, "]");
+    }
+    writer_literal(&json, "}");
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < render_mesh_draw_count(m); ++i) {
+    u32 material;
+    u32 count = render_mesh_draw(m, i, &material);
+    if (!count)
+      continue;
+    writer_literal(&json, ",{\"bufferView\":1,\"byteOffset\":");
+    writer_int(&json, offset);
+    writer_literal(&json, ",\"componentType\":5125,\"count\":");
+    writer_int(&json, count);
+    writer_literal(&json, ",\"type\":\"SCALAR\"}");
+    offset += count * 4;
+  }
+  writer_literal(&json, "]}");
+  while (buf_size(json.data) % 4)
+    writer_literal(&json, " ");
+  size_t json_bytes = buf_size(json.data);
+  writer_literal(w, "glTF");
+  writer_u32_le(w, 2);
+  writer_u32_le(w, 12 + 8 + json_bytes + 8 + bin_bytes);
+  writer_u32_le(w, json_bytes);
+  writer_literal(w, "JSON");
+  writer_write(w, json.data, json_bytes);
+  writer_free(&json);
+  writer_u32_le(w, bin_bytes);
+  writer_write(w, "BIN\0", 4);
+  writer_write(w, m->verts, vert_bytes);
+  if (d) {
+    writer_write(w, d->indices, sizeof(u32) * buf_size(d->indices));
+    if (meshlet_count) {
+      writer_write(w, d->meshlets, meshlet_bytes);
+      writer_write(w, d->meshlet_vertices, meshlet_vertex_bytes);
+      writer_write(w, d->meshlet_triangles, meshlet_triangle_bytes);
+      writer_write(w, "\0\0\0", meshlet_padding);
+    }
+    return;
+  }
+  u32 chunk[MESH_INDEX_CHUNK];
+  size_t n = 0;
+  for (size_t i = 0; i < m->soup_count; ++i) {
+    DiskTriangleSoup *s = &m->soups[m->order[i]];
+    u16 *indices = &m->indices[s->firstIndex];
+    for (size_t j = 0; j < (size_t)(s->indexCount - s->indexCount % 3); ++j) {
+      chunk[n++] = s->firstVertex + indices[j];
+      if (n == MESH_INDEX_CHUNK) {
+        writer_write(w, chunk, sizeof(chunk));
+        n = 0;
+      }
+    }
+  }
+  writer_write(w, chunk, sizeof(u32) * n);
+}
+static void writer_obj_face(Writer *w, s64 a, s64 b, s64 c) {
+  s64 v[3] = { a + 1, b + 1, c + 1 };
+  writer_literal(w, "f");
+  for (int k = 0; k < 3; ++k) {
+    writer_literal(w, " ");
+    writer_int(w, v[k]);
+    writer_literal(w, "/");
+    writer_int(w, v[k]);
+    writer_literal(w, "/");
+    writer_int(w, v[k]);
+  }
+  writer_literal(w, "\n");
+}
+static void writer_obj_material(Writer *w, dmaterial_t *material) {
+  char name[sizeof(material->material) + 1] = {0};
+  memcpy(name, material->material, sizeof(material->material));
+  writer_literal(w, "usemtl ");
+  writer_string(w, name);
+  writer_literal(w, "\n");
+}
+// Wavefront OBJ in map coordinates. Texture v is flipped, OBJ puts its origin at the bottom.
+static void write_obj(RenderMesh *m, Writer *w) {
+  for (size_t i = 0; i < m->vert_count; ++i) {
+    DiskGfxVertex *v = &m->verts[i];
+    writer_literal(w, "v ");
+    writer_vec3(w, v->xyz[0], v->xyz[1], v->xyz[2]);
+    writer_literal(w, "\n");
+  }
+  for (size_t i = 0; i < m->vert_count; ++i) {
+    DiskGfxVertex *v = &m->verts[i];
+    writer_literal(w, "vt ");
+    writer_float(w, v->texCoord[0]);
+    writer_literal(w, " ");
+    writer_float(w, 1.f - v->texCoord[1]);
+    writer_literal(w, "\n");
+  }
+  for (size_t i = 0; i < m->vert_count; ++i) {
+    DiskGfxVertex *v = &m->verts[i];
+    writer_literal(w, "vn ");
+    writer_vec3(w, v->normal[0], v->normal[1], v->normal[2]);
+    writer_literal(w, "\n");
+  }
+  if (m->draws) {
+    for (size_t i = 0; i < buf_size(m->draws->batches); ++i) {
+      DrawBatch *b = &m->draws->batches[i];
+      u32 *indices = &m->draws->indices[b->first_index];
+      writer_obj_material(w, &m->materials[b->material]);
+      for (size_t k = 0; k < b->index_count; k += 3)
+        writer_obj_face(w, indices[k], indices[k + 1], indices[k + 2]);
+    }
+    return;
+  }
+  for (size_t i = 0; i < m->material_count; ++i) {
+    if (!m->material_indices[i])
+      continue;
+    writer_obj_material(w, &m->materials[i]);
+    for (size_t j = m->material_first[i]; j < m->material_first[i + 1]; ++j) {
+      DiskTriangleSoup *s = &m->soups[m->order[j]];
+      u16 *indices = &m->indices[s->firstIndex];
+      for (size_t k = 0; k + 3 <= s->indexCount; k += 3) {
+        s64 first = s->firstVertex;
+        writer_obj_face(w, first + indices[k], first + indices[k + 1], first + indices[k + 2]);
+      }
+    }
+  }
+}
+// With optimize the soups are merged and reordered first (see optimize_mesh). A NULL path only
+// prints that report.
+static void export_mesh(Bsp *bsp, FILE *out, const char *path, bool obj, bool optimize, bool meshlets) {
+  RenderMesh m;
+  DrawBatches draws;
+  render_mesh_load(bsp, &m);
+  size_t index_total = 0;
+  for (size_t i = 0; i < m.material_count; ++i)
+    index_total += m.material_indices[i];
+  if (!index_total) {
+    fprintf(out, "No render geometry to export\n");
+    render_mesh_free(&m);
+    return;
+  }
+  if (optimize)
+    optimize_mesh(bsp, out, &m, &draws, meshlets);
+  if (path && obj && meshlets)
+    fprintf(out, "OBJ has no place for meshlets, they are only written to glTF\n");
+  FILE *fp = path ? fopen(path, "wb") : NULL;
+  if (path && !fp)
+    fprintf(out, "Failed to open '%s'\n", path);
+  if (fp) {
+    fprintf(out, "Exporting %zu triangle soups to '%s'\n", m.soup_count, path);
+    Writer w = { .fp = fp };
+    if (obj)
+      write_obj(&m, &w);
+    else
+      write_glb(&m, &w);
+    writer_free(&w);
+    fclose(fp);
+  }
+  if (optimize)
+    draw_batches_free(&draws);
+  render_mesh_free(&m);
+}
+// Binned SAH build (Wald 2007): centroids are binned along each axis, the cheapest plane by surface
+// area heuristic wins, and a range becomes a leaf when no split beats intersecting it whole. The top
+// of the tree is built on one thread until ranges drop below a task size, then the subtrees are
+// built in parallel into their own node lists and spliced in. Ranges that reach the depth the cast
+// stacks allow become leafs whatever their size, so a degenerate tree gets slower, not wrong.
+#define BVH_BINS 16
+#define BVH_LEAF_MIN 2
+#define BVH_LEAF_MAX 16
+#define BVH_TRAVERSAL_COST 1.f
+#define BVH_TASK_MIN 4096
+#define BVH_STACK_SIZE 256
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 1)
+#define RAY_PACKET_SIZE 8
+#define RAYCAST_CHUNK 1024
+typedef struct {
+  vec3 mins, maxs, center;
+  u32 tri;
+} BvhRef;
+typedef struct {
+  u32 node, begin, end, depth;
+  BvhNode *nodes; // the subtree, its root at 0
+} BvhTask;
+typedef struct {
+  vec3 mins, maxs;
+  u32 count;
+} BvhBin;
+// Plain compares: fminf and fmaxf have to handle NaNs and end up as library calls in these loops.
+static float bvh_min(float a, float b) {
+  return a < b ? a : b;
+}
+static float bvh_max(float a, float b) {
+  return a > b ? a : b;
+}
+static float bvh_area(const vec3 mins, const vec3 maxs) {
+  vec3 d;
+  vec3_sub(d, maxs, mins);
+  return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+static void bvh_grow(vec3 mins, vec3 maxs, const vec3 a, const vec3 b) {
+  for (int k = 0; k < 3; ++k) {
+    mins[k] = bvh_min(mins[k], a[k]);
+    maxs[k] = bvh_max(maxs[k], b[k]);
+  }
+}
+// Builds the node at index node and depth (the root being 1) over refs[begin, end). With tasks, ranges
+// of at most task_size are recorded there instead of being built.
+static void bvh_build(BvhNode **nodes, BvhRef *refs, u32 node, u32 begin, u32 end, u32 depth, BvhTask **tasks,
+               size_t task_size) {
+  vec3 mins = { FLT_MAX, FLT_MAX, FLT_MAX }, maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  vec3 cmins = { FLT_MAX, FLT_MAX, FLT_MAX }, cmaxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (u32 i = begin; i < end; ++i) {
+    bvh_grow(mins, maxs, refs[i].mins, refs[i].maxs);
+    bvh_grow(cmins, cmaxs, refs[i].center, refs[i].center);
+  }
+  BvhNode *n = &(*nodes)[node];
+  vec3_dup(n->mins, mins);
+  vec3_dup(n->maxs, maxs);
+  n->first = begin;
+  n->count = end - begin;
+  if (end - begin <= BVH_LEAF_MIN || depth >= BVH_MAX_DEPTH)
+    return;
+  if (tasks && end - begin <= task_size) {
+    buf_push(*tasks, ((BvhTask) { node, begin, end, depth, NULL }));
+    return;
+  }
+  float best_cost = FLT_MAX;
+  int best_axis = -1;
+  u32 best_split = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    float extent = cmaxs[axis] - cmins[axis];
+    if (extent <= 0.f)
+      continue;
+    float scale = BVH_BINS / extent;
+    BvhBin bins[BVH_BINS];
+    for (int j = 0; j < BVH_BINS; ++j)
+      bins[j] = (BvhBin) { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX }, 0 };
+    for (u32 i = begin; i < end; ++i) {
+      int j = (int)((refs[i].center[axis] - cmins[axis]) * scale);
+      j = j < BVH_BINS ? j : BVH_BINS - 1;
+      bvh_grow(bins[j].mins, bins[j].maxs, refs[i].mins, refs[i].maxs);
+      bins[j].count++;
+    }
+    // Right to left sweep for the right side areas, then left to right evaluating each plane.
+    float right_area[BVH_BINS];
+    vec3 rmins = { FLT_MAX, FLT_MAX, FLT_MAX }, rmaxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int j = BVH_BINS - 1; j > 0; --j) {
+      bvh_grow(rmins, rmaxs, bins[j].mins, bins[j].maxs);
+      right_area[j] = rmins[0] <= rmaxs[0] ? bvh_area(rmins, rmaxs) : 0.f;
+    }
+    vec3 lmins = { FLT_MAX, FLT_MAX, FLT_MAX }, lmaxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    u32 left_count = 0;
+    for (int j = 1; j < BVH_BINS; ++j) {
+      bvh_grow(lmins, lmaxs, bins[j - 1].mins, bins[j - 1].maxs);
+      left_count += bins[j - 1].count;
+      u32 right_count = end - begin - left_count;
+      if (!left_count || !right_count)
+        continue;
+      float cost = bvh_area(lmins, lmaxs) * left_count + right_area[j] * right_count;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = j;
+      }
+    }
+  }
+  float leaf_cost = (float)(end - begin);
+  float split_cost = BVH_TRAVERSAL_COST + (best_axis < 0 ? FLT_MAX : best_cost / bvh_area(mins, maxs));
+  if (split_cost >= leaf_cost && end - begin <= BVH_LEAF_MAX)
+    return;
+  // With every centroid in one point there's no plane to bin on, halving the range still beats a huge leaf.
+  u32 mid = begin + (end - begin) / 2;
+  if (best_axis >= 0) {
+    float scale = BVH_BINS / (cmaxs[best_axis] - cmins[best_axis]);
+    u32 i = begin, j = end;
+    while (i < j) {
+      int bin = (int)((refs[i].center[best_axis] - cmins[best_axis]) * scale);
+      if ((bin < BVH_BINS ? bin : BVH_BINS - 1) < (int)best_split) {
+        ++i;
+      } else {
+        BvhRef tmp = refs[i];
+        refs[i] = refs[--j];
+        refs[j] = tmp;
+      }
+    }
+    mid = i;
+  }
+  u32 children = buf_size(*nodes);
+  buf_push(*nodes, (BvhNode) {0});
+  buf_push(*nodes, (BvhNode) {0});
+  (*nodes)[node].first = children;
+  (*nodes)[node].count = 0;
+  bvh_build(nodes, refs, children, begin, mid, depth + 1, tasks, task_size);
+  bvh_build(nodes, refs, children + 1, mid, end, depth + 1, tasks, task_size);
+}
+typedef struct {
+  BvhRef *refs;
+  BvhTask *tasks;
+} BvhTasks;
+static void bvh_task_job(void *ctx, size_t index) {
+  BvhTasks *bt = ctx;
+  BvhTask *task = &bt->tasks[index];
+  buf_push(task->nodes, (BvhNode) {0});
+  bvh_build(&task->nodes, bt->refs, 0, task->begin, task->end, task->depth, NULL, 0);
+}
+// Lazily builds the BVH over every complete triangle of the triangle soups.
+static void render_bvh_load(Bsp *bsp) {
+  RenderBvh *bvh = &bsp->bvh;
+  if (bvh->loaded)
+    return;
+  RenderMesh m;
+  render_mesh_load(bsp, &m);
+  size_t count = 0;
+  for (size_t i = 0; i < m.soup_count; ++i)
+    count += m.soups[i].indexCount / 3;
+  BvhRef *refs = malloc(sizeof(BvhRef) * (count + 1));
+  RenderTriangle *tris = malloc(sizeof(RenderTriangle) * (count + 1));
+  size_t n = 0;
+  for (size_t i = 0; i < m.soup_count; ++i) {
+    DiskTriangleSoup *s = &m.soups[i];
+    for (size_t j = 0; j + 3 <= s->indexCount; j += 3) {
+      float *p[3];
+      for (int k = 0; k < 3; ++k)
+        p[k] = m.verts[s->firstVertex + m.indices[s->firstIndex + j + k]].xyz;
+      RenderTriangle *t = &tris[n];
+      vec3_dup(t->v0, p[0]);
+      vec3_sub(t->e1, p[1], p[0]);
+      vec3_sub(t->e2, p[2], p[0]);
+      t->soup = i;
+      t->index = s->firstIndex + j;
+      BvhRef *r = &refs[n];
+      vec3_dup(r->mins, p[0]);
+      vec3_dup(r->maxs, p[0]);
+      bvh_grow(r->mins, r->maxs, p[1], p[1]);
+      bvh_grow(r->mins, r->maxs, p[2], p[2]);
+      vec3_add(r->center, r->mins, r->maxs);
+      vec3_scale(r->center, r->center, 0.5f);
+      r->tri = n++;
     }
-    for (size_t k = 0; k < numsides; ++k) {
-      cbrushside_t *side = &brushsides[side_offset + k];
-      DiskPlane *diskplane = &diskplanes[side->plane];
-      MapPlane plane = {0};
-      plane.distance = diskplane->dist;
-      snprintf(plane.material, sizeof(plane.material), "%s", materials[side->materialNum].material);
-      vec3_dup(plane.normal, diskplane->normal);
-      buf_push(dst.planes, plane);
+  }
+  render_mesh_free(&m);
+  bvh->tri_count = count;
+  if (count) {
+    size_t threads = bsp->threads ? bsp->threads : cpu_count();
+    size_t task_size = count / (threads * 8);
+    task_size = threads > 1 && task_size > BVH_TASK_MIN ? task_size : BVH_TASK_MIN;
+    BvhTasks bt = { .refs = refs };
+    buf_push(bvh->nodes, (BvhNode) {0});
+    bvh_build(&bvh->nodes, refs, 0, 0, count, 1, &bt.tasks, task_size);
+    parallel_for(buf_size(bt.tasks), bsp->threads, bvh_task_job, &bt);
+    // Splice: the subtree root replaces the placeholder, the rest is appended with child indices moved.
+    for (size_t i = 0; i < buf_size(bt.tasks); ++i) {
+      BvhTask *task = &bt.tasks[i];
+      u32 base = buf_size(bvh->nodes) - 1;
+      for (size_t j = 0; j < buf_size(task->nodes); ++j) {
+        BvhNode node = task->nodes[j];
+        if (!node.count)
+          node.first += base;
+        if (j)
+          buf_push(bvh->nodes, node);
+        else
+          bvh->nodes[task->node] = node;
+      }
+      buf_free(task->nodes);
     }
-    buf_push(mapbrushes, dst);
-    side_offset += numsides;
+    buf_free(bt.tasks);
   }
+  bvh->tris = malloc(sizeof(RenderTriangle) * (count + 1));
+  for (size_t i = 0; i < count; ++i)
+    bvh->tris[i] = tris[refs[i].tri];
+  free(tris);
+  free(refs);
+  bvh->loaded = true;
 }
-float mat3_determinant(mat3 m) {
-  return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
-       + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
-}
-bool mat3_inverse(mat3 result, mat3 m) {
-  float a, b, c, d, e, f, g, h, i;
-  a = m[0][0];
-  b = m[0][1];
-  c = m[0][2];
-  d = m[1][0];
-  e = m[1][1];
-  f = m[1][2];
-  g = m[2][0];
-  h = m[2][1];
-  i = m[2][2];
-  float det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
-  if (det == 0.0) {
+// Moller-Trumbore, two sided like the renderer draws them.
+static bool ray_triangle(const vec3 origin, const vec3 dir, const RenderTriangle *t, float tmax, RenderHit *hit) {
+  vec3 p, q, s;
+  vec3_mul_cross(p, dir, t->e2);
+  float det = vec3_mul_inner(t->e1, p);
+  if (fabsf(det) < 1e-12f)
     return false;
-  }
-  float inv_det = 1.f / det;
-  result[0][0] = (e * i - f * h) * inv_det;
-  result[0][1] = (c * h - b * i) * inv_det;
-  result[0][2] = (b * f - c * e) * inv_det;
-  result[1][0] = (f * g - d * i) * inv_det;
-  result[1][1] = (a * i - c * g) * inv_det;
-  result[1][2] = (c * d - a * f) * inv_det;
-  result[2][0] = (d * h - e * g) * inv_det;
-  result[2][1] = (b * g - a * h) * inv_det;
-  result[2][2] = (a * e - b * d) * inv_det;
+  float inv = 1.f / det;
+  vec3_sub(s, origin, t->v0);
+  float u = vec3_mul_inner(s, p) * inv;
+  if (u < 0.f || u > 1.f)
+    return false;
+  vec3_mul_cross(q, s, t->e1);
+  float v = vec3_mul_inner(dir, q) * inv;
+  if (v < 0.f || u + v > 1.f)
+    return false;
+  float d = vec3_mul_inner(t->e2, q) * inv;
+  if (d < 0.f || d >= tmax)
+    return false;
+  hit->t = d;
+  hit->u = u;
+  hit->v = v;
   return true;
 }
-void mat3_vec3_mul(vec3 result, mat3 m, vec3 v) {
-  result[0] = result[1] = result[2] = 0.f;
-  for (size_t i = 0; i < 3; ++i) {
-    for (size_t j = 0; j < 3; ++j) {
-      result[i] = result[i] + m[i][j] * v[j];
+static float ray_box_enter(const vec3 origin, const vec3 inv_dir, const vec3 mins, const vec3 maxs, float tmax) {
+  float enter = 0.f, leave = tmax;
+  for (int k = 0; k < 3; ++k) {
+    float t0 = (mins[k] - origin[k]) * inv_dir[k];
+    float t1 = (maxs[k] - origin[k]) * inv_dir[k];
+    enter = bvh_max(enter, bvh_min(t0, t1));
+    leave = bvh_min(leave, bvh_max(t0, t1));
+  }
+  return enter <= leave ? enter : FLT_MAX;
+}
+// Closest hit along one ray, nearer child first.
+static void render_ray_cast(RenderBvh *bvh, const RenderRay *ray, RenderHit *hit) {
+  hit->t = ray->tmax;
+  hit->triangle = -1;
+  if (!bvh->tri_count)
+    return;
+  vec3 inv_dir;
+  for (int k = 0; k < 3; ++k)
+    inv_dir[k] = 1.f / ray->dir[k];
+  TraceStackEntry stack[BVH_STACK_SIZE];
+  size_t sp = 0;
+  stack[sp++] = (TraceStackEntry) { 0, ray_box_enter(ray->origin, inv_dir, bvh->nodes[0].mins, bvh->nodes[0].maxs, hit->t) };
+  while (sp) {
+    TraceStackEntry top = stack[--sp];
+    if (top.enter >= hit->t)
+      continue;
+    BvhNode *node = &bvh->nodes[top.index];
+    if (node->count) {
+      for (u32 i = node->first; i < node->first + node->count; ++i) {
+        if (ray_triangle(ray->origin, ray->dir, &bvh->tris[i], hit->t, hit))
+          hit->triangle = i;
+      }
+      continue;
+    }
+    BvhNode *na = &bvh->nodes[node->first], *nb = na + 1;
+    TraceStackEntry a = { node->first, ray_box_enter(ray->origin, inv_dir, na->mins, na->maxs, hit->t) };
+    TraceStackEntry b = { node->first + 1, ray_box_enter(ray->origin, inv_dir, nb->mins, nb->maxs, hit->t) };
+    assert(sp + 2 <= BVH_STACK_SIZE);
+    if (a.enter != FLT_MAX && b.enter != FLT_MAX) {
+      stack[sp++] = a.enter > b.enter ? a : b;
+      stack[sp++] = a.enter > b.enter ? b : a;
+    } else if (a.enter != FLT_MAX) {
+      stack[sp++] = a;
+    } else if (b.enter != FLT_MAX) {
+      stack[sp++] = b;
     }
   }
 }
-bool polygon_has_pt(Polygon *polygon, vec3 pt) {
-  for (size_t i = 0; i < buf_size(polygon->points); ++i) {
-    vec3 v;
-    vec3_sub(v, pt, polygon->points[i]);
-    if (vec3_len(v) < 0.001)
-      return true;
+// RAY_PACKET_SIZE rays in structure of arrays form, traversed together: a node is opened when any of
+// them enters it, which for coherent rays (camera rays of neighbouring pixels, samples around a
+// point) fetches each node once for the whole packet. On x86 the lanes go through SSE four at a
+// time, elsewhere through the scalar loops.
+typedef struct {
+  float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+  float dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+  float ix[RAY_PACKET_SIZE], iy[RAY_PACKET_SIZE], iz[RAY_PACKET_SIZE];
+  float t[RAY_PACKET_SIZE], u[RAY_PACKET_SIZE], v[RAY_PACKET_SIZE];
+  s32 triangle[RAY_PACKET_SIZE];
+} RayPacket;
+#ifdef BSP_X86
+static float ray_packet_enter_sse(const RayPacket *rp, const BvhNode *node) {
+  __m128 best = _mm_set1_ps(FLT_MAX);
+  __m128 minx = _mm_set1_ps(node->mins[0]), miny = _mm_set1_ps(node->mins[1]), minz = _mm_set1_ps(node->mins[2]);
+  __m128 maxx = _mm_set1_ps(node->maxs[0]), maxy = _mm_set1_ps(node->maxs[1]), maxz = _mm_set1_ps(node->maxs[2]);
+  for (int l = 0; l < RAY_PACKET_SIZE; l += 4) {
+    __m128 ox = _mm_loadu_ps(&rp->ox[l]), oy = _mm_loadu_ps(&rp->oy[l]), oz = _mm_loadu_ps(&rp->oz[l]);
+    __m128 ix = _mm_loadu_ps(&rp->ix[l]), iy = _mm_loadu_ps(&rp->iy[l]), iz = _mm_loadu_ps(&rp->iz[l]);
+    __m128 x0 = _mm_mul_ps(_mm_sub_ps(minx, ox), ix), x1 = _mm_mul_ps(_mm_sub_ps(maxx, ox), ix);
+    __m128 y0 = _mm_mul_ps(_mm_sub_ps(miny, oy), iy), y1 = _mm_mul_ps(_mm_sub_ps(maxy, oy), iy);
+    __m128 z0 = _mm_mul_ps(_mm_sub_ps(minz, oz), iz), z1 = _mm_mul_ps(_mm_sub_ps(maxz, oz), iz);
+    __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)),
+                              _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+    __m128 leave = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)),
+                              _mm_min_ps(_mm_max_ps(z0, z1), _mm_loadu_ps(&rp->t[l])));
+    __m128 inside = _mm_cmple_ps(enter, leave);
+    best = _mm_min_ps(best, _mm_or_ps(_mm_and_ps(inside, enter), _mm_andnot_ps(inside, _mm_set1_ps(FLT_MAX))));
   }
-  return false;
+  best = _mm_min_ps(best, _mm_movehl_ps(best, best));
+  best = _mm_min_ss(best, _mm_shuffle_ps(best, best, 1));
+  return _mm_cvtss_f32(best);
 }
-#define buf_set_size(v, new_size)                                                                         \
-  do {                                                                                                    \
-    if (v) {                                                                                               \
-      buf_ptr((v))->size = (size_t)new_size > buf_ptr((v))->capacity ? buf_ptr((v))->capacity : new_size; \
-    }                                                                                                     \
-  } while(0)
-bool polygonize_brush(MapBrush *brush, Polygon **polygons_out) {
-  Polygon *polygons = NULL;
-  size_t plane_count = buf_size(brush->planes);
-  for (size_t i = 0; i < plane_count; ++i) {
-    MapPlane *p0 = &brush->planes[i];
-    Polygon polygon = { 0 };
-    polygon.plane = p0;
-    for (size_t j = 0; j < plane_count; ++j) {
-      if (j == i)
+static void ray_packet_triangle_sse(RayPacket *rp, const RenderTriangle *tri, s32 index) {
+  __m128 e1x = _mm_set1_ps(tri->e1[0]), e1y = _mm_set1_ps(tri->e1[1]), e1z = _mm_set1_ps(tri->e1[2]);
+  __m128 e2x = _mm_set1_ps(tri->e2[0]), e2y = _mm_set1_ps(tri->e2[1]), e2z = _mm_set1_ps(tri->e2[2]);
+  __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+  __m128 sign = _mm_set1_ps(-0.f);
+  for (int l = 0; l < RAY_PACKET_SIZE; l += 4) {
+    __m128 dx = _mm_loadu_ps(&rp->dx[l]), dy = _mm_loadu_ps(&rp->dy[l]), dz = _mm_loadu_ps(&rp->dz[l]);
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv = _mm_div_ps(one, det);
+    __m128 sx = _mm_sub_ps(_mm_loadu_ps(&rp->ox[l]), _mm_set1_ps(tri->v0[0]));
+    __m128 sy = _mm_sub_ps(_mm_loadu_ps(&rp->oy[l]), _mm_set1_ps(tri->v0[1]));
+    __m128 sz = _mm_sub_ps(_mm_loadu_ps(&rp->oz[l]), _mm_set1_ps(tri->v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+    __m128 d = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+    __m128 t = _mm_loadu_ps(&rp->t[l]);
+    __m128 hit = _mm_cmpge_ps(_mm_andnot_ps(sign, det), _mm_set1_ps(1e-12f));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(d, zero), _mm_cmplt_ps(d, t)));
+    if (!_mm_movemask_ps(hit))
+      continue;
+    _mm_storeu_ps(&rp->t[l], _mm_or_ps(_mm_and_ps(hit, d), _mm_andnot_ps(hit, t)));
+    _mm_storeu_ps(&rp->u[l], _mm_or_ps(_mm_and_ps(hit, u), _mm_andnot_ps(hit, _mm_loadu_ps(&rp->u[l]))));
+    _mm_storeu_ps(&rp->v[l], _mm_or_ps(_mm_and_ps(hit, v), _mm_andnot_ps(hit, _mm_loadu_ps(&rp->v[l]))));
+    __m128i tris = _mm_loadu_si128((__m128i*)&rp->triangle[l]);
+    __m128i mask = _mm_castps_si128(hit);
+    tris = _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi32(index)), _mm_andnot_si128(mask, tris));
+    _mm_storeu_si128((__m128i*)&rp->triangle[l], tris);
+  }
+}
+#define ray_packet_enter ray_packet_enter_sse
+#define ray_packet_triangle ray_packet_triangle_sse
+#else
+// Nearest entry into node over the lanes, FLT_MAX when none enters it.
+static float ray_packet_enter_scalar(const RayPacket *rp, const BvhNode *node) {
+  float best = FLT_MAX;
+  for (int l = 0; l < RAY_PACKET_SIZE; ++l) {
+    float x0 = (node->mins[0] - rp->ox[l]) * rp->ix[l], x1 = (node->maxs[0] - rp->ox[l]) * rp->ix[l];
+    float y0 = (node->mins[1] - rp->oy[l]) * rp->iy[l], y1 = (node->maxs[1] - rp->oy[l]) * rp->iy[l];
+    float z0 = (node->mins[2] - rp->oz[l]) * rp->iz[l], z1 = (node->maxs[2] - rp->oz[l]) * rp->iz[l];
+    float enter = bvh_max(bvh_max(bvh_min(x0, x1), bvh_min(y0, y1)), bvh_max(bvh_min(z0, z1), 0.f));
+    float leave = bvh_min(bvh_min(bvh_max(x0, x1), bvh_max(y0, y1)), bvh_min(bvh_max(z0, z1), rp->t[l]));
+    best = enter <= leave ? bvh_min(best, enter) : best;
+  }
+  return best;
+}
+static void ray_packet_triangle_scalar(RayPacket *rp, const RenderTriangle *tri, s32 index) {
+  for (int l = 0; l < RAY_PACKET_SIZE; ++l) {
+    float px = rp->dy[l] * tri->e2[2] - rp->dz[l] * tri->e2[1];
+    float py = rp->dz[l] * tri->e2[0] - rp->dx[l] * tri->e2[2];
+    float pz = rp->dx[l] * tri->e2[1] - rp->dy[l] * tri->e2[0];
+    float det = tri->e1[0] * px + tri->e1[1] * py + tri->e1[2] * pz;
+    float inv = 1.f / det;
+    float sx = rp->ox[l] - tri->v0[0], sy = rp->oy[l] - tri->v0[1], sz = rp->oz[l] - tri->v0[2];
+    float u = (sx * px + sy * py + sz * pz) * inv;
+    float qx = sy * tri->e1[2] - sz * tri->e1[1];
+    float qy = sz * tri->e1[0] - sx * tri->e1[2];
+    float qz = sx * tri->e1[1] - sy * tri->e1[0];
+    float v = (rp->dx[l] * qx + rp->dy[l] * qy + rp->dz[l] * qz) * inv;
+    float d = (tri->e2[0] * qx + tri->e2[1] * qy + tri->e2[2] * qz) * inv;
+    if (fabsf(det) >= 1e-12f && u >= 0.f && u <= 1.f && v >= 0.f && u + v <= 1.f && d >= 0.f && d < rp->t[l]) {
+      rp->t[l] = d;
+      rp->u[l] = u;
+      rp->v[l] = v;
+      rp->triangle[l] = index;
+    }
+  }
+}
+#define ray_packet_enter ray_packet_enter_scalar
+#define ray_packet_triangle ray_packet_triangle_scalar
+#endif
+// Up to RAY_PACKET_SIZE rays, results in hits. Unused lanes get an empty interval and never hit.
+static void render_ray_cast_packet(RenderBvh *bvh, const RenderRay *rays, size_t count, RenderHit *hits) {
+  RayPacket rp;
+  for (size_t l = 0; l < RAY_PACKET_SIZE; ++l) {
+    const RenderRay *r = &rays[l < count ? l : 0];
+    rp.ox[l] = r->origin[0], rp.oy[l] = r->origin[1], rp.oz[l] = r->origin[2];
+    rp.dx[l] = r->dir[0], rp.dy[l] = r->dir[1], rp.dz[l] = r->dir[2];
+    rp.ix[l] = 1.f / r->dir[0], rp.iy[l] = 1.f / r->dir[1], rp.iz[l] = 1.f / r->dir[2];
+    rp.t[l] = l < count ? r->tmax : -1.f;
+    rp.u[l] = rp.v[l] = 0.f;
+    rp.triangle[l] = -1;
+  }
+  if (bvh->tri_count) {
+    TraceStackEntry stack[BVH_STACK_SIZE];
+    size_t sp = 0;
+    stack[sp++] = (TraceStackEntry) { 0, ray_packet_enter(&rp, &bvh->nodes[0]) };
+    while (sp) {
+      TraceStackEntry top = stack[--sp];
+      float farthest = -1.f;
+      for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+        farthest = rp.t[l] > farthest ? rp.t[l] : farthest;
+      if (top.enter >= farthest)
         continue;
-      for (size_t k = 0; k < plane_count; ++k) {
-        MapPlane *p1 = &brush->planes[j];
-        MapPlane *p2 = &brush->planes[k];
-        if (j == k || i == k)
-          continue;
-        mat3 P = {
-          { p0->normal[0], p0->normal[1], p0->normal[2] },
-          { p1->normal[0], p1->normal[1], p1->normal[2] },
-          { p2->normal[0], p2->normal[1], p2->normal[2] }
-        };
-        float det = mat3_determinant(P);
-        if (det == 0.0f)
-          continue;
-        vec3 b = { p0->distance, p1->distance, p2->distance };
-        // P * v = -b
-        // v = -inverse(P) * b
-        mat3 inv_P;
-        mat3_inverse(inv_P, P);
-        vec3 v;
-        mat3_vec3_mul(v, inv_P, b);
-        bool invalid = false;
-        for (size_t m = 0; m < plane_count; ++m) {
-          float d = vec3_mul_inner(brush->planes[m].normal, v) - brush->planes[m].distance;
-          if (d > 0.008f)
-          {
-            invalid = true;
-            break;
-          }
-        }
-        if (!invalid && !polygon_has_pt(&polygon, v)) {
-          buf_grow(polygon.points, 1);
-          buf_set_size(polygon.points, buf_size(polygon.points) + 1);
-          memcpy(polygon.points[buf_size(polygon.points) - 1], v, sizeof(vec3));
-        }
+      BvhNode *node = &bvh->nodes[top.index];
+      if (node->count) {
+        for (u32 i = node->first; i < node->first + node->count; ++i)
+          ray_packet_triangle(&rp, &bvh->tris[i], i);
+        continue;
+      }
+      TraceStackEntry a = { node->first, ray_packet_enter(&rp, &bvh->nodes[node->first]) };
+      TraceStackEntry b = { node->first + 1, ray_packet_enter(&rp, &bvh->nodes[node->first + 1]) };
+      assert(sp + 2 <= BVH_STACK_SIZE);
+      if (a.enter != FLT_MAX && b.enter != FLT_MAX) {
+        stack[sp++] = a.enter > b.enter ? a : b;
+        stack[sp++] = a.enter > b.enter ? b : a;
+      } else if (a.enter != FLT_MAX) {
+        stack[sp++] = a;
+      } else if (b.enter != FLT_MAX) {
+        stack[sp++] = b;
       }
     }
-    if (buf_size(polygon.points) >= 3) {
-      buf_push(polygons, polygon);
-    } else {
-      buf_free(polygon.indices);
-      buf_free(polygon.points);
+  }
+  for (size_t l = 0; l < count; ++l)
+    hits[l] = (RenderHit) { rp.t[l], rp.u[l], rp.v[l], rp.triangle[l] };
+}
+// Packets only pay off when the rays take the same path through the tree. Rays leaving in the same
+// octant from nearby origins are close enough, anything else is cast one ray at a time.
+#define RAY_PACKET_SPREAD 256.f
+static bool ray_packet_coherent(const RenderRay *rays, size_t count) {
+  for (size_t i = 1; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      if ((rays[i].dir[k] < 0.f) != (rays[0].dir[k] < 0.f))
+        return false;
+      if (fabsf(rays[i].origin[k] - rays[0].origin[k]) > RAY_PACKET_SPREAD)
+        return false;
     }
   }
-  *polygons_out = polygons;
   return true;
 }
-void write_brushes(FILE *fp, dmodel_t *model, vec3 origin) {
-  for (size_t i = 0; i < model->numBrushes; ++i) {
-    fprintf(fp, "{\n");
-    MapBrush *brush = &mapbrushes[model->firstBrush + i];
-    // for (size_t j = 0; j < buf_size(brush->planes); ++j)
-    // {
-    //   MapPlane *plane = &brush->planes[j];
-    //   write_plane(fp, plane->material, plane->normal, plane->distance);
-    // }
-    Polygon *polys = NULL;
-    polygonize_brush(brush, &polys);
-    for (size_t j = 0; j < buf_size(polys); ++j) {
-      Polygon *poly = &polys[j];
-      MapPlane *plane = poly->plane;
-      write_plane(fp, plane->material, plane->normal, plane->distance, origin);
-    }
-    fprintf(fp, "}\n");  
-  }
-}
-void export_to_map(ProgramOptions *opts, const char *path) {
-  FILE *mapfile = NULL;
-  mapfile = fopen(path, "w");
-  if (!mapfile) {
-    printf("Failed to open '%s'\n", path);
-    return;
-  }
-  printf("Exporting to '%s'\n", path);
-  Entity *worldspawn = &entities[0];
-  fprintf(mapfile, "iwmap 4\n");
-  fprintf(mapfile, "// entity 0\n{\n");
-  for (size_t i = 0; i < buf_size(worldspawn->keyvalues); ++i) {
-    KeyValuePair *kvp = &worldspawn->keyvalues[i];
-    fprintf(mapfile, "\"%s\" \"%s\"\n", kvp->key, kvp->value);
+typedef struct {
+  RenderBvh *bvh;
+  const RenderRay *rays;
+  RenderHit *hits;
+  size_t count;
+} RaycastBatch;
+static void raycast_batch_chunk(void *ctx, size_t index) {
+  RaycastBatch *rb = ctx;
+  size_t end = (index + 1) * RAYCAST_CHUNK;
+  if (end > rb->count)
+    end = rb->count;
+  for (size_t i = index * RAYCAST_CHUNK; i < end; i += RAY_PACKET_SIZE) {
+    size_t n = end - i < RAY_PACKET_SIZE ? end - i : RAY_PACKET_SIZE;
+    if (ray_packet_coherent(&rb->rays[i], n)) {
+      render_ray_cast_packet(rb->bvh, &rb->rays[i], n, &rb->hits[i]);
+      continue;
+    }
+    for (size_t j = i; j < i + n; ++j)
+      render_ray_cast(rb->bvh, &rb->rays[j], &rb->hits[j]);
   }
-  dmodel_t *models = lumpdata[LUMP_MODELS].data;
-  write_brushes(mapfile, &models[0], (vec3) { 0.f, 0.f, 0.f });
-  if (!opts->exclude_patches) {
-    write_patches(mapfile);
+}
+// Casts a stream of rays on the map's worker threads. Consecutive rays form the packets, so callers
+// get the most out of it by keeping neighbouring rays together.
+static void render_ray_cast_batch(Bsp *bsp, const RenderRay *rays, RenderHit *hits, size_t count) {
+  render_bvh_load(bsp);
+  RaycastBatch rb = { .bvh = &bsp->bvh, .rays = rays, .hits = hits, .count = count };
+  parallel_for((count + RAYCAST_CHUNK - 1) / RAYCAST_CHUNK, bsp->threads, raycast_batch_chunk, &rb);
+}
+static void print_traces(Bsp *bsp, FILE *out, TraceRay *rays) {
+  size_t count = buf_size(rays);
+  TraceResult *results = malloc(sizeof(TraceResult) * (count + 1));
+  trace_batch(bsp, rays, results, count);
+  dmaterial_t *materials = lump(bsp, LUMP_MATERIALS)->data;
+  for (size_t i = 0; i < count; ++i) {
+    TraceResult *tr = &results[i];
+    fprintf(out, "%f %f %f %f %s%s\n", tr->fraction, tr->normal[0], tr->normal[1], tr->normal[2],
+            tr->material >= 0 ? materials[tr->material].material : "-", tr->start_solid ? " startsolid" : "");
   }
-  fprintf(mapfile, "}\n");
-  for (size_t i = 1; i < buf_size(entities); ++i) {
-    Entity *e = &entities[i];
-    const char *classname = entity_key_by_value(e, "classname");
-    fprintf(mapfile, "// entity %d\n{\n", i);
-    bool has_brushes = !strcmp(classname, "script_brushmodel") || strstr(classname, "trigger_");
-    for (size_t j = 0; j < buf_size(e->keyvalues); ++j) {
-      KeyValuePair *kvp = &e->keyvalues[j];
-      if (has_brushes) {
-        if (!strcmp(kvp->key, "origin") || !strcmp(kvp->key, "model"))
-          continue;
-      }
-      fprintf(mapfile, "\"%s\" \"%s\"\n", kvp->key, kvp->value);
-    }
-    if (has_brushes) {
-      const char *modelstr = entity_key_by_value(e, "model");
-      vec3 origin = {0};
-      const char *originstr = entity_key_by_value(e, "origin");
-      if (originstr) {
-        sscanf(originstr, "%f %f %f", &origin[0], &origin[1], &origin[2]);
-      }
-      int modelidx = 0;
-      sscanf(modelstr, "*%d", &modelidx);
-      write_brushes(mapfile, &models[modelidx], origin);
+  free(results);
+}
+static void print_raycasts(Bsp *bsp, FILE *out, RenderRay *rays) {
+  size_t count = buf_size(rays);
+  RenderHit *hits = malloc(sizeof(RenderHit) * (count + 1));
+  render_ray_cast_batch(bsp, rays, hits, count);
+  dmaterial_t *materials = lump(bsp, LUMP_MATERIALS)->data;
+  DiskTriangleSoup *soups = lump(bsp, LUMP_TRIANGLES)->data;
+  for (size_t i = 0; i < count; ++i) {
+    RenderHit *hit = &hits[i];
+    if (hit->triangle < 0) {
+      fprintf(out, "%f - - -\n", hit->t);
+      continue;
     }
-    fprintf(mapfile, "}\n");
+    RenderTriangle *tri = &bsp->bvh.tris[hit->triangle];
+    fprintf(out, "%f %d %d %s\n", hit->t, tri->soup, tri->index, materials[soups[tri->soup].materialIndex].material);
   }
-  fclose(mapfile);
+  free(hits);
+}
+// First brush of the brushes lump the point is inside of, -1 for none. The bounds reject most brushes
+// before the kernel tests the planes.
+static s32 point_brush(Bsp *bsp, const float *p) {
+  for (size_t i = 0; i < bsp->mapbrush_count; ++i) {
+    MapBrush *brush = &bsp->mapbrushes[i];
+    if (p[0] < brush->mins[0] - CLIP_EPSILON || p[0] > brush->maxs[0] + CLIP_EPSILON
+        || p[1] < brush->mins[1] - CLIP_EPSILON || p[1] > brush->maxs[1] + CLIP_EPSILON
+        || p[2] < brush->mins[2] - CLIP_EPSILON || p[2] > brush->maxs[2] + CLIP_EPSILON)
+      continue;
+    if (brush_contains_point(brush, p, CLIP_EPSILON))
+      return i;
+  }
+  return -1;
+}
+static void print_classifications(Bsp *bsp, FILE *out, float *points) {
+  size_t count = buf_size(points) / 3;
+  s32 *leafs = malloc(sizeof(s32) * (count + 1));
+  point_leafs(bsp, (const vec3*)points, leafs, count);
+  map_brush_planes_load(bsp);
+  dleaf_t *diskleafs = lump(bsp, LUMP_LEAFS)->data;
+  for (size_t i = 0; i < count; ++i) {
+    dleaf_t *leaf = &diskleafs[leafs[i]];
+    fprintf(out, "%d %d %d %d %d\n", leafs[i], leaf->cluster, leaf->area, leaf->cellNum,
+            point_brush(bsp, &points[i * 3]));
+  }
+  free(leafs);
+}
+static void print_pvs(Bsp *bsp, FILE *out) {
+  pvs_load(bsp);
+  Pvs *pvs = &bsp->pvs;
+  PvsStats stats;
+  u32 *counts = malloc(sizeof(u32) * (pvs->cluster_count + 1));
+  pvs_stats(bsp, &stats, counts);
+  fprintf(out, "pvs: %zu clusters, visible min %zu max %zu mean %.1f, %llu visible pairs\n", pvs->cluster_count,
+          stats.min, stats.max, stats.mean, (unsigned long long)stats.pairs);
+  for (size_t i = 0; i < pvs->cluster_count; ++i)
+    fprintf(out, "%zu %d\n", i, counts[i]);
+  free(counts);
+}
+static void print_visibility(Bsp *bsp, FILE *out, VisCamera *cameras) {
+  VisContext *ctx = malloc(sizeof(VisContext));
+  vis_context_init(ctx, bsp);
+  double elapsed = 0.0;
+  for (size_t i = 0; i < buf_size(cameras); ++i) {
+    VisCamera *cam = &cameras[i];
+    VisFrustum frustum;
+    vis_frustum_from_camera(&frustum, cam->origin, cam->pitch, cam->yaw, cam->fov_x, cam->fov_y);
+    double t0 = time_seconds();
+    vis_query(ctx, cam->origin, &frustum);
+    elapsed += time_seconds() - t0;
+    fprintf(out, "%zu cells %zu cullgroups:", ctx->cell_count, ctx->cullgroup_count);
+    for (size_t j = 0; j < ctx->cell_count; ++j)
+      fprintf(out, " %d", ctx->cells[j]);
+    fprintf(out, "\n");
+  }
+  fprintf(out, "%zu queries in %.3f ms\n", buf_size(cameras), elapsed * 1000.0);
+  vis_context_free(ctx);
+  free(ctx);
 }
-void print_info(dheader_t *hdr, const char *path) {
-  printf("bsp.c v0.1 (c) 2024\n");
-  printf("---------------------\n");
-  printf("%s: %d\n", path, filelen);
-  info(hdr, LUMP_MODELS, NULL);
-  info(hdr, LUMP_MATERIALS, NULL);
-  info(hdr, LUMP_BRUSHES, NULL);
-  info(hdr, LUMP_BRUSHSIDES, NULL);
-  info(hdr, LUMP_PLANES, NULL);
+static void print_info(Bsp *bsp, FILE *out, const char *path) {
+  Entity *entities = bsp->entities;
+  fprintf(out, "bsp.c v0.1 (c) 2024\n");
+  fprintf(out, "---------------------\n");
+  fprintf(out, "%s: %" PRId64 "\n", path, bsp->filelen);
+  info(bsp, out, LUMP_MODELS, NULL);
+  info(bsp, out, LUMP_MATERIALS, NULL);
+  info(bsp, out, LUMP_BRUSHES, NULL);
+  info(bsp, out, LUMP_BRUSHSIDES, NULL);
+  info(bsp, out, LUMP_PLANES, NULL);
   int entity_count = buf_size(entities);
-  info(hdr, LUMP_ENTITIES, &entity_count);
-  printf("\n");
-  info(hdr, LUMP_NODES, NULL);
-  info(hdr, LUMP_LEAFS, NULL);
-  info(hdr, LUMP_LEAFBRUSHES, NULL);
-  info(hdr, LUMP_LEAFSURFACES, NULL);
-  info(hdr, LUMP_COLLISIONVERTS, NULL);
-  info(hdr, LUMP_COLLISIONEDGES, NULL);
-  info(hdr, LUMP_COLLISIONTRIS, NULL);
-  info(hdr, LUMP_COLLISIONBORDERS, NULL);
-  info(hdr, LUMP_COLLISIONAABBS, NULL);
-  info(hdr, LUMP_DRAWVERTS, NULL);
-  info(hdr, LUMP_DRAWINDICES, NULL);
-  info(hdr, LUMP_TRIANGLES, NULL);
-  info(hdr, LUMP_OBSOLETE_1, NULL);
-  info(hdr, LUMP_OBSOLETE_2, NULL);
-  info(hdr, LUMP_OBSOLETE_3, NULL);
-  info(hdr, LUMP_OBSOLETE_4, NULL);
-  info(hdr, LUMP_OBSOLETE_5, NULL);
-  info(hdr, LUMP_LIGHTBYTES, NULL);
-  info(hdr, LUMP_LIGHTGRIDENTRIES, NULL);
-  info(hdr, LUMP_LIGHTGRIDCOLORS, NULL);
+  info(bsp, out, LUMP_ENTITIES, &entity_count);
+  fprintf(out, "\n");
+  info(bsp, out, LUMP_NODES, NULL);
+  info(bsp, out, LUMP_LEAFS, NULL);
+  info(bsp, out, LUMP_LEAFBRUSHES, NULL);
+  info(bsp, out, LUMP_LEAFSURFACES, NULL);
+  info(bsp, out, LUMP_COLLISIONVERTS, NULL);
+  info(bsp, out, LUMP_COLLISIONEDGES, NULL);
+  info(bsp, out, LUMP_COLLISIONTRIS, NULL);
+  info(bsp, out, LUMP_COLLISIONBORDERS, NULL);
+  info(bsp, out, LUMP_COLLISIONAABBS, NULL);
+  info(bsp, out, LUMP_DRAWVERTS, NULL);
+  info(bsp, out, LUMP_DRAWINDICES, NULL);
+  info(bsp, out, LUMP_TRIANGLES, NULL);
+  info(bsp, out, LUMP_OBSOLETE_1, NULL);
+  info(bsp, out, LUMP_OBSOLETE_2, NULL);
+  info(bsp, out, LUMP_OBSOLETE_3, NULL);
+  info(bsp, out, LUMP_OBSOLETE_4, NULL);
+  info(bsp, out, LUMP_OBSOLETE_5, NULL);
+  info(bsp, out, LUMP_LIGHTBYTES, NULL);
+  info(bsp, out, LUMP_LIGHTGRIDENTRIES, NULL);
+  info(bsp, out, LUMP_LIGHTGRIDCOLORS, NULL);
   // Not sure if it's stored as a lump or just parsed from entdata with classname "light"
-  size_t light_entity_count = 0;
-  for (size_t i = 0; i < buf_size(entities); ++i) {
-    Entity *e = &entities[i];
-    const char *classname = entity_key_by_value(e, "classname");
-    if (!strcmp(classname, "light"))
-      ++light_entity_count;
-  }
-  printf("     %d lights                   0 B      0 KB   0.0%\n", light_entity_count);
-  info(hdr, LUMP_VISIBILITY, NULL);
-  info(hdr, LUMP_PORTALVERTS, NULL);
-  info(hdr, LUMP_OCCLUDERS, NULL);
-  info(hdr, LUMP_OCCLUDERPLANES, NULL);
-  info(hdr, LUMP_OCCLUDEREDGES, NULL);
-  info(hdr, LUMP_OCCLUDERINDICES, NULL);
-  info(hdr, LUMP_AABBTREES, NULL);
-  info(hdr, LUMP_CELLS, NULL);
-  info(hdr, LUMP_PORTALS, NULL);
-  info(hdr, LUMP_CULLGROUPS, NULL);
-  info(hdr, LUMP_CULLGROUPINDICES, NULL);
-  printf("\n");
-  info(hdr, LUMP_PATHCONNECTIONS, NULL);
-  printf("---------------------\n");
+  const s32 *lights;
+  size_t light_entity_count = entities_by_classname(&bsp->entity_index, "light", &lights);
+  fprintf(out, "     %zu lights                   0 B      0 KB   0.0%%\n", light_entity_count);
+  info(bsp, out, LUMP_VISIBILITY, NULL);
+  info(bsp, out, LUMP_PORTALVERTS, NULL);
+  info(bsp, out, LUMP_OCCLUDERS, NULL);
+  info(bsp, out, LUMP_OCCLUDERPLANES, NULL);
+  info(bsp, out, LUMP_OCCLUDEREDGES, NULL);
+  info(bsp, out, LUMP_OCCLUDERINDICES, NULL);
+  info(bsp, out, LUMP_AABBTREES, NULL);
+  info(bsp, out, LUMP_CELLS, NULL);
+  info(bsp, out, LUMP_PORTALS, NULL);
+  info(bsp, out, LUMP_CULLGROUPS, NULL);
+  info(bsp, out, LUMP_CULLGROUPINDICES, NULL);
+  fprintf(out, "\n");
+  info(bsp, out, LUMP_PATHCONNECTIONS, NULL);
+  fprintf(out, "---------------------\n");
 }
-void print_usage() {
+#include "bsp_bench.c"
+static void print_usage() {
   printf("Usage: ./bsp [options] <input_file>\n");
   printf("\n");
   printf("Options:\n");
@@ -1212,20 +5479,224 @@ void print_usage() {
   printf("                          Example: /path/to/your/bsp.d3dbsp will write to /path/to/your/bsp_exported.map\n");
   printf("  -original_brush_portals   By default portals are converted to brushes instead of using the portals that are in brushes.\n");
   printf("  -exclude_patches       Don't export patches.\n");
+  printf("  -cache <dir>           Keep the polygonized brushes and deduplicated patch triangles of each exported map\n");
+  printf("                          in <dir>, keyed by a hash of its lumps, and reuse them on later exports.\n");
+  printf("  -mmap                  Map the input file into memory instead of reading every lump into a copy.\n");
+  printf("  -threads <n>           Number of worker threads for batches. Defaults to one per core.\n");
+  printf("  -batch <list>          Process every .d3dbsp listed in <list> (one path per line).\n");
+  printf("  -trace <rays>          Trace each line of <rays> (sx sy sz ex ey ez [hx hy hz]) against the collision\n");
+  printf("                          triangles and print fraction, normal and material per ray.\n");
+  printf("  -raycast <rays>        Cast each line of <rays> (sx sy sz ex ey ez) against the render triangles and\n");
+  printf("                          print fraction, soup, draw index and material of the closest hit.\n");
+  printf("  -vis <cameras>         Print the cells and cull groups visible from each line of <cameras>\n");
+  printf("                          (x y z pitch yaw [fov_x fov_y]), found by clipping through portals.\n");
+  printf("  -hash                  Print a hash of every lump and lightmap page. In a batch, also print how many\n");
+  printf("                          lumps, pages and 64 KB chunks are shared between maps, and the bytes that saves.\n");
+  printf("  -pvs                   Print PVS statistics and the number of clusters each cluster can see.\n");
+  printf("  -classify <points>     Print leaf, cluster, area, cell and the first brush containing the point (-1 for\n");
+  printf("                          none) for each line of <points> (x y z).\n");
+  printf("  -lightmaps <dir>       Write each lightmap page to <dir> as <map>_lm<n>.png (the four tiles stacked)\n");
+  printf("                          and <map>_shadow<n>.png.\n");
+  printf("  -mesh <path>           Export the triangle soups, indexed and grouped by material, to a binary glTF\n");
+  printf("                          (or OBJ with -format obj). In a batch <path> is a directory.\n");
+  printf("  -optimize              Merge the triangle soups into one draw per material and lightmap, reorder them\n");
+  printf("                          for the vertex cache and print draw counts and ACMR. -mesh writes the result.\n");
+  printf("  -meshlets              With -optimize, also split the draws into meshlets of at most 64 vertices and\n");
+  printf("                          124 triangles, print their statistics and write them to glTF as extras.\n");
+  printf("  -profile <format>      After each map print time per phase (lumps, entities, brushes, polygonize_cpu,\n");
+  printf("                          patches, io, export), counts of brushes, sides, polygons, triangles\n");
+  printf("                          and allocations, and peak RSS, as a table or as one line of json.\n");
+  printf("                          polygonize_cpu is summed over the threads, the others are wall time.\n");
+  printf("  -format <format>       Output format: png (default) or raw (.rgba/.gray, no header) for -lightmaps,\n");
+  printf("                          glb (default) or obj for -mesh.\n");
   printf("\n");
   printf("\n");
   printf("  -export_path <path>   Specify the path where the export should be saved. Requires an argument.\n");
+  printf("  -bench <name>         Run a benchmark on synthetic data instead of processing input files: patches, planes, cache, hash, export, trace, leafs, pvs, vis, lightmaps, mesh, meshopt, bvh.\n");
+  printf("  -bench_size <n>       Problem size for -bench, e.g. the number of collision triangles.\n");
+  printf("  -generate <path>      Write a synthetic .d3dbsp with brushes, collision triangles, portals and entities.\n");
+  printf("  -generate_counts <list>  Counts for -generate, e.g. brushes=20000,sides=8,triangles=100000,portals=2000,\n");
+  printf("                          entities=1000,seed=1. sides is the most bevel sides per brush.\n");
   printf("  -help                Display this help message and exit.\n");
   printf("\n");
   printf("Arguments:\n");
   printf("  <input_file>         The input file to be processed.\n");
+  printf("                       Several files, or a directory of .d3dbsp files, are processed as a batch.\n");
+  printf("                       In a batch, -export_path names the directory the .map files are written to.\n");
   printf("\n");
   printf("Examples:\n");
   printf("./bsp -info input_file.d3dbsp\n");
   printf("./bsp -export -export_path /path/to/exported_file.map input_file.d3dbsp\n");
+  printf("./bsp -info -threads 8 /path/to/maps/\n");
   exit(0);
 }
-bool parse_arguments(int argc, char **argv, ProgramOptions *opts) {
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+static bool has_extension(const char *path, const char *ext) {
+  const char *delim = strrchr(path, '.');
+  if (!delim)
+    return false;
+#ifdef _WIN32
+  return !_stricmp(delim + 1, ext);
+#else
+  return !strcasecmp(delim + 1, ext);
+#endif
+}
+// A directory expands to the .d3dbsp files directly inside it, anything else is taken as a file.
+static void add_input(const char *path, ProgramOptions *opts) {
+  char file[1024];
+#ifdef _WIN32
+  char pattern[1024];
+  snprintf(pattern, sizeof(pattern), "%s\\*.d3dbsp", path);
+  WIN32_FIND_DATAA fd;
+  DWORD attr = GetFileAttributesA(path);
+  if (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+    buf_push(opts->input_files, strdup(path));
+    return;
+  }
+  opts->batch = true;
+  HANDLE h = FindFirstFileA(pattern, &fd);
+  if (h == INVALID_HANDLE_VALUE)
+    return;
+  do {
+    snprintf(file, sizeof(file), "%s\\%s", path, fd.cFileName);
+    buf_push(opts->input_files, strdup(file));
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+#else
+  DIR *dir = opendir(path);
+  if (!dir) {
+    buf_push(opts->input_files, strdup(path));
+    return;
+  }
+  size_t first = buf_size(opts->input_files);
+  opts->batch = true;
+  for (struct dirent *de; (de = readdir(dir));) {
+    if (!has_extension(de->d_name, "d3dbsp"))
+      continue;
+    snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+    buf_push(opts->input_files, strdup(file));
+  }
+  closedir(dir);
+  // readdir order is arbitrary, sort so batch output is stable between runs.
+  qsort(&opts->input_files[first], buf_size(opts->input_files) - first, sizeof(char*), compare_strings);
+#endif
+}
+static bool read_batch_list(const char *path, ProgramOptions *opts) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: failed to open batch list '%s'.\n", path);
+    return false;
+  }
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0])
+      add_input(line, opts);
+  }
+  fclose(fp);
+  return true;
+}
+// One ray per line: start and end, optionally followed by the half size of a box to sweep.
+static bool read_trace_rays(const char *path, ProgramOptions *opts) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: failed to open trace list '%s'.\n", path);
+    return false;
+  }
+  char line[1024];
+  for (size_t n = 1; fgets(line, sizeof(line), fp); ++n) {
+    TraceRay ray = {0};
+    int count = sscanf(line, "%f %f %f %f %f %f %f %f %f",
+                       &ray.start[0], &ray.start[1], &ray.start[2], &ray.end[0], &ray.end[1], &ray.end[2],
+                       &ray.extents[0], &ray.extents[1], &ray.extents[2]);
+    if (count <= 0)
+      continue;
+    if (count != 6 && count != 9) {
+      fprintf(stderr, "Error: %s:%zu: expected start, end and optionally box extents.\n", path, n);
+      fclose(fp);
+      return false;
+    }
+    buf_push(opts->trace_rays, ray);
+  }
+  fclose(fp);
+  return true;
+}
+// One ray per line, start and end. Hits are reported as a fraction of the way between them.
+static bool read_raycast_rays(const char *path, ProgramOptions *opts) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: failed to open ray list '%s'.\n", path);
+    return false;
+  }
+  char line[1024];
+  for (size_t n = 1; fgets(line, sizeof(line), fp); ++n) {
+    vec3 start, end;
+    int count = sscanf(line, "%f %f %f %f %f %f", &start[0], &start[1], &start[2], &end[0], &end[1], &end[2]);
+    if (count <= 0)
+      continue;
+    if (count != 6) {
+      fprintf(stderr, "Error: %s:%zu: expected start and end.\n", path, n);
+      fclose(fp);
+      return false;
+    }
+    RenderRay ray = { .tmax = 1.f };
+    vec3_dup(ray.origin, start);
+    vec3_sub(ray.dir, end, start);
+    buf_push(opts->raycast_rays, ray);
+  }
+  fclose(fp);
+  return true;
+}
+static bool read_classify_points(const char *path, ProgramOptions *opts) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: failed to open point list '%s'.\n", path);
+    return false;
+  }
+  char line[1024];
+  for (size_t n = 1; fgets(line, sizeof(line), fp); ++n) {
+    vec3 p;
+    int count = sscanf(line, "%f %f %f", &p[0], &p[1], &p[2]);
+    if (count <= 0)
+      continue;
+    if (count != 3) {
+      fprintf(stderr, "Error: %s:%zu: expected a point.\n", path, n);
+      fclose(fp);
+      return false;
+    }
+    for (int k = 0; k < 3; ++k)
+      buf_push(opts->classify_points, p[k]);
+  }
+  fclose(fp);
+  return true;
+}
+// One camera per line: origin, pitch and yaw, and optionally the horizontal and vertical field of view.
+static bool read_vis_cameras(const char *path, ProgramOptions *opts) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Error: failed to open camera path '%s'.\n", path);
+    return false;
+  }
+  char line[1024];
+  for (size_t n = 1; fgets(line, sizeof(line), fp); ++n) {
+    VisCamera cam = { .fov_x = 90.f, .fov_y = 73.74f };
+    int count = sscanf(line, "%f %f %f %f %f %f %f", &cam.origin[0], &cam.origin[1], &cam.origin[2], &cam.pitch,
+                       &cam.yaw, &cam.fov_x, &cam.fov_y);
+    if (count <= 0)
+      continue;
+    if (count != 5 && count != 7) {
+      fprintf(stderr, "Error: %s:%zu: expected origin, pitch, yaw and optionally fov x and y.\n", path, n);
+      fclose(fp);
+      return false;
+    }
+    buf_push(opts->vis_cameras, cam);
+  }
+  fclose(fp);
+  return true;
+}
+static bool parse_arguments(int argc, char **argv, ProgramOptions *opts) {
   opts->try_fix_portals = true;
   for (int i = 1; i < argc; i++) {
     switch(argv[i][0]) {
@@ -1238,6 +5709,16 @@ bool parse_arguments(int argc, char **argv, ProgramOptions *opts) {
           opts->exclude_patches = true;
         } else if (!strcmp(argv[i], "-original_brush_portals")) {
           opts->try_fix_portals = false;
+        } else if (!strcmp(argv[i], "-hash")) {
+          opts->hash_lumps = true;
+        } else if (!strcmp(argv[i], "-pvs")) {
+          opts->print_pvs = true;
+        } else if (!strcmp(argv[i], "-optimize")) {
+          opts->optimize_mesh = true;
+        } else if (!strcmp(argv[i], "-meshlets")) {
+          opts->meshlets = true;
+        } else if (!strcmp(argv[i], "-mmap")) {
+          opts->use_mmap = true;
         } else if (!strcmp(argv[i], "-export")) {
           opts->export_to_map = true;
         } else if (!strcmp(argv[i], "-export_path")) {
@@ -1247,6 +5728,110 @@ bool parse_arguments(int argc, char **argv, ProgramOptions *opts) {
             fprintf(stderr, "Error: -export_path requires a argument.\n");
             return false;
           }
+        } else if (!strcmp(argv[i], "-threads")) {
+          // strtoul alone would wrap a negative count around to a huge one.
+          char *end = NULL;
+          unsigned long threads = 0;
+          if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')
+            threads = strtoul(argv[i + 1], &end, 10);
+          if (!threads || *end || threads == ULONG_MAX) {
+            fprintf(stderr, "Error: -threads requires a thread count above 0.\n");
+            return false;
+          }
+          opts->threads = threads;
+          ++i;
+        } else if (!strcmp(argv[i], "-batch")) {
+          if (i + 1 >= argc) {
+            fprintf(stderr, "Error: -batch requires a argument.\n");
+            return false;
+          }
+          if (!read_batch_list(argv[++i], opts))
+            return false;
+          opts->batch = true;
+        } else if (!strcmp(argv[i], "-trace")) {
+          if (i + 1 >= argc) {
+            fprintf(stderr, "Error: -trace requires a argument.\n");
+            return false;
+          }
+          if (!read_trace_rays(argv[++i], opts))
+            return false;
+        } else if (!strcmp(argv[i], "-raycast")) {
+          if (i + 1 >= argc) {
+            fprintf(stderr, "Error: -raycast requires a argument.\n");
+            return false;
+          }
+          if (!read_raycast_rays(argv[++i], opts))
+            return false;
+        } else if (!strcmp(argv[i], "-classify")) {
+          if (i + 1 >= argc) {
+            fprintf(stderr, "Error: -classify requires a argument.\n");
+            return false;
+          }
+          if (!read_classify_points(argv[++i], opts))
+            return false;
+        } else if (!strcmp(argv[i], "-vis")) {
+          if (i + 1 >= argc) {
+            fprintf(stderr, "Error: -vis requires a argument.\n");
+            return false;
+          }
+          if (!read_vis_cameras(argv[++i], opts))
+            return false;
+        } else if (!strcmp(argv[i], "-lightmaps")) {
+          if (i + 1 < argc) {
+            opts->lightmap_dir = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -lightmaps requires a argument.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-cache")) {
+          if (i + 1 < argc) {
+            opts->cache_dir = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -cache requires a argument.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-mesh")) {
+          if (i + 1 < argc) {
+            opts->mesh_file = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -mesh requires a argument.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-profile")) {
+          if (i + 1 < argc && (!strcmp(argv[i + 1], "table") || !strcmp(argv[i + 1], "json"))) {
+            opts->profile_format = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -profile requires table or json.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-generate")) {
+          if (i + 1 < argc) {
+            opts->generate_file = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -generate requires a argument.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-generate_counts")) {
+          if (i + 1 < argc) {
+            opts->generate_counts = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -generate_counts requires a argument.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-bench")) {
+          if (i + 1 < argc) {
+            opts->bench = argv[++i];
+          } else {
+            fprintf(stderr, "Error: -bench requires a argument.\n");
+            return false;
+          }
+        } else if (!strcmp(argv[i], "-bench_size")) {
+          if (i + 1 < argc) {
+            opts->bench_size = strtoull(argv[++i], NULL, 10);
+          } else {
+            fprintf(stderr, "Error: -bench_size requires a argument.\n");
+            return false;
+          }
         } else if (!strcmp(argv[i], "-format")) {
           if (i + 1 < argc) {
             opts->format = argv[++i];
@@ -1261,13 +5846,13 @@ bool parse_arguments(int argc, char **argv, ProgramOptions *opts) {
       break;
       default:
         // printf("%s\n", argv[i]);
-        opts->input_file = argv[i];
+        add_input(argv[i], opts);
       break;
     }
     }
   return true;
 }
-void pathinfo(
+static void pathinfo(
   const char *path,
   char *directory, size_t directory_max_length,
   char *basename, size_t basename_max_length,
@@ -1284,7 +5869,7 @@ void pathinfo(
     ++it;
   }
   directory[0] = 0;
-  snprintf(directory, directory_max_length, "%.*s", offset, path);
+  snprintf(directory, directory_max_length, "%.*s", (int)offset, path);
   const char *filename = path + offset;
   if (*filename == '/' || *filename == '\\')
     ++filename;
@@ -1294,52 +5879,259 @@ void pathinfo(
   if (!delim) {
     snprintf(basename, basename_max_length, "%s", filename);
   } else {
-    snprintf(basename, basename_max_length, "%.*s", delim - filename, filename);
+    snprintf(basename, basename_max_length, "%.*s", (int)(delim - filename), filename);
     snprintf(extension, extension_max_length, "%s", delim + 1);
   }
 }
-int main(int argc, char **argv) {
-  ProgramOptions opts = {0};
-  if (!parse_arguments(argc, argv, &opts)) {
-    return 1;
+static void print_profile(Bsp *bsp, FILE *out, const char *input_file, bool json) {
+  Profile *p = &bsp->profile;
+  u64 rss = peak_rss_bytes();
+  if (!json) {
+    fprintf(out, "Profile of '%s':\n", input_file);
+    for (int i = 0; i < PROFILE_PHASES; ++i)
+      fprintf(out, "  %-16s %12.3f ms%s\n", profile_phase_names[i], p->ns[i] / 1e6,
+              i == PROFILE_POLYGONIZE ? " (summed over threads)" : "");
+    for (int i = 0; i < PROFILE_COUNTERS; ++i)
+      fprintf(out, "  %-16s %12llu\n", profile_counter_names[i], (unsigned long long)p->counters[i]);
+    fprintf(out, "  %-16s %12.1f MB (process)\n", "peak_rss", rss / 1e6);
+    return;
   }
-  TEST(dmodel_t, 48);
-  Stream s = {0};
-  assert(0 == stream_open_file(&s, opts.input_file, "rb"));
-  s.seek(&s, 0, SEEK_END);
-  filelen = s.tell(&s);
-  s.seek(&s, 0, SEEK_SET);
-  dheader_t hdr = { 0 };
-  stream_read(s, hdr);
-  if (memcmp(hdr.ident, "IBSP", 4)) {
-    fprintf(stderr, "Magic mismatch");
-    exit(1);
+  // One line per map, so a batch's output can be picked apart line by line.
+  Writer w = { .fp = out };
+  writer_literal(&w, "{\"map\":");
+  writer_json_string(&w, input_file);
+  writer_literal(&w, ",\"phases_ms\":{");
+  for (int i = 0; i < PROFILE_PHASES; ++i) {
+    char ms[32];
+    snprintf(ms, sizeof(ms), "%.3f", p->ns[i] / 1e6);
+    writer_string(&w, i ? ",\"" : "\"");
+    writer_string(&w, profile_phase_names[i]);
+    writer_literal(&w, "\":");
+    writer_string(&w, ms);
   }
-  if (hdr.version != 4) {
-    fprintf(stderr, "Version mismatch");
-    exit(1);
+  writer_literal(&w, "},\"counters\":{");
+  for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+    writer_string(&w, i ? ",\"" : "\"");
+    writer_string(&w, profile_counter_names[i]);
+    writer_literal(&w, "\":");
+    writer_int(&w, p->counters[i]);
   }
-  for (size_t i = 0; i < LUMP_MAX; ++i) {
-    lump_t *l = &hdr.lumps[i];
-    if (l->filelen != 0 && lumpsizes[i] != 0) {
-      LumpData *ld = &lumpdata[i];
-      assert(l->filelen % lumpsizes[i] == 0);
-      ld->count = l->filelen / lumpsizes[i];
-      ld->data = calloc(ld->count, lumpsizes[i]);
-      s.seek(&s, l->fileofs, SEEK_SET);
-      s.read(&s, ld->data, lumpsizes[i], ld->count);
-    }
-  }
-  entities = parse_entities();
-  load_map_brushes();
-  if (opts.print_info)
-    print_info(&hdr, opts.input_file);
-  if (opts.export_to_map) {
+  writer_literal(&w, "},\"peak_rss_bytes\":");
+  writer_int(&w, rss);
+  writer_literal(&w, "}\n");
+  writer_free(&w);
+}
+// -hash: every lump, every lightmap page and every chunk of a map is hashed straight from the mapped
+// file. In a batch the hashes of all maps are then grouped to show how much a content addressed
+// store would save.
+#define HASH_KIND_PAGE LUMP_MAX
+#define HASH_KIND_CHUNK (LUMP_MAX + 1)
+#define HASH_KINDS (LUMP_MAX + 2)
+#define HASH_TOP_SHARED 10
+typedef struct {
+  u64 hash;
+  u64 size;
+  s32 kind; // lump type, HASH_KIND_PAGE or HASH_KIND_CHUNK
+  u32 map; // index of the input file
+} ContentHash;
+typedef struct {
+  ContentHash *items;
+} MapHashes;
+static void hash_map(Bsp *bsp, FILE *out, const char *input_file, MapHashes *mh) {
+  lump_t *lumps = bsp->source.hdr.lumps;
+  const u8 *file = bsp->source.fm.data;
+  ByteRange ranges[LUMP_MAX];
+  u64 hashes[LUMP_MAX];
+  double t0 = time_seconds();
+  for (int type = 0; type < LUMP_MAX; ++type)
+    ranges[type] = (ByteRange) { file + lumps[type].fileofs, lumps[type].filelen };
+  u64 *chunk_hashes = hash_ranges(ranges, LUMP_MAX, hashes, bsp->threads);
+  double elapsed = time_seconds() - t0;
+  size_t lump_count = 0, page_count = 0;
+  u64 total = 0;
+  size_t chunk = 0;
+  for (int type = 0; type < LUMP_MAX; ++type) {
+    size_t size = lumps[type].filelen;
+    size_t chunks = hash_chunk_count(size);
+    if (size) {
+      buf_push(mh->items, ((ContentHash) { hashes[type], size, type, 0 }));
+      ++lump_count;
+      total += size;
+    }
+    for (size_t i = 0; i < chunks; ++i) {
+      size_t chunk_size = size - i * HASH_CHUNK_SIZE < HASH_CHUNK_SIZE ? size - i * HASH_CHUNK_SIZE : HASH_CHUNK_SIZE;
+      buf_push(mh->items, ((ContentHash) { chunk_hashes[chunk + i], chunk_size, HASH_KIND_CHUNK, 0 }));
+    }
+    // A page is 4 MB, a whole number of chunks.
+    if (type == LUMP_LIGHTBYTES) {
+      size_t page_chunks = sizeof(DiskGfxLightmap) / HASH_CHUNK_SIZE;
+      page_count = size / sizeof(DiskGfxLightmap);
+      for (size_t i = 0; i < page_count; ++i) {
+        u64 hash = hash_chunk_hashes(&chunk_hashes[chunk + i * page_chunks], page_chunks, sizeof(DiskGfxLightmap));
+        buf_push(mh->items, ((ContentHash) { hash, sizeof(DiskGfxLightmap), HASH_KIND_PAGE, 0 }));
+      }
+    }
+    chunk += chunks;
+  }
+  free(chunk_hashes);
+  fprintf(out, "%s: %zu lumps, %zu lightmap pages, %.1f MB hashed in %.3f ms\n", input_file, lump_count, page_count,
+          total / 1e6, elapsed * 1000.0);
+  size_t page = 0;
+  for (size_t i = 0; i < buf_size(mh->items); ++i) {
+    ContentHash *c = &mh->items[i];
+    if (c->kind == HASH_KIND_CHUNK)
+      continue;
+    if (c->kind == HASH_KIND_PAGE)
+      fprintf(out, "  lightmap page %-5zu %12llu  %016llx\n", page++, (unsigned long long)c->size,
+              (unsigned long long)c->hash);
+    else
+      fprintf(out, "  %-19s %12llu  %016llx\n", lumpnames[c->kind], (unsigned long long)c->size,
+              (unsigned long long)c->hash);
+  }
+}
+static int compare_content_hashes(const void *a, const void *b) {
+  const ContentHash *x = a, *y = b;
+  if (x->kind != y->kind)
+    return x->kind < y->kind ? -1 : 1;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  if (x->size != y->size)
+    return x->size < y->size ? -1 : 1;
+  return x->map < y->map ? -1 : x->map > y->map;
+}
+typedef struct {
+  ContentHash *first;
+  size_t copies;
+} SharedContent;
+static int compare_shared_content(const void *a, const void *b) {
+  const SharedContent *x = a, *y = b;
+  u64 wx = x->first->size * (x->copies - 1), wy = y->first->size * (y->copies - 1);
+  return wx > wy ? -1 : wx < wy;
+}
+static const char *hash_kind_name(s32 kind) {
+  if (kind == HASH_KIND_PAGE)
+    return "lightmap pages";
+  if (kind == HASH_KIND_CHUNK)
+    return "64 KB chunks";
+  return lumpnames[kind];
+}
+// Groups equal content by kind, hash and size, and prints what each kind would take stored once,
+// followed by the contents with the most bytes in duplicates.
+static void print_hash_library(ProgramOptions *opts, MapHashes *maps, size_t map_count) {
+  ContentHash *all = NULL;
+  for (size_t i = 0; i < map_count; ++i) {
+    for (size_t j = 0; j < buf_size(maps[i].items); ++j) {
+      ContentHash c = maps[i].items[j];
+      c.map = i;
+      buf_push(all, c);
+    }
+  }
+  size_t count = buf_size(all);
+  if (count)
+    qsort(all, count, sizeof(ContentHash), compare_content_hashes);
+  struct {
+    size_t count, unique;
+    u64 bytes, unique_bytes;
+  } kinds[HASH_KINDS] = {0}, lumps = {0};
+  SharedContent *shared = NULL;
+  for (size_t i = 0; i < count;) {
+    size_t j = i + 1;
+    while (j < count && all[j].kind == all[i].kind && all[j].hash == all[i].hash && all[j].size == all[i].size)
+      ++j;
+    s32 kind = all[i].kind;
+    kinds[kind].count += j - i;
+    kinds[kind].unique += 1;
+    kinds[kind].bytes += all[i].size * (j - i);
+    kinds[kind].unique_bytes += all[i].size;
+    if (kind < LUMP_MAX) {
+      lumps.count += j - i;
+      lumps.unique += 1;
+      lumps.bytes += all[i].size * (j - i);
+      lumps.unique_bytes += all[i].size;
+      if (j - i > 1)
+        buf_push(shared, ((SharedContent) { &all[i], j - i }));
+    }
+    i = j;
+  }
+  printf("Library index: %zu maps\n", map_count);
+  printf("  %-19s %8s %8s %12s %14s\n", "kind", "count", "unique", "total MB", "duplicate MB");
+  for (s32 kind = 0; kind < HASH_KINDS; ++kind) {
+    if (kind == HASH_KIND_PAGE)
+      printf("  %-19s %8zu %8zu %12.1f %14.1f\n", "all lumps", lumps.count, lumps.unique, lumps.bytes / 1e6,
+             (lumps.bytes - lumps.unique_bytes) / 1e6);
+    if (!kinds[kind].count)
+      continue;
+    printf("  %-19s %8zu %8zu %12.1f %14.1f\n", hash_kind_name(kind), kinds[kind].count, kinds[kind].unique,
+           kinds[kind].bytes / 1e6, (kinds[kind].bytes - kinds[kind].unique_bytes) / 1e6);
+  }
+  if (buf_size(shared)) {
+    qsort(shared, buf_size(shared), sizeof(SharedContent), compare_shared_content);
+    printf("Most duplicated lumps:\n");
+    for (size_t i = 0; i < buf_size(shared) && i < HASH_TOP_SHARED; ++i) {
+      ContentHash *c = shared[i].first;
+      printf("  %-19s %016llx %12llu B in %zu maps, first %s\n", lumpnames[c->kind], (unsigned long long)c->hash,
+             (unsigned long long)c->size, shared[i].copies, opts->input_files[c->map]);
+    }
+  }
+  buf_free(shared);
+  buf_free(all);
+}
+typedef struct {
+  ProgramOptions *opts;
+  FILE **outputs;
+  bool *failed;
+  MapHashes *hashes;
+} BatchJobs;
+static void process_map(ProgramOptions *opts, const char *input_file, bool batch, FILE *out, bool *failed, MapHashes *hashes) {
+  // Heap allocated so its contents are still valid after a longjmp back here.
+  Bsp *bsp = calloc(1, sizeof(Bsp));
+  jmp_buf on_error;
+  if (batch)
+    bsp->on_error = &on_error;
+  // A batch already keeps every core busy with whole maps.
+  bsp->threads = batch ? 1 : opts->threads;
+  if (setjmp(on_error)) {
+    fprintf(out, "%s: %s\n", input_file, bsp->error);
+    *failed = true;
+    bsp_close(bsp);
+    free(bsp);
+    return;
+  }
+  AllocCounter allocs = thread_allocs;
+  double t0 = time_seconds();
+  u64 declared = 0;
+  if (opts->print_info)
+    declared |= info_lumps;
+  if (opts->export_to_map)
+    declared |= export_lump_set(opts);
+  if (opts->trace_rays)
+    declared |= trace_lumps;
+  if (opts->raycast_rays)
+    declared |= mesh_lumps;
+  if (opts->classify_points)
+    declared |= leaf_lumps | brush_lumps;
+  if (opts->print_pvs)
+    declared |= pvs_lumps;
+  if (opts->vis_cameras)
+    declared |= vis_lumps;
+  if (opts->lightmap_dir)
+    declared |= lightmap_lumps;
+  if (opts->mesh_file || opts->optimize_mesh)
+    declared |= mesh_lumps;
+  // Hashing reads straight from the mapping rather than through lump().
+  bsp_open(bsp, input_file, opts->use_mmap || opts->hash_lumps, declared);
+  if (opts->hash_lumps)
+    hash_map(bsp, out, input_file, hashes);
+  if (opts->print_info || opts->export_to_map)
+    bsp_load_entities(bsp);
+  if (opts->print_info)
+    print_info(bsp, out, input_file);
+  if (opts->export_to_map) {
     char directory[256] = {0};
     char basename[256] = {0};
     char extension[256] = {0};
     char sep = 0;
-    pathinfo(opts.input_file,
+    pathinfo(input_file,
          directory,
          sizeof(directory),
          basename,
@@ -1348,11 +6140,122 @@ int main(int argc, char **argv) {
          sizeof(extension),
          &sep);
     char output_file[256] = {0};
-    snprintf(output_file, sizeof(output_file), "%s%c%s_exported.map", directory, sep, basename);
-    if (opts.export_file)
-      export_to_map(&opts, opts.export_file);
+    if (batch && opts->export_file)
+      snprintf(output_file, sizeof(output_file), "%s%c%s_exported.map", opts->export_file, sep ? sep : '/', basename);
+    else if (opts->export_file)
+      snprintf(output_file, sizeof(output_file), "%s", opts->export_file);
+    else if (sep)
+      snprintf(output_file, sizeof(output_file), "%s%c%s_exported.map", directory, sep, basename);
     else
-      export_to_map(&opts, output_file);
+      snprintf(output_file, sizeof(output_file), "%s_exported.map", basename);
+    export_map_file(bsp, out, opts, output_file);
   }
-  return 0;
+  if (opts->trace_rays)
+    print_traces(bsp, out, opts->trace_rays);
+  if (opts->raycast_rays)
+    print_raycasts(bsp, out, opts->raycast_rays);
+  if (opts->classify_points)
+    print_classifications(bsp, out, opts->classify_points);
+  if (opts->print_pvs)
+    print_pvs(bsp, out);
+  if (opts->vis_cameras)
+    print_visibility(bsp, out, opts->vis_cameras);
+  if (opts->lightmap_dir) {
+    char directory[256] = {0};
+    char basename[256] = {0};
+    char extension[256] = {0};
+    pathinfo(input_file, directory, sizeof(directory), basename, sizeof(basename), extension, sizeof(extension), NULL);
+    char prefix[768] = {0};
+    snprintf(prefix, sizeof(prefix), "%s/%s", opts->lightmap_dir, basename);
+    extract_lightmaps(bsp, out, prefix, opts->format && !strcmp(opts->format, "raw"));
+  }
+  if (opts->mesh_file || opts->optimize_mesh) {
+    bool obj = opts->format && !strcmp(opts->format, "obj");
+    char directory[256] = {0};
+    char basename[256] = {0};
+    char extension[256] = {0};
+    pathinfo(input_file, directory, sizeof(directory), basename, sizeof(basename), extension, sizeof(extension), NULL);
+    char output_file[768] = {0};
+    if (batch && opts->mesh_file)
+      snprintf(output_file, sizeof(output_file), "%s/%s.%s", opts->mesh_file, basename, obj ? "obj" : "glb");
+    else if (opts->mesh_file)
+      snprintf(output_file, sizeof(output_file), "%s", opts->mesh_file);
+    export_mesh(bsp, out, opts->mesh_file ? output_file : NULL, obj, opts->optimize_mesh, opts->meshlets);
+  }
+  if (opts->profile_format) {
+    profile_time(&bsp->profile, PROFILE_TOTAL, t0);
+    profile_count(&bsp->profile, PROFILE_ALLOCATIONS, thread_allocs.count - allocs.count);
+    profile_count(&bsp->profile, PROFILE_ALLOCATED_BYTES, thread_allocs.bytes - allocs.bytes);
+    print_profile(bsp, out, input_file, !strcmp(opts->profile_format, "json"));
+  }
+  bsp_close(bsp);
+  free(bsp);
+}
+// Without a temporary file for its output the map fails, rather than writing to stdout in between the
+// other workers.
+static void batch_job(void *ctx, size_t index) {
+  BatchJobs *jobs = ctx;
+  jobs->outputs[index] = tmpfile();
+  if (!jobs->outputs[index]) {
+    jobs->failed[index] = true;
+    return;
+  }
+  process_map(jobs->opts, jobs->opts->input_files[index], true, jobs->outputs[index], &jobs->failed[index],
+              &jobs->hashes[index]);
+}
+int main(int argc, char **argv) {
+  ProgramOptions opts = {0};
+  if (!parse_arguments(argc, argv, &opts)) {
+    return 1;
+  }
+  count_allocations = opts.profile_format != NULL;
+  TEST(dmodel_t, 48);
+  if (opts.bench)
+    return run_benchmark(&opts);
+  if (opts.generate_file)
+    return generate_map(&opts);
+  size_t input_count = buf_size(opts.input_files);
+  if (input_count == 0) {
+    fprintf(stderr, "Error: no input files.\n");
+    return 1;
+  }
+  if (input_count == 1 && !opts.batch) {
+    bool failed = false;
+    MapHashes hashes = {0};
+    process_map(&opts, opts.input_files[0], false, stdout, &failed, &hashes);
+    buf_free(hashes.items);
+    return 0;
+  }
+  // Each map gets its own Bsp and its own output file, which are printed in input order
+  // once every worker is done. A map that fails only reports its error.
+  BatchJobs jobs = {
+    .opts = &opts,
+    .outputs = calloc(input_count, sizeof(FILE*)),
+    .failed = calloc(input_count, sizeof(bool)),
+    .hashes = calloc(input_count, sizeof(MapHashes))
+  };
+  parallel_for(input_count, opts.threads, batch_job, &jobs);
+  size_t failed_count = 0;
+  for (size_t i = 0; i < input_count; ++i) {
+    FILE *fp = jobs.outputs[i];
+    if (fp) {
+      char chunk[4096];
+      size_t n;
+      rewind(fp);
+      while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        fwrite(chunk, 1, n, stdout);
+      fclose(fp);
+    } else {
+      printf("Error: no temporary file for the output of '%s'\n", opts.input_files[i]);
+    }
+    if (jobs.failed[i])
+      ++failed_count;
+  }
+  if (opts.hash_lumps)
+    print_hash_library(&opts, jobs.hashes, input_count);
+  for (size_t i = 0; i < input_count; ++i)
+    buf_free(jobs.hashes[i].items);
+  printf("%zu maps processed, %zu failed\n", input_count, failed_count);
+  return failed_count ? 1 : 0;
 }
+#endif
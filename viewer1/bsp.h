@@ -0,0 +1,79 @@
+// libd3dbsp: reads IBSP version 4 .d3dbsp files and exports them to .map.
+//
+// bsp.c is both the library and the bsp command line tool. Built with BSP_LIBRARY defined it leaves
+// out the tool, its other features and the benchmarks, and exports only the functions below. The
+// Makefile builds both: make bsp, make libd3dbsp.a.
+//
+// All state lives in the Bsp a map was opened into, so any number of maps can be open and worked on
+// from different threads at once. A single Bsp must only be used by one thread at a time. Functions
+// report errors through their return value and d3dbsp_error() instead of exiting.
+#ifndef D3DBSP_H
+#define D3DBSP_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+enum LumpType {
+  LUMP_MATERIALS = 0,
+  LUMP_LIGHTBYTES = 1,
+  LUMP_LIGHTGRIDENTRIES = 2,
+  LUMP_LIGHTGRIDCOLORS = 3,
+  LUMP_PLANES = 4,
+  LUMP_BRUSHSIDES = 5,
+  LUMP_BRUSHES = 6,
+  LUMP_TRIANGLES = 7,
+  LUMP_DRAWVERTS = 8,
+  LUMP_DRAWINDICES = 9,
+  LUMP_CULLGROUPS = 10,
+  LUMP_CULLGROUPINDICES = 11,
+  LUMP_OBSOLETE_1 = 12,
+  LUMP_OBSOLETE_2 = 13,
+  LUMP_OBSOLETE_3 = 14,
+  LUMP_OBSOLETE_4 = 15,
+  LUMP_OBSOLETE_5 = 16,
+  LUMP_PORTALVERTS = 17,
+  LUMP_OCCLUDERS = 18,
+  LUMP_OCCLUDERPLANES = 19,
+  LUMP_OCCLUDEREDGES = 20,
+  LUMP_OCCLUDERINDICES = 21,
+  LUMP_AABBTREES = 22,
+  LUMP_CELLS = 23,
+  LUMP_PORTALS = 24,
+  LUMP_NODES = 25,
+  LUMP_LEAFS = 26,
+  LUMP_LEAFBRUSHES = 27,
+  LUMP_LEAFSURFACES = 28,
+  LUMP_COLLISIONVERTS = 29,
+  LUMP_COLLISIONEDGES = 30,
+  LUMP_COLLISIONTRIS = 31,
+  LUMP_COLLISIONBORDERS = 32,
+  LUMP_COLLISIONPARTITIONS = 33,
+  LUMP_COLLISIONAABBS = 34,
+  LUMP_MODELS = 35,
+  LUMP_VISIBILITY = 36,
+  LUMP_ENTITIES = 37,
+  LUMP_PATHCONNECTIONS = 38,
+  LUMP_MAX = 39
+};
+typedef struct Bsp_s Bsp;
+typedef struct {
+  bool use_mmap; // map the file instead of reading each lump into a copy
+  size_t threads; // for work within the map, 0 = one per core
+} BspOpenOptions;
+typedef struct {
+  bool exclude_patches;
+  const char *cache_dir; // keep polygonized brushes here for later exports, NULL for none
+} BspExportOptions;
+// Reads and checks the header, lumps are loaded when first asked for. options may be NULL.
+// Returns NULL on failure, with the reason in error.
+Bsp *d3dbsp_open(const char *path, const BspOpenOptions *options, char *error, size_t error_size);
+// The contents of a lump as count elements of element_size bytes, valid until d3dbsp_close.
+// Lumps without a known element size come back empty. NULL with *count 0 on failure too.
+const void *d3dbsp_lump(Bsp *bsp, int type, size_t *count, size_t *element_size);
+const char *d3dbsp_lump_name(int type);
+// Writes the map's brushes, patches and entities to path. Progress messages go to log, which may
+// be NULL.
+bool d3dbsp_export_map(Bsp *bsp, const char *path, const BspExportOptions *options, FILE *log);
+// Why the last call on bsp failed.
+const char *d3dbsp_error(Bsp *bsp);
+void d3dbsp_close(Bsp *bsp);
+#endif
@@ -0,0 +1,1389 @@
+// Benchmarks and the synthetic map generator, behind -bench and -generate. Not built on its own:
+// bsp.c includes it in the tool build only, after everything the benchmarks measure.
+static u32 bench_rand(u64 *state) {
+  u64 x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return (u32)((x * 0x2545F4914F6CDD1Dull) >> 32);
+}
+static float bench_randf(u64 *state, float lo, float hi) {
+  return lo + (hi - lo) * (bench_rand(state) / 4294967296.f);
+}
+static void bsp_set_lump(Bsp *bsp, int type, void *data, size_t count) {
+  bsp->lumps[type] = (LumpData) { .data = data, .count = count, .loaded = true };
+  bsp->source.declared |= LUMP_BIT(type);
+}
+// Collision data shaped like what write_patches reads: leaf aabbs with a partition of 16 triangles each,
+// and roughly one in ten triangles repeating an earlier one with its vertices in a different order.
+static void bench_collision_lumps(Bsp *bsp, size_t tri_count, u64 *rng) {
+  size_t vert_count = tri_count / 2 + 3;
+  size_t part_count = (tri_count + 15) / 16;
+  dmaterial_t *materials = calloc(1, sizeof(dmaterial_t));
+  DiskCollisionVertex *verts = calloc(vert_count, sizeof(DiskCollisionVertex));
+  DiskCollisionTriangle *tris = calloc(tri_count, sizeof(DiskCollisionTriangle));
+  DiskCollisionPartition *parts = calloc(part_count, sizeof(DiskCollisionPartition));
+  DiskCollisionAabbTree *aabbs = calloc(part_count, sizeof(DiskCollisionAabbTree));
+  snprintf(materials[0].material, sizeof(materials[0].material), "caulk");
+  for (size_t i = 0; i < vert_count; ++i) {
+    for (int k = 0; k < 3; ++k)
+      verts[i].xyz[k] = bench_randf(rng, 1.f, 8192.f);
+  }
+  for (size_t i = 0; i < tri_count; ++i) {
+    u32 *v = tris[i].vertIndices;
+    if (i > 0 && bench_rand(rng) % 10 == 0) {
+      u32 *other = tris[bench_rand(rng) % i].vertIndices;
+      v[0] = other[2];
+      v[1] = other[0];
+      v[2] = other[1];
+      continue;
+    }
+    v[0] = bench_rand(rng) % vert_count;
+    v[1] = (v[0] + 1 + bench_rand(rng) % 64) % vert_count;
+    v[2] = (v[1] + 1 + bench_rand(rng) % 64) % vert_count;
+  }
+  for (size_t i = 0; i < part_count; ++i) {
+    parts[i].firstTriIndex = i * 16;
+    parts[i].triCount = tri_count - i * 16 < 16 ? tri_count - i * 16 : 16;
+    aabbs[i].u.partitionIndex = i;
+  }
+  bsp_set_lump(bsp, LUMP_MATERIALS, materials, 1);
+  bsp_set_lump(bsp, LUMP_COLLISIONVERTS, verts, vert_count);
+  bsp_set_lump(bsp, LUMP_COLLISIONTRIS, tris, tri_count);
+  bsp_set_lump(bsp, LUMP_COLLISIONPARTITIONS, parts, part_count);
+  bsp_set_lump(bsp, LUMP_COLLISIONAABBS, aabbs, part_count);
+}
+// The linear scan write_patches did before the triangle set, the baseline for bench_dedupe. vertices
+// should be sorted.
+static bool patch_has_triangle(Patch *patch, int *vertices) {
+  for (size_t i = 0; i < buf_size(patch->triangles); ++i) {
+    Triangle *tri = &patch->triangles[i];
+    if (tri->vertex[0] == vertices[0] && tri->vertex[1] == vertices[1] && tri->vertex[2] == vertices[2])
+      return true;
+  }
+  return false;
+}
+static bool patches_has_triangle(Patch *patches, int *vertices) {
+  for (size_t i = 0; i < buf_size(patches); ++i) {
+    if (patch_has_triangle(&patches[i], vertices))
+      return true;
+  }
+  return false;
+}
+// The dedupe step of write_patches on its own, with the previous linear scan over all patches
+// or with the triangle set.
+static size_t bench_dedupe(Triangle *tris, size_t count, bool hashed) {
+  Patch *patches = NULL;
+  TriangleSet seen;
+  size_t unique = 0;
+  if (hashed)
+    triangle_set_init(&seen, count);
+  for (size_t i = 0; i < count; ++i) {
+    bool is_new = hashed ? triangle_set_insert(&seen, tris[i].vertex) : !patches_has_triangle(patches, tris[i].vertex);
+    if (!is_new)
+      continue;
+    if (!hashed) {
+      if (!buf_size(patches) || buf_size(patches[buf_size(patches) - 1].triangles) >= 7)
+        buf_push(patches, (Patch) { 0 });
+      buf_push(patches[buf_size(patches) - 1].triangles, tris[i]);
+    }
+    ++unique;
+  }
+  if (hashed)
+    triangle_set_free(&seen);
+  for (size_t i = 0; i < buf_size(patches); ++i)
+    buf_free(patches[i].triangles);
+  buf_free(patches);
+  return unique;
+}
+#define BENCH_LINEAR_DEDUPE_MAX 40000
+static void bench_patches(size_t size) {
+  u64 rng = 0x6b8b4567327b23c6ull;
+  Bsp bsp = {0};
+  bench_collision_lumps(&bsp, size, &rng);
+  DiskCollisionTriangle *disktris = bsp.lumps[LUMP_COLLISIONTRIS].data;
+  Triangle *tris = malloc(sizeof(Triangle) * size);
+  for (size_t i = 0; i < size; ++i) {
+    for (int k = 0; k < 3; ++k)
+      tris[i].vertex[k] = disktris[i].vertIndices[k];
+    triangle_sort_vertices(tris[i].vertex);
+  }
+  printf("patches: %zu collision triangles\n", size);
+  printf("%10s %12s %12s %10s\n", "triangles", "linear ms", "hashed ms", "unique");
+  for (size_t n = 5000;; n *= 2) {
+    if (n > size)
+      n = size;
+    double t0 = time_seconds();
+    size_t unique = bench_dedupe(tris, n, true);
+    double hashed = time_seconds() - t0;
+    if (n <= BENCH_LINEAR_DEDUPE_MAX) {
+      t0 = time_seconds();
+      bench_dedupe(tris, n, false);
+      printf("%10zu %12.3f %12.3f %10zu\n", n, (time_seconds() - t0) * 1000.0, hashed * 1000.0, unique);
+    } else {
+      printf("%10zu %12s %12.3f %10zu\n", n, "-", hashed * 1000.0, unique);
+    }
+    if (n == size)
+      break;
+  }
+  Writer w = { .fp = fopen(NULL_DEVICE, "w") };
+  double t0 = time_seconds();
+  write_patches(&bsp, &w);
+  writer_flush(&w);
+  printf("write_patches: %.3f ms\n", (time_seconds() - t0) * 1000.0);
+  writer_free(&w);
+  fclose(w.fp);
+  free(tris);
+  bsp_close(&bsp);
+}
+// Convex brushes made of the six axial planes and a few random bevels, like compiled brushes.
+#define BENCH_BRUSH_COUNT 1024
+#define BENCH_BRUSH_SIDES 12
+// The plane loop as polygonization used to run it, over the array-of-structs planes.
+static bool bench_contains_point_aos(MapBrush *brush, const float *p, float epsilon) {
+  for (size_t i = 0; i < brush->plane_count; ++i) {
+    MapPlane *plane = &brush->planes[i];
+    if (vec3_mul_inner(plane->normal, p) - plane->distance > epsilon)
+      return false;
+  }
+  return true;
+}
+static void bench_planes(size_t size) {
+  u64 rng = 0x2545f4914f6cdd1dull;
+  Bsp bsp = {0};
+  MapBrush *brushes = bsp_alloc(&bsp, sizeof(MapBrush) * BENCH_BRUSH_COUNT);
+  for (size_t i = 0; i < BENCH_BRUSH_COUNT; ++i) {
+    MapBrush *b = &brushes[i];
+    b->plane_count = 6 + bench_rand(&rng) % BENCH_BRUSH_SIDES;
+    b->soa = (BrushPlanes) {0};
+    b->planes = bsp_alloc(&bsp, sizeof(MapPlane) * b->plane_count);
+    for (int k = 0; k < 3; ++k) {
+      b->mins[k] = bench_randf(&rng, -64.f, 0.f);
+      b->maxs[k] = bench_randf(&rng, 1.f, 64.f);
+    }
+    map_planes_from_aabb(b->mins, b->maxs, b->planes);
+    for (size_t j = 6; j < b->plane_count; ++j) {
+      MapPlane *plane = &b->planes[j];
+      vec3 n = { bench_randf(&rng, -1.f, 1.f), bench_randf(&rng, -1.f, 1.f), bench_randf(&rng, -1.f, 1.f) };
+      vec3_norm(plane->normal, n);
+      plane->distance = bench_randf(&rng, 16.f, 64.f);
+    }
+  }
+  bsp.mapbrushes = brushes;
+  bsp.mapbrush_count = BENCH_BRUSH_COUNT;
+  map_brush_planes_load(&bsp);
+  float *points = bsp_alloc(&bsp, sizeof(vec3) * size);
+  for (size_t i = 0; i < size * 3; ++i)
+    points[i] = bench_randf(&rng, -72.f, 72.f);
+  struct {
+    const char *name;
+    BrushContainsPoint fn;
+  } kernels[] = {
+    { "aos scalar", NULL },
+    { "soa scalar", brush_contains_point_scalar },
+#ifdef BSP_X86
+    { "sse", brush_contains_point_sse },
+    { "avx2", cpu_has_avx2() ? brush_contains_point_avx2 : NULL },
+#endif
+  };
+  printf("planes: %zu points against %d brushes of 6-%d planes\n", size, BENCH_BRUSH_COUNT, 6 + BENCH_BRUSH_SIDES - 1);
+  printf("%12s %10s %14s %10s\n", "kernel", "ms", "Mtests/s", "inside");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+    if (k > 1 && !kernels[k].fn) {
+      printf("%12s %10s\n", kernels[k].name, "-");
+      continue;
+    }
+    size_t inside = 0;
+    double t0 = time_seconds();
+    for (size_t i = 0; i < size; ++i) {
+      MapBrush *b = &brushes[i % BENCH_BRUSH_COUNT];
+      float *p = &points[i * 3];
+      inside += kernels[k].fn ? kernels[k].fn(&b->soa, p, 0.008f) : bench_contains_point_aos(b, p, 0.008f);
+    }
+    double t = time_seconds() - t0;
+    printf("%12s %10.3f %14.1f %10zu\n", kernels[k].name, t * 1000.0, size / t / 1e6, inside);
+  }
+  // The query itself, through whichever kernel this cpu gets.
+  size_t inside = 0;
+  double t0 = time_seconds();
+  for (size_t i = 0; i < size; ++i)
+    inside += brush_contains_point(&brushes[i % BENCH_BRUSH_COUNT], &points[i * 3], 0.008f);
+  double t = time_seconds() - t0;
+  printf("%12s %10.3f %14.1f %10zu\n", "dispatched", t * 1000.0, size / t / 1e6, inside);
+  arena_free(&bsp.arena);
+}
+// Brush lumps laid out like a compiled map: six axial sides storing the bounds, then bevel sides
+// pointing at shared planes, all in one world model. Uses material 0.
+static void bench_brush_lumps(Bsp *bsp, size_t brush_count, size_t max_bevels, u64 *rng) {
+  size_t plane_count = 4096;
+  DiskPlane *planes = calloc(plane_count, sizeof(DiskPlane));
+  DiskBrush *brushes = calloc(brush_count + 1, sizeof(DiskBrush));
+  cbrushside_t *sides = calloc(brush_count * (6 + max_bevels) + 1, sizeof(cbrushside_t));
+  dmodel_t *models = calloc(1, sizeof(dmodel_t));
+  for (size_t i = 0; i < plane_count; ++i) {
+    vec3 n = { bench_randf(rng, -1.f, 1.f), bench_randf(rng, -1.f, 1.f), bench_randf(rng, -1.f, 1.f) };
+    vec3_norm(planes[i].normal, n);
+    planes[i].dist = bench_randf(rng, 16.f, 64.f);
+  }
+  size_t side_count = 0;
+  for (size_t i = 0; i < brush_count; ++i) {
+    size_t bevels = max_bevels ? bench_rand(rng) % (max_bevels + 1) : 0;
+    brushes[i].numSides = 6 + bevels;
+    for (int axis = 0; axis < 3; ++axis) {
+      float bounds[2] = { bench_randf(rng, -64.f, 0.f), bench_randf(rng, 1.f, 64.f) };
+      for (int sign = 0; sign < 2; ++sign) {
+        memcpy(&sides[side_count].plane, &bounds[sign], sizeof(float));
+        sides[side_count++].materialNum = 0;
+      }
+    }
+    for (size_t k = 0; k < bevels; ++k) {
+      sides[side_count].plane = bench_rand(rng) % plane_count;
+      sides[side_count++].materialNum = 0;
+    }
+  }
+  models[0].numBrushes = brush_count;
+  bsp_set_lump(bsp, LUMP_PLANES, planes, plane_count);
+  bsp_set_lump(bsp, LUMP_BRUSHES, brushes, brush_count);
+  bsp_set_lump(bsp, LUMP_BRUSHSIDES, sides, side_count);
+  bsp_set_lump(bsp, LUMP_MODELS, models, 1);
+}
+// A cold export, building the cache, and a warm export that hashes the lumps, checks the cache
+// and only formats. The warm run reads the cache from memory, which is what a mapped file becomes.
+static void bench_cache(size_t size) {
+  u64 rng = 0x853c49e6748fea9bull;
+  Bsp bsp = {0};
+  bench_collision_lumps(&bsp, size, &rng);
+  bench_brush_lumps(&bsp, size, BENCH_BRUSH_SIDES - 1, &rng);
+  dmodel_t *model = bsp.lumps[LUMP_MODELS].data;
+  vec3 origin = {0};
+  printf("cache: %zu brushes of 6-%d planes and %zu collision triangles\n", size, 6 + BENCH_BRUSH_SIDES - 1, size);
+  Writer w = { .fp = fopen(NULL_DEVICE, "w") };
+  double t0 = time_seconds();
+  load_map_brushes(&bsp);
+  write_brushes(&bsp, &w, model, origin);
+  write_world_patches(&bsp, &w);
+  writer_flush(&w);
+  printf("%-8s %10.3f ms\n", "cold", (time_seconds() - t0) * 1000.0);
+  arena_free(&bsp.arena);
+  t0 = time_seconds();
+  u64 key = brush_cache_key(&bsp);
+  brush_cache_build(&bsp, &bsp.brush_cache, key);
+  BrushCacheHeader *h = bsp.brush_cache.data;
+  printf("%-8s %10.3f ms, %.1f MB, %" PRIu64 " faces, %" PRIu64 " patches\n", "build", (time_seconds() - t0) * 1000.0,
+         h->size / 1e6, h->face_count, h->patch_count);
+  t0 = time_seconds();
+  bool valid = brush_cache_key(&bsp) == key && brush_cache_validate(&bsp, &bsp.brush_cache, bsp.brush_cache.data, h->size, key);
+  double check = time_seconds() - t0;
+  write_brushes(&bsp, &w, model, origin);
+  write_world_patches(&bsp, &w);
+  writer_flush(&w);
+  printf("%-8s %10.3f ms, of which %.3f ms hashing and validating%s\n", "warm", (time_seconds() - t0) * 1000.0,
+         check * 1000.0, valid ? "" : " (cache rejected)");
+  writer_free(&w);
+  fclose(w.fp);
+  bsp_close(&bsp);
+}
+// Portal pairs like the compiler writes them: every portal is stored once for each of its two
+// cells, the second copy with its vertices in reverse order. Appends a plane per pair.
+static void bench_portal_lumps(Bsp *bsp, size_t portal_count, u64 *rng) {
+  size_t pair_count = portal_count / 2;
+  LumpData *pl = &bsp->lumps[LUMP_PLANES];
+  size_t first_plane = pl->count;
+  DiskPlane *planes = realloc(pl->data, sizeof(DiskPlane) * (first_plane + pair_count + 1));
+  DiskGfxPortal *portals = calloc(pair_count * 2 + 1, sizeof(DiskGfxPortal));
+  DiskGfxPortalVertex *verts = calloc(pair_count * 8 + 1, sizeof(DiskGfxPortalVertex));
+  for (size_t i = 0; i < pair_count; ++i) {
+    int axis = bench_rand(rng) % 2;
+    float wall = bench_randf(rng, -8192.f, 8192.f), center = bench_randf(rng, -8192.f, 8192.f);
+    float bottom = bench_randf(rng, -512.f, 512.f);
+    DiskPlane *plane = &planes[first_plane + i];
+    memset(plane, 0, sizeof(*plane));
+    plane->normal[axis] = 1.f;
+    plane->dist = wall;
+    float corners[4][2] = { { -64.f, 0.f }, { 64.f, 0.f }, { 64.f, 192.f }, { -64.f, 192.f } };
+    for (int side = 0; side < 2; ++side) {
+      DiskGfxPortal *portal = &portals[side * pair_count + i];
+      portal->planeIndex = first_plane + i;
+      portal->cellIndex = side;
+      portal->firstPortalVertex = i * 8 + side * 4;
+      portal->portalVertexCount = 4;
+      for (int k = 0; k < 4; ++k) {
+        float *xyz = verts[portal->firstPortalVertex + k].xyz;
+        float *c = corners[side ? 3 - k : k];
+        xyz[axis] = wall;
+        xyz[axis ^ 1] = center + c[0];
+        xyz[2] = bottom + c[1];
+      }
+    }
+  }
+  // Two cells spanning the map, each holding the portals into the other one. No cull groups.
+  DiskGfxCell *cells = calloc(2, sizeof(DiskGfxCell));
+  for (int c = 0; c < 2; ++c) {
+    vec3_dup(cells[c].mins, (vec3) { -8192.f - 64.f, -8192.f - 64.f, -512.f });
+    vec3_dup(cells[c].maxs, (vec3) { 8192.f + 64.f, 8192.f + 64.f, 512.f + 192.f });
+    cells[c].firstPortal = (c ^ 1) * pair_count;
+    cells[c].portalCount = pair_count;
+  }
+  pl->data = planes;
+  pl->count = first_plane + pair_count;
+  bsp_set_lump(bsp, LUMP_PORTALS, portals, pair_count * 2);
+  bsp_set_lump(bsp, LUMP_PORTALVERTS, verts, pair_count * 8);
+  bsp_set_lump(bsp, LUMP_CELLS, cells, 2);
+}
+// Counts for a generated map. sides is the most bevel sides a brush gets on top of its six axial ones.
+typedef struct {
+  size_t brushes;
+  size_t sides;
+  size_t triangles;
+  size_t portals;
+  size_t entities;
+  u64 seed;
+} SyntheticMap;
+#define SYNTHETIC_BRUSH_MODEL_BRUSHES 4
+// Every eighth entity is a script_brushmodel with a model of its own taken from the end of the
+// brushes, the rest are point entities.
+static void synthetic_map_lumps(Bsp *bsp, SyntheticMap *sm) {
+  u64 rng = sm->seed;
+  bench_collision_lumps(bsp, sm->triangles, &rng);
+  bench_brush_lumps(bsp, sm->brushes, sm->sides, &rng);
+  bench_portal_lumps(bsp, sm->portals, &rng);
+  size_t brush_models = sm->entities / 8;
+  if (brush_models * SYNTHETIC_BRUSH_MODEL_BRUSHES > sm->brushes)
+    brush_models = sm->brushes / SYNTHETIC_BRUSH_MODEL_BRUSHES;
+  dmodel_t *models = calloc(brush_models + 1, sizeof(dmodel_t));
+  models[0].numBrushes = sm->brushes - brush_models * SYNTHETIC_BRUSH_MODEL_BRUSHES;
+  for (size_t i = 1; i <= brush_models; ++i) {
+    models[i].firstBrush = models[0].numBrushes + (i - 1) * SYNTHETIC_BRUSH_MODEL_BRUSHES;
+    models[i].numBrushes = SYNTHETIC_BRUSH_MODEL_BRUSHES;
+  }
+  free(bsp->lumps[LUMP_MODELS].data);
+  bsp_set_lump(bsp, LUMP_MODELS, models, brush_models + 1);
+  Writer w = {0};
+  writer_literal(&w, "{\n\"classname\" \"worldspawn\"\n\"sundirection\" \"-45 120 0\"\n}\n");
+  size_t model = 0;
+  for (size_t i = 0; i < sm->entities; ++i) {
+    writer_literal(&w, "{\n\"origin\" \"");
+    writer_vec3(&w, bench_randf(&rng, -8192.f, 8192.f), bench_randf(&rng, -8192.f, 8192.f), bench_randf(&rng, -512.f, 512.f));
+    if (i % 8 == 7 && model < brush_models) {
+      writer_literal(&w, "\"\n\"classname\" \"script_brushmodel\"\n\"model\" \"*");
+      writer_int(&w, ++model);
+    } else {
+      writer_literal(&w, "\"\n\"classname\" \"script_origin\"\n\"angles\" \"0 ");
+      writer_int(&w, bench_rand(&rng) % 360);
+      writer_literal(&w, " 0");
+    }
+    writer_literal(&w, "\"\n\"targetname\" \"ent");
+    writer_int(&w, i);
+    writer_literal(&w, "\"\n}\n");
+  }
+  buf_push(w.data, 0);
+  size_t size = buf_size(w.data);
+  char *entities = malloc(size);
+  memcpy(entities, w.data, size);
+  writer_free(&w);
+  bsp_set_lump(bsp, LUMP_ENTITIES, entities, size);
+}
+// Writes the lumps of a synthetic map as an IBSP version 4 file, each lump 4 byte aligned.
+static bool write_synthetic_map(const char *path, SyntheticMap *sm) {
+  Bsp bsp = {0};
+  synthetic_map_lumps(&bsp, sm);
+  FILE *fp = fopen(path, "wb");
+  bool ok = fp != NULL;
+  dheader_t hdr = {0};
+  memcpy(hdr.ident, "IBSP", 4);
+  hdr.version = 4;
+  u32 offset = sizeof(hdr);
+  for (int type = 0; type < LUMP_MAX && ok; ++type) {
+    LumpData *ld = &bsp.lumps[type];
+    offset = (offset + 3) & ~3u;
+    hdr.lumps[type].fileofs = offset;
+    hdr.lumps[type].filelen = ld->count * lumpsizes[type];
+    offset += hdr.lumps[type].filelen;
+  }
+  ok = ok && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+  for (int type = 0; type < LUMP_MAX && ok; ++type) {
+    lump_t *l = &hdr.lumps[type];
+    while (ok && ftell(fp) < l->fileofs)
+      ok = fputc(0, fp) != EOF;
+    ok = ok && (l->filelen == 0 || fwrite(bsp.lumps[type].data, l->filelen, 1, fp) == 1);
+  }
+  if (fp)
+    ok = !fclose(fp) && ok;
+  bsp_close(&bsp);
+  return ok;
+}
+// Counts from a list like "brushes=20000,sides=8,triangles=100000,portals=2000,entities=1000".
+static bool parse_synthetic_counts(const char *list, SyntheticMap *sm) {
+  const char *p = list;
+  while (*p) {
+    char key[32];
+    unsigned long long value;
+    int n = 0;
+    if (sscanf(p, "%31[a-z]=%llu%n", key, &value, &n) != 2)
+      return false;
+    if (!strcmp(key, "brushes"))
+      sm->brushes = value;
+    else if (!strcmp(key, "sides"))
+      sm->sides = value;
+    else if (!strcmp(key, "triangles"))
+      sm->triangles = value;
+    else if (!strcmp(key, "portals"))
+      sm->portals = value;
+    else if (!strcmp(key, "entities"))
+      sm->entities = value;
+    else if (!strcmp(key, "seed"))
+      sm->seed = value;
+    else
+      return false;
+    p += n;
+    if (*p == ',')
+      ++p;
+    else if (*p)
+      return false;
+  }
+  return true;
+}
+// Scaled from the brush count the way the counts relate in shipped maps.
+static SyntheticMap synthetic_map_scaled(size_t brushes) {
+  return (SyntheticMap) { .brushes = brushes, .sides = 8, .triangles = brushes * 5, .portals = brushes / 10,
+                          .entities = brushes / 20, .seed = 0x853c49e6748fea9bull };
+}
+// Where benchmarks put the files they need on disk.
+static void bench_temp_path(char *path, size_t size, const char *name) {
+  const char *dir = getenv("TMPDIR");
+  if (!dir)
+    dir = getenv("TEMP");
+  if (!dir)
+    dir = getenv("TMP");
+#ifdef _WIN32
+  if (!dir)
+    dir = ".";
+#else
+  if (!dir)
+    dir = "/tmp";
+#endif
+  snprintf(path, size, "%s/%s", dir, name);
+}
+#define BENCH_EXPORT_SCALES 4
+#define BENCH_VIS_CAMERAS 64
+enum {
+  BENCH_PHASE_LOAD,
+  BENCH_PHASE_ENTITIES,
+  BENCH_PHASE_BRUSHES,
+  BENCH_PHASE_POLYGONIZE,
+  BENCH_PHASE_PATCHES,
+  BENCH_PHASE_PORTALS,
+  BENCH_PHASE_EXPORT,
+  BENCH_PHASE_VIS,
+  BENCH_PHASES
+};
+static const char *bench_phase_names[BENCH_PHASES] = {
+  "load", "entities", "brushes", "polygonize", "patches", "portals", "export", "vis"
+};
+// Each phase of an export on its own, then a whole export, on generated maps of size, 2 * size,
+// 4 * size and 8 * size brushes. Everything but the export runs on one thread. Loading reads the
+// lumps from the file, the rest works from memory. vis is -vis from random cameras plus -pvs, which
+// also checks the generated cells and portals load.
+static void bench_export(size_t size) {
+  char path[1024];
+  bench_temp_path(path, sizeof(path), "bsp_bench_export.d3dbsp");
+  double times[BENCH_EXPORT_SCALES][BENCH_PHASES];
+  size_t counts[BENCH_EXPORT_SCALES][BENCH_PHASES];
+  FILE *null_out = fopen(NULL_DEVICE, "w");
+  u64 rng = 0x5851f42d4c957f2dull;
+  VisCamera *cameras = NULL;
+  for (int i = 0; i < BENCH_VIS_CAMERAS; ++i) {
+    VisCamera cam = { .yaw = bench_randf(&rng, 0.f, 360.f), .fov_x = 90.f, .fov_y = 73.74f };
+    cam.origin[0] = bench_randf(&rng, -8192.f, 8192.f);
+    cam.origin[1] = bench_randf(&rng, -8192.f, 8192.f);
+    cam.origin[2] = bench_randf(&rng, 0.f, 512.f);
+    buf_push(cameras, cam);
+  }
+  printf("export: generated maps of %zu to %zu brushes\n", size, size << (BENCH_EXPORT_SCALES - 1));
+  printf("%9s %8s", "brushes", "MB");
+  for (int p = 0; p < BENCH_PHASES; ++p)
+    printf(" %11s", bench_phase_names[p]);
+  printf("   (ms)\n");
+  for (int s = 0; s < BENCH_EXPORT_SCALES; ++s) {
+    SyntheticMap sm = synthetic_map_scaled(size << s);
+    if (!write_synthetic_map(path, &sm)) {
+      fprintf(stderr, "Failed to write '%s'\n", path);
+      break;
+    }
+    Bsp bsp = { .threads = 1 };
+    u64 declared = export_lumps | patch_lumps | portal_lumps;
+    double t0 = time_seconds();
+    bsp_open(&bsp, path, false, declared);
+    for (int type = 0; type < LUMP_MAX; ++type) {
+      if (declared & LUMP_BIT(type))
+        lump(&bsp, type);
+    }
+    times[s][BENCH_PHASE_LOAD] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_LOAD] = bsp.filelen;
+    t0 = time_seconds();
+    bsp_load_entities(&bsp);
+    times[s][BENCH_PHASE_ENTITIES] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_ENTITIES] = buf_size(bsp.entities);
+    t0 = time_seconds();
+    load_map_brushes(&bsp);
+    times[s][BENCH_PHASE_BRUSHES] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_BRUSHES] = bsp.mapbrush_count;
+    t0 = time_seconds();
+    size_t polygons = 0;
+    for (size_t i = 0; i < bsp.mapbrush_count; ++i) {
+      Arena scratch = { .block_size = BRUSH_ARENA_BLOCK_SIZE };
+      Polygon *polys;
+      polygons += polygonize_brush(&bsp.mapbrushes[i], &scratch, &polys);
+      arena_free(&scratch);
+    }
+    times[s][BENCH_PHASE_POLYGONIZE] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_POLYGONIZE] = bsp.mapbrush_count;
+    Writer w = { .fp = null_out };
+    t0 = time_seconds();
+    write_patches(&bsp, &w);
+    writer_flush(&w);
+    times[s][BENCH_PHASE_PATCHES] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_PATCHES] = sm.triangles;
+    t0 = time_seconds();
+    write_portals(&bsp, &w);
+    writer_flush(&w);
+    times[s][BENCH_PHASE_PORTALS] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_PORTALS] = sm.portals;
+    writer_free(&w);
+    bsp_close(&bsp);
+    // The same steps process_map takes for -export, with the usual threads.
+    ProgramOptions opts = {0};
+    t0 = time_seconds();
+    bsp_open(&bsp, path, false, export_lumps | patch_lumps);
+    bsp_load_entities(&bsp);
+    load_map_brushes(&bsp);
+    export_to_map(&bsp, null_out, &opts, NULL_DEVICE);
+    times[s][BENCH_PHASE_EXPORT] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_EXPORT] = sm.brushes;
+    bsp_close(&bsp);
+    t0 = time_seconds();
+    bsp_open(&bsp, path, false, vis_lumps | pvs_lumps);
+    print_visibility(&bsp, null_out, cameras);
+    print_pvs(&bsp, null_out);
+    times[s][BENCH_PHASE_VIS] = time_seconds() - t0;
+    counts[s][BENCH_PHASE_VIS] = sm.portals;
+    bsp_close(&bsp);
+    printf("%9zu %8.1f", sm.brushes, counts[s][BENCH_PHASE_LOAD] / 1e6);
+    for (int p = 0; p < BENCH_PHASES; ++p)
+      printf(" %11.3f", times[s][p] * 1000.0);
+    printf("\n");
+  }
+  remove(path);
+  fclose(null_out);
+  buf_free(cameras);
+  // Throughput at the largest size, in the unit each phase works through, and how time grows with
+  // size: 1.0 is linear, 2.0 quadratic.
+  int last = BENCH_EXPORT_SCALES - 1;
+  const char *units[BENCH_PHASES] = { "MB", "entities", "brushes", "brushes", "triangles", "portals", "brushes", "portals" };
+  printf("%11s %16s %10s\n", "phase", "throughput/s", "scaling");
+  for (int p = 0; p < BENCH_PHASES; ++p) {
+    double per_second = counts[last][p] / times[last][p] / (p == BENCH_PHASE_LOAD ? 1e6 : 1.0);
+    double scaling = log(times[last][p] / times[0][p]) / log((double)counts[last][p] / counts[0][p]);
+    printf("%11s %10.4g %-9s %6.2f\n", bench_phase_names[p], per_second, units[p], scaling);
+  }
+}
+// Hashing throughput on one thread and on all of them, over size MB of pseudo random bytes.
+static void bench_hash(size_t size) {
+  u64 rng = 0x9e3779b97f4a7c15ull;
+  size_t bytes = size << 20;
+  u32 *data = malloc(bytes);
+  for (size_t i = 0; i < bytes / 4; ++i)
+    data[i] = bench_rand(&rng);
+  ByteRange range = { (const u8*)data, bytes };
+  printf("hash: %zu MB in %d KB chunks\n", size, HASH_CHUNK_SIZE >> 10);
+  printf("%8s %10s %10s %18s\n", "threads", "ms", "GB/s", "hash");
+  size_t threads[] = { 1, cpu_count() };
+  for (size_t k = 0; k < 2; ++k) {
+    u64 hash;
+    double t0 = time_seconds();
+    free(hash_ranges(&range, 1, &hash, threads[k]));
+    double t = time_seconds() - t0;
+    printf("%8zu %10.3f %10.2f %18llx\n", threads[k], t * 1000.0, bytes / t / 1e9, (unsigned long long)hash);
+  }
+  free(data);
+}
+// The plane and s/t vectors the compiler stores with a collision triangle: s and t are the
+// barycentric weights of the second and third vertex, s = dot(svec, p) - svec[3].
+static void collision_triangle_setup(DiskCollisionTriangle *tri, DiskCollisionVertex *verts) {
+  float *a = verts[tri->vertIndices[0]].xyz, *b = verts[tri->vertIndices[1]].xyz, *c = verts[tri->vertIndices[2]].xyz;
+  vec3 e1, e2, n;
+  vec3_sub(e1, b, a);
+  vec3_sub(e2, c, a);
+  vec3_mul_cross(n, e1, e2);
+  vec3_norm(tri->plane, n);
+  tri->plane[3] = vec3_mul_inner(tri->plane, a);
+  float d11 = vec3_mul_inner(e1, e1), d12 = vec3_mul_inner(e1, e2), d22 = vec3_mul_inner(e2, e2);
+  float inv_det = 1.f / (d11 * d22 - d12 * d12);
+  for (int k = 0; k < 3; ++k) {
+    tri->svec[k] = (e1[k] * d22 - e2[k] * d12) * inv_det;
+    tri->tvec[k] = (e2[k] * d11 - e1[k] * d12) * inv_det;
+  }
+  tri->svec[3] = vec3_mul_inner(tri->svec, a);
+  tri->tvec[3] = vec3_mul_inner(tri->tvec, a);
+}
+// Rolling terrain of grid * grid cells, two triangles each. Every 4x4 block of cells is a partition
+// with a leaf aabb, and the leaves are grouped into quadtrees of 8x8 blocks.
+#define BENCH_TERRAIN_CELL 64.f
+#define BENCH_TERRAIN_BLOCK 4
+#define BENCH_TERRAIN_TREE 8
+typedef struct {
+  DiskCollisionAabbTree *aabbs;
+  DiskCollisionAabbTree *leaves; // one per block, row by row
+  size_t blocks;
+  size_t count;
+} BenchTerrain;
+static void bench_terrain_bounds(DiskCollisionAabbTree *node, vec3 mins, vec3 maxs) {
+  for (int k = 0; k < 3; ++k) {
+    node->origin[k] = (mins[k] + maxs[k]) * 0.5f;
+    node->halfSize[k] = (maxs[k] - mins[k]) * 0.5f;
+  }
+}
+static void bench_terrain_node(BenchTerrain *bt, DiskCollisionAabbTree *node, size_t bx, size_t by, size_t size) {
+  if (size == 1) {
+    *node = bt->leaves[by * bt->blocks + bx];
+    return;
+  }
+  size_t half = size / 2;
+  s32 first = bt->count;
+  bt->count += 4;
+  vec3 mins = { FLT_MAX, FLT_MAX, FLT_MAX }, maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (size_t i = 0; i < 4; ++i) {
+    DiskCollisionAabbTree *child = &bt->aabbs[first + i];
+    bench_terrain_node(bt, child, bx + (i & 1) * half, by + (i >> 1) * half, half);
+    for (int k = 0; k < 3; ++k) {
+      mins[k] = fminf(mins[k], child->origin[k] - child->halfSize[k]);
+      maxs[k] = fmaxf(maxs[k], child->origin[k] + child->halfSize[k]);
+    }
+  }
+  bench_terrain_bounds(node, mins, maxs);
+  node->childCount = 4;
+  node->u.firstChildIndex = first;
+}
+static void bench_terrain_lumps(Bsp *bsp, size_t grid) {
+  size_t blocks = grid / BENCH_TERRAIN_BLOCK;
+  size_t trees = blocks / BENCH_TERRAIN_TREE;
+  size_t vert_count = (grid + 1) * (grid + 1);
+  size_t tri_count = grid * grid * 2;
+  size_t part_count = blocks * blocks;
+  dmaterial_t *materials = calloc(1, sizeof(dmaterial_t));
+  DiskCollisionVertex *verts = calloc(vert_count, sizeof(DiskCollisionVertex));
+  DiskCollisionTriangle *tris = calloc(tri_count, sizeof(DiskCollisionTriangle));
+  DiskCollisionPartition *parts = calloc(part_count, sizeof(DiskCollisionPartition));
+  BenchTerrain bt = {
+    .aabbs = calloc(part_count * 2, sizeof(DiskCollisionAabbTree)),
+    .leaves = calloc(part_count, sizeof(DiskCollisionAabbTree)),
+    .blocks = blocks,
+    .count = trees * trees
+  };
+  snprintf(materials[0].material, sizeof(materials[0].material), "terrain");
+  materials[0].contentFlags = 1;
+  for (size_t y = 0; y <= grid; ++y) {
+    for (size_t x = 0; x <= grid; ++x) {
+      float *p = verts[y * (grid + 1) + x].xyz;
+      p[0] = x * BENCH_TERRAIN_CELL;
+      p[1] = y * BENCH_TERRAIN_CELL;
+      p[2] = 96.f * sinf(x * 0.21f) * cosf(y * 0.17f) + 32.f * sinf((x + y) * 0.9f);
+    }
+  }
+  size_t n = 0;
+  for (size_t by = 0; by < blocks; ++by) {
+    for (size_t bx = 0; bx < blocks; ++bx) {
+      DiskCollisionPartition *part = &parts[by * blocks + bx];
+      part->firstTriIndex = n;
+      part->triCount = BENCH_TERRAIN_BLOCK * BENCH_TERRAIN_BLOCK * 2;
+      vec3 mins = { FLT_MAX, FLT_MAX, FLT_MAX }, maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+      for (size_t y = by * BENCH_TERRAIN_BLOCK; y < (by + 1) * BENCH_TERRAIN_BLOCK; ++y) {
+        for (size_t x = bx * BENCH_TERRAIN_BLOCK; x < (bx + 1) * BENCH_TERRAIN_BLOCK; ++x) {
+          u32 v00 = y * (grid + 1) + x, v10 = v00 + 1, v01 = v00 + grid + 1, v11 = v01 + 1;
+          u32 quad[2][3] = { { v00, v10, v11 }, { v00, v11, v01 } };
+          for (int t = 0; t < 2; ++t, ++n) {
+            memcpy(tris[n].vertIndices, quad[t], sizeof(quad[t]));
+            collision_triangle_setup(&tris[n], verts);
+            for (int i = 0; i < 3; ++i) {
+              for (int k = 0; k < 3; ++k) {
+                mins[k] = fminf(mins[k], verts[quad[t][i]].xyz[k]);
+                maxs[k] = fmaxf(maxs[k], verts[quad[t][i]].xyz[k]);
+              }
+            }
+          }
+        }
+      }
+      DiskCollisionAabbTree *leaf = &bt.leaves[by * blocks + bx];
+      bench_terrain_bounds(leaf, mins, maxs);
+      leaf->u.partitionIndex = by * blocks + bx;
+    }
+  }
+  for (size_t ty = 0; ty < trees; ++ty) {
+    for (size_t tx = 0; tx < trees; ++tx)
+      bench_terrain_node(&bt, &bt.aabbs[ty * trees + tx], tx * BENCH_TERRAIN_TREE, ty * BENCH_TERRAIN_TREE, BENCH_TERRAIN_TREE);
+  }
+  free(bt.leaves);
+  bsp_set_lump(bsp, LUMP_MATERIALS, materials, 1);
+  bsp_set_lump(bsp, LUMP_COLLISIONVERTS, verts, vert_count);
+  bsp_set_lump(bsp, LUMP_COLLISIONTRIS, tris, tri_count);
+  bsp_set_lump(bsp, LUMP_COLLISIONPARTITIONS, parts, part_count);
+  bsp_set_lump(bsp, LUMP_COLLISIONAABBS, bt.aabbs, bt.count);
+}
+#define BENCH_TERRAIN_GRID 256
+static void bench_trace(size_t size) {
+  u64 rng = 0x9e3779b97f4a7c15ull;
+  Bsp bsp = {0};
+  bench_terrain_lumps(&bsp, BENCH_TERRAIN_GRID);
+  float extent = BENCH_TERRAIN_GRID * BENCH_TERRAIN_CELL;
+  // Eye height to a random point on the ground some distance away, like line of sight checks.
+  TraceRay *rays = malloc(sizeof(TraceRay) * size);
+  TraceRay *boxes = malloc(sizeof(TraceRay) * size);
+  for (size_t i = 0; i < size; ++i) {
+    TraceRay *r = &rays[i];
+    *r = (TraceRay) {0};
+    r->start[0] = bench_randf(&rng, 0.f, extent);
+    r->start[1] = bench_randf(&rng, 0.f, extent);
+    r->start[2] = bench_randf(&rng, 140.f, 200.f);
+    for (int k = 0; k < 2; ++k)
+      r->end[k] = fminf(fmaxf(r->start[k] + bench_randf(&rng, -2048.f, 2048.f), 0.f), extent);
+    r->end[2] = bench_randf(&rng, -140.f, 140.f);
+    boxes[i] = *r;
+    vec3_dup(boxes[i].extents, (vec3) { 15.f, 15.f, 36.f });
+  }
+  TraceResult *results = malloc(sizeof(TraceResult) * size);
+  TraceResult *check = malloc(sizeof(TraceResult) * size);
+  printf("trace: %zu rays against %d terrain triangles\n", size, BENCH_TERRAIN_GRID * BENCH_TERRAIN_GRID * 2);
+  printf("%8s %8s %10s %14s %10s\n", "kind", "threads", "ms", "Mrays/s", "hits");
+  collision_load(&bsp);
+  size_t threads[] = { 1, 0 };
+  for (int kind = 0; kind < 2; ++kind) {
+    for (int t = 0; t < 2; ++t) {
+      bsp.threads = threads[t];
+      double t0 = time_seconds();
+      trace_batch(&bsp, kind ? boxes : rays, results, size);
+      double elapsed = time_seconds() - t0;
+      size_t hits = 0;
+      for (size_t i = 0; i < size; ++i)
+        hits += results[i].fraction < 1.f;
+      printf("%8s %8zu %10.3f %14.2f %10zu\n", kind ? "box" : "ray", t ? cpu_count() : 1, elapsed * 1000.0,
+             size / elapsed / 1e6, hits);
+    }
+  }
+  // A tiny box has to stop where the ray does, which checks the two triangle tests against each other.
+  // The few that differ graze a ridge, where the box's padding touches and the ray passes.
+  for (size_t i = 0; i < size; ++i)
+    vec3_dup(boxes[i].extents, (vec3) { 0.001f, 0.001f, 0.001f });
+  trace_batch(&bsp, rays, results, size);
+  trace_batch(&bsp, boxes, check, size);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < size; ++i)
+    mismatches += fabsf(results[i].fraction - check[i].fraction) > 0.01f;
+  printf("ray/box mismatches: %zu of %zu\n", mismatches, size);
+  free(rays);
+  free(boxes);
+  free(results);
+  free(check);
+  bsp_close(&bsp);
+}
+// A tree over a 16k unit cube that mostly splits on axial planes, with every fourth plane tilted,
+// down to BENCH_LEAF_DEPTH levels. Nodes are written parent first like the compiler does.
+#define BENCH_LEAF_DEPTH 16
+#define BENCH_LEAF_EXTENT 8192.f
+typedef struct {
+  dnode_t *nodes;
+  DiskPlane *planes;
+  dleaf_t *leafs;
+  u64 rng;
+} BenchLeafTree;
+static s32 bench_leaf_node(BenchLeafTree *bt, vec3 mins, vec3 maxs, int depth) {
+  if (depth == BENCH_LEAF_DEPTH) {
+    s32 leaf = buf_size(bt->leafs);
+    buf_push(bt->leafs, ((dleaf_t) { .cluster = leaf / 4, .area = leaf / 256, .cellNum = leaf / 16 }));
+    return -(leaf + 1);
+  }
+  int axis = depth % 3;
+  vec3 center;
+  for (int k = 0; k < 3; ++k)
+    center[k] = bench_randf(&bt->rng, mins[k] + (maxs[k] - mins[k]) * 0.3f, mins[k] + (maxs[k] - mins[k]) * 0.7f);
+  DiskPlane plane = {0};
+  plane.normal[axis] = 1.f;
+  if (bench_rand(&bt->rng) % 4 == 0) {
+    plane.normal[(axis + 1) % 3] = bench_randf(&bt->rng, -0.5f, 0.5f);
+    vec3_norm(plane.normal, plane.normal);
+  }
+  plane.dist = vec3_mul_inner(plane.normal, center);
+  s32 index = buf_size(bt->nodes);
+  buf_push(bt->nodes, ((dnode_t) { .planeNum = buf_size(bt->planes) }));
+  buf_push(bt->planes, plane);
+  // The children keep the axial bounds, which is all the split positions need.
+  vec3 front_mins, back_maxs;
+  vec3_dup(front_mins, mins);
+  vec3_dup(back_maxs, maxs);
+  front_mins[axis] = center[axis];
+  back_maxs[axis] = center[axis];
+  s32 front = bench_leaf_node(bt, front_mins, maxs, depth + 1);
+  s32 back = bench_leaf_node(bt, mins, back_maxs, depth + 1);
+  bt->nodes[index].children[0] = front;
+  bt->nodes[index].children[1] = back;
+  return index;
+}
+// The plain descent, one point at a time.
+static void bench_point_leafs_scalar(Bsp *bsp, const vec3 *points, s32 *leafs, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    leafs[i] = point_leaf(bsp, points[i]);
+}
+static void bench_leafs(size_t size) {
+  BenchLeafTree bt = { .rng = 0xd1b54a32d192ed03ull };
+  bench_leaf_node(&bt, (vec3) { -BENCH_LEAF_EXTENT, -BENCH_LEAF_EXTENT, -BENCH_LEAF_EXTENT },
+                  (vec3) { BENCH_LEAF_EXTENT, BENCH_LEAF_EXTENT, BENCH_LEAF_EXTENT }, 0);
+  Bsp bsp = {0};
+  size_t node_count = buf_size(bt.nodes), leaf_count = buf_size(bt.leafs);
+  // bsp_close frees the lumps with free(), so move them out of the growable buffers.
+  void *copies[3] = { bt.nodes, bt.planes, bt.leafs };
+  size_t sizes[3] = { sizeof(dnode_t) * node_count, sizeof(DiskPlane) * node_count, sizeof(dleaf_t) * leaf_count };
+  for (int i = 0; i < 3; ++i) {
+    void *data = malloc(sizes[i]);
+    memcpy(data, copies[i], sizes[i]);
+    copies[i] = data;
+  }
+  buf_free(bt.nodes);
+  buf_free(bt.planes);
+  buf_free(bt.leafs);
+  bsp_set_lump(&bsp, LUMP_NODES, copies[0], node_count);
+  bsp_set_lump(&bsp, LUMP_PLANES, copies[1], node_count);
+  bsp_set_lump(&bsp, LUMP_LEAFS, copies[2], leaf_count);
+  bsp_tree_load(&bsp);
+  vec3 *points = malloc(sizeof(vec3) * size);
+  for (size_t i = 0; i < size; ++i) {
+    for (int k = 0; k < 3; ++k)
+      points[i][k] = bench_randf(&bt.rng, -BENCH_LEAF_EXTENT, BENCH_LEAF_EXTENT);
+  }
+  s32 *expected = malloc(sizeof(s32) * size);
+  s32 *leafs = malloc(sizeof(s32) * size);
+  printf("leafs: %zu points, %zu nodes, %zu leafs\n", size, node_count, leaf_count);
+  printf("%12s %8s %10s %14s %10s\n", "descent", "threads", "ms", "Mpoints/s", "matches");
+  double t0 = time_seconds();
+  bench_point_leafs_scalar(&bsp, points, expected, size);
+  double t = time_seconds() - t0;
+  printf("%12s %8d %10.3f %14.2f %10zu\n", "scalar", 1, t * 1000.0, size / t / 1e6, size);
+  size_t threads[] = { 1, 0 };
+  for (int i = 0; i < 2; ++i) {
+    bsp.threads = threads[i];
+    memset(leafs, 0xff, sizeof(s32) * size);
+    t0 = time_seconds();
+    point_leafs(&bsp, points, leafs, size);
+    t = time_seconds() - t0;
+    size_t matches = 0;
+    for (size_t j = 0; j < size; ++j)
+      matches += leafs[j] == expected[j];
+    printf("%12s %8zu %10.3f %14.2f %10zu\n", "lanes", i ? cpu_count() : 1, t * 1000.0, size / t / 1e6, matches);
+  }
+  // 64 unit boxes, which should each touch a handful of leafs including the one at their center.
+  size_t box_count = size / 16, total = 0, found = 0;
+  t0 = time_seconds();
+  for (size_t i = 0; i < box_count; ++i) {
+    s32 hits[256];
+    vec3 mins, maxs;
+    for (int k = 0; k < 3; ++k) {
+      mins[k] = points[i][k] - 32.f;
+      maxs[k] = points[i][k] + 32.f;
+    }
+    size_t n = box_leafs(&bsp, mins, maxs, hits, 256);
+    total += n;
+    for (size_t j = 0; j < n && j < 256; ++j) {
+      if (hits[j] == expected[i]) {
+        ++found;
+        break;
+      }
+    }
+  }
+  t = time_seconds() - t0;
+  printf("box_leafs: %zu boxes in %.3f ms, %.2f leafs per box, center leaf found in %zu\n", box_count, t * 1000.0,
+         (double)total / box_count, found);
+  free(points);
+  free(expected);
+  free(leafs);
+  bsp_close(&bsp);
+}
+// Clusters on a line, each seeing its neighbours within a random radius, so rows are dense near the
+// diagonal like real maps.
+static void bench_pvs(size_t size) {
+  u64 rng = 0x8f1bbcdcca62c1d6ull;
+  size_t row_bytes = (size + 7) / 8;
+  u8 *vis = calloc(1, 8 + size * row_bytes);
+  s32 header[2] = { size, row_bytes };
+  memcpy(vis, header, sizeof(header));
+  for (size_t i = 0; i < size; ++i) {
+    u8 *row = vis + 8 + i * row_bytes;
+    size_t radius = 16 + bench_rand(&rng) % (size / 8 + 1);
+    for (size_t j = i > radius ? i - radius : 0; j < size && j <= i + radius; ++j) {
+      if (bench_rand(&rng) % 4)
+        row[j / 8] |= 1 << (j % 8);
+    }
+  }
+  Bsp bsp = {0};
+  bsp_set_lump(&bsp, LUMP_VISIBILITY, vis, 8 + size * row_bytes);
+  pvs_load(&bsp);
+  Pvs *pvs = &bsp.pvs;
+  u64 *scratch = bsp_alloc(&bsp, sizeof(u64) * pvs->row_words + 64);
+  scratch = (u64*)(((uintptr_t)scratch + 63) & ~(uintptr_t)63);
+  struct {
+    const char *name;
+    PvsKernels k;
+  } kernels[] = {
+    { "scalar", { pvs_rows_and_scalar, pvs_rows_or_scalar, pvs_popcount_scalar } },
+#ifdef BSP_X86
+    { "sse", { pvs_rows_and_sse, pvs_rows_or_sse, pvs_popcount_scalar } },
+    { "avx2", { pvs_rows_and_avx2, pvs_rows_or_avx2, pvs_popcount_avx2 } },
+#endif
+  };
+  printf("pvs: %zu clusters, %zu byte rows\n", size, pvs->row_words * 8);
+  printf("%8s %12s %12s %12s %14s\n", "kernel", "popcount ms", "and ms", "or ms", "checksum");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+#ifdef BSP_X86
+    if (kernels[k].k.popcount == pvs_popcount_avx2 && !cpu_has_avx2()) {
+      printf("%8s %12s\n", kernels[k].name, "-");
+      continue;
+    }
+#endif
+    PvsKernels *kn = &kernels[k].k;
+    u64 checksum = 0;
+    double t0 = time_seconds();
+    for (size_t i = 0; i < size; ++i)
+      checksum += kn->popcount(pvs_row(&bsp, i), pvs->row_words);
+    double popcount = time_seconds() - t0;
+    // Every cluster against its successor: the clusters both see, and the clusters either sees.
+    t0 = time_seconds();
+    for (size_t i = 0; i + 1 < size; ++i) {
+      kn->rows_and(scratch, pvs_row(&bsp, i), pvs_row(&bsp, i + 1), pvs->row_words);
+      checksum += scratch[i / PVS_WORD_BITS];
+    }
+    double and_time = time_seconds() - t0;
+    memset(scratch, 0, sizeof(u64) * pvs->row_words);
+    t0 = time_seconds();
+    for (size_t i = 0; i < size; ++i)
+      kn->rows_or(scratch, scratch, pvs_row(&bsp, i), pvs->row_words);
+    double or_time = time_seconds() - t0;
+    checksum += kn->popcount(scratch, pvs->row_words);
+    printf("%8s %12.3f %12.3f %12.3f %14llu\n", kernels[k].name, popcount * 1000.0, and_time * 1000.0, or_time * 1000.0,
+           (unsigned long long)checksum);
+  }
+  // The queries on top of the dispatched kernels, every cluster against its successor, then every
+  // cluster counted, and listed through a leaf of its own. Counted and listed must agree.
+  dleaf_t *leafs = calloc(size, sizeof(dleaf_t));
+  for (size_t i = 0; i < size; ++i)
+    leafs[i].cluster = i;
+  bsp_set_lump(&bsp, LUMP_LEAFS, leafs, size);
+  size_t both = 0, either = 0, next = 0, counted = 0, listed = 0;
+  double t0 = time_seconds();
+  for (size_t i = 0; i + 1 < size; ++i) {
+    both += pvs_rows_and(&bsp, i, i + 1, scratch);
+    either += pvs_rows_or(&bsp, i, i + 1, scratch);
+    next += pvs_cluster_visible(&bsp, i, i + 1);
+  }
+  for (size_t i = 0; i < size; ++i) {
+    counted += pvs_cluster_count(&bsp, i);
+    listed += pvs_leaf_clusters(&bsp, i, NULL, 0);
+  }
+  printf("queries: %.3f ms, %zu visible from both, %zu from either, %zu see the next, %zu counted, %zu listed\n",
+         (time_seconds() - t0) * 1000.0, both, either, next, counted, listed);
+  bsp_close(&bsp);
+}
+// Soups of 8x8 vertex grids, about a hundred triangles each, spread over 64 materials and 8 lightmaps.
+// Shuffled, the triangles of each soup come in random order, which is roughly what the compiler emits.
+#define BENCH_MESH_GRID 8
+static void bench_mesh_lumps(Bsp *bsp, size_t size, bool shuffle) {
+  u64 rng = 0xa54ff53a5f1d36f1ull;
+  size_t tris_per_soup = (BENCH_MESH_GRID - 1) * (BENCH_MESH_GRID - 1) * 2;
+  size_t soup_count = (size + tris_per_soup - 1) / tris_per_soup;
+  size_t verts_per_soup = BENCH_MESH_GRID * BENCH_MESH_GRID;
+  size_t material_count = 64;
+  dmaterial_t *materials = calloc(material_count, sizeof(dmaterial_t));
+  for (size_t i = 0; i < material_count; ++i)
+    snprintf(materials[i].material, sizeof(materials[i].material), "bench/material_%zu", i);
+  DiskTriangleSoup *soups = calloc(soup_count, sizeof(DiskTriangleSoup));
+  DiskGfxVertex *verts = calloc(soup_count * verts_per_soup, sizeof(DiskGfxVertex));
+  u16 *indices = malloc(sizeof(u16) * soup_count * tris_per_soup * 3);
+  for (size_t i = 0; i < soup_count; ++i) {
+    DiskTriangleSoup *s = &soups[i];
+    s->materialIndex = bench_rand(&rng) % material_count;
+    s->lightmapIndex = bench_rand(&rng) % 8;
+    s->firstVertex = i * verts_per_soup;
+    s->vertexCount = verts_per_soup;
+    s->firstIndex = i * tris_per_soup * 3;
+    s->indexCount = tris_per_soup * 3;
+    vec3 origin = { bench_randf(&rng, 0.f, 8192.f), bench_randf(&rng, 0.f, 8192.f), bench_randf(&rng, 0.f, 1024.f) };
+    for (size_t y = 0; y < BENCH_MESH_GRID; ++y) {
+      for (size_t x = 0; x < BENCH_MESH_GRID; ++x) {
+        DiskGfxVertex *v = &verts[s->firstVertex + y * BENCH_MESH_GRID + x];
+        v->xyz[0] = origin[0] + x * 16.f;
+        v->xyz[1] = origin[1] + y * 16.f;
+        v->xyz[2] = origin[2] + bench_randf(&rng, 0.f, 8.f);
+        v->normal[2] = 1.f;
+        v->color = 0xffffffff;
+        v->texCoord[0] = x / 4.f;
+        v->texCoord[1] = y / 4.f;
+        v->lmapCoord[0] = bench_randf(&rng, 0.f, 1.f);
+        v->lmapCoord[1] = bench_randf(&rng, 0.f, 1.f);
+      }
+    }
+    u16 *ix = &indices[s->firstIndex];
+    for (size_t y = 0; y + 1 < BENCH_MESH_GRID; ++y) {
+      for (size_t x = 0; x + 1 < BENCH_MESH_GRID; ++x) {
+        u16 a = y * BENCH_MESH_GRID + x, b = a + 1, c = a + BENCH_MESH_GRID, d = c + 1;
+        u16 quad[6] = { a, b, d, a, d, c };
+        memcpy(ix, quad, sizeof(quad));
+        ix += 6;
+      }
+    }
+    for (size_t t = tris_per_soup - 1; shuffle && t > 0; --t) {
+      size_t j = bench_rand(&rng) % (t + 1);
+      u16 tmp[3];
+      u16 *a = &indices[s->firstIndex + t * 3], *c = &indices[s->firstIndex + j * 3];
+      memcpy(tmp, a, sizeof(tmp));
+      memcpy(a, c, sizeof(tmp));
+      memcpy(c, tmp, sizeof(tmp));
+    }
+  }
+  bsp_set_lump(bsp, LUMP_MATERIALS, materials, material_count);
+  bsp_set_lump(bsp, LUMP_TRIANGLES, soups, soup_count);
+  bsp_set_lump(bsp, LUMP_DRAWVERTS, verts, soup_count * verts_per_soup);
+  bsp_set_lump(bsp, LUMP_DRAWINDICES, indices, soup_count * tris_per_soup * 3);
+  printf("mesh: %zu soups, %zu triangles, %zu vertices\n", soup_count, soup_count * tris_per_soup,
+         soup_count * verts_per_soup);
+}
+// Both export formats written to the null device.
+static void bench_mesh(size_t size) {
+  Bsp bsp = {0};
+  bench_mesh_lumps(&bsp, size, false);
+  for (int obj = 0; obj < 2; ++obj) {
+    FILE *fp = fopen(NULL_DEVICE, "wb");
+    Writer w = { .fp = fp };
+    double t0 = time_seconds();
+    RenderMesh m;
+    render_mesh_load(&bsp, &m);
+    if (obj)
+      write_obj(&m, &w);
+    else
+      write_glb(&m, &w);
+    writer_flush(&w);
+    double elapsed = time_seconds() - t0;
+    printf("%4s: %.3f ms\n", obj ? "obj" : "glb", elapsed * 1000.0);
+    render_mesh_free(&m);
+    writer_free(&w);
+    if (fp)
+      fclose(fp);
+  }
+  bsp_close(&bsp);
+}
+// Merging, Tipsify and meshlets over shuffled soups, on every core.
+static void bench_meshopt(size_t size) {
+  Bsp bsp = { .threads = cpu_count() };
+  bench_mesh_lumps(&bsp, size, true);
+  RenderMesh m;
+  DrawBatches draws;
+  render_mesh_load(&bsp, &m);
+  optimize_mesh(&bsp, stdout, &m, &draws, true);
+  draw_batches_free(&draws);
+  render_mesh_free(&m);
+  bsp_close(&bsp);
+}
+// Builds the BVH over the shuffled soup benchmark mesh on one thread and on every core, then casts
+// camera rays (packets cover 4x2 pixel tiles) and random rays one at a time and as packets.
+#define BENCH_BVH_RAYS 1000000
+#define BENCH_BVH_IMAGE 256
+static size_t bench_bvh_mismatches(const RenderHit *a, const RenderHit *b, size_t count) {
+  size_t mismatches = 0;
+  for (size_t i = 0; i < count; ++i)
+    mismatches += a[i].triangle != b[i].triangle && fabsf(a[i].t - b[i].t) > 1e-3f * fmaxf(1.f, a[i].t);
+  return mismatches;
+}
+static void bench_bvh(size_t size) {
+  u64 rng = 0x510e527fade682d1ull;
+  Bsp bsp = {0};
+  bench_mesh_lumps(&bsp, size, true);
+  double build[2];
+  for (int pass = 0; pass < 2; ++pass) {
+    buf_free(bsp.bvh.nodes);
+    free(bsp.bvh.tris);
+    bsp.bvh = (RenderBvh) {0};
+    bsp.threads = pass ? cpu_count() : 1;
+    double t0 = time_seconds();
+    render_bvh_load(&bsp);
+    build[pass] = time_seconds() - t0;
+  }
+  size_t leafs = 0;
+  for (size_t i = 0; i < buf_size(bsp.bvh.nodes); ++i)
+    leafs += bsp.bvh.nodes[i].count != 0;
+  printf("bvh: %zu nodes, %zu leafs, %.1f triangles per leaf, built in %.3f ms (1 thread), %.3f ms (%zu threads)\n",
+         buf_size(bsp.bvh.nodes), leafs, (double)bsp.bvh.tri_count / leafs, build[0] * 1000.0, build[1] * 1000.0,
+         cpu_count());
+  RenderRay *rays = malloc(sizeof(RenderRay) * BENCH_BVH_RAYS);
+  RenderHit *single = malloc(sizeof(RenderHit) * BENCH_BVH_RAYS);
+  RenderHit *packet = malloc(sizeof(RenderHit) * BENCH_BVH_RAYS);
+  printf("%10s %12s %12s %12s %12s %10s\n", "rays", "hit", "single ms", "packet ms", "stream ms", "mismatches");
+  for (int coherent = 1; coherent >= 0; --coherent) {
+    for (size_t i = 0; i < BENCH_BVH_RAYS;) {
+      if (!coherent) {
+        RenderRay *r = &rays[i++];
+        vec3 o = { bench_randf(&rng, 0.f, 8192.f), bench_randf(&rng, 0.f, 8192.f), bench_randf(&rng, 0.f, 1536.f) };
+        vec3 d = { bench_randf(&rng, -1.f, 1.f), bench_randf(&rng, -1.f, 1.f), bench_randf(&rng, -1.f, 1.f) };
+        *r = (RenderRay) { { o[0], o[1], o[2] }, { d[0], d[1], d[2] }, 16384.f };
+        continue;
+      }
+      // A camera above the map looking down at a random angle, its image in 4x2 pixel tiles.
+      vec3 eye = { bench_randf(&rng, 0.f, 8192.f), bench_randf(&rng, 0.f, 8192.f), bench_randf(&rng, 1200.f, 2000.f) };
+      float yaw = bench_randf(&rng, 0.f, 6.2831853f), pitch = bench_randf(&rng, 0.3f, 1.2f);
+      vec3 fw = { cosf(yaw) * cosf(pitch), sinf(yaw) * cosf(pitch), -sinf(pitch) };
+      vec3 right = { sinf(yaw), -cosf(yaw), 0.f }, up;
+      vec3_mul_cross(up, right, fw);
+      for (size_t ty = 0; ty < BENCH_BVH_IMAGE; ty += 2) {
+        for (size_t tx = 0; tx < BENCH_BVH_IMAGE; tx += 4) {
+          for (size_t p = 0; p < 8 && i < BENCH_BVH_RAYS; ++p) {
+            float sx = ((tx + p % 4) + 0.5f) / BENCH_BVH_IMAGE * 2.f - 1.f;
+            float sy = ((ty + p / 4) + 0.5f) / BENCH_BVH_IMAGE * 2.f - 1.f;
+            RenderRay *r = &rays[i++];
+            vec3_dup(r->origin, eye);
+            for (int k = 0; k < 3; ++k)
+              r->dir[k] = fw[k] + right[k] * sx + up[k] * sy;
+            r->tmax = 16384.f;
+          }
+        }
+      }
+    }
+    double t0 = time_seconds();
+    for (size_t i = 0; i < BENCH_BVH_RAYS; ++i)
+      render_ray_cast(&bsp.bvh, &rays[i], &single[i]);
+    double single_time = time_seconds() - t0;
+    t0 = time_seconds();
+    for (size_t i = 0; i < BENCH_BVH_RAYS; i += RAY_PACKET_SIZE)
+      render_ray_cast_packet(&bsp.bvh, &rays[i], RAY_PACKET_SIZE, &packet[i]);
+    double packet_time = time_seconds() - t0;
+    size_t mismatches = bench_bvh_mismatches(single, packet, BENCH_BVH_RAYS);
+    t0 = time_seconds();
+    render_ray_cast_batch(&bsp, rays, packet, BENCH_BVH_RAYS);
+    double stream_time = time_seconds() - t0;
+    mismatches += bench_bvh_mismatches(single, packet, BENCH_BVH_RAYS);
+    size_t hits = 0;
+    for (size_t i = 0; i < BENCH_BVH_RAYS; ++i)
+      hits += single[i].triangle >= 0;
+    printf("%10s %12zu %12.3f %12.3f %12.3f %10zu\n", coherent ? "camera" : "random", hits, single_time * 1000.0,
+           packet_time * 1000.0, stream_time * 1000.0, mismatches);
+  }
+  free(rays);
+  free(single);
+  free(packet);
+  bsp_close(&bsp);
+}
+// Random lightmap pages, converted by every kernel and checked against the scalar one, then written
+// out as PNGs to the null device to show what the encoder costs next to the conversion.
+static void bench_lightmaps(size_t size) {
+  u64 rng = 0x3c6ef372fe94f82bull;
+  DiskGfxLightmap *pages = malloc(sizeof(DiskGfxLightmap) * size);
+  for (size_t i = 0; i < sizeof(DiskGfxLightmap) * size / 8; ++i)
+    ((u64*)pages)[i] = bench_rand(&rng);
+  RGBA *expected = malloc(sizeof(RGBA) * LIGHTMAP_TEXELS * LIGHTMAP_TILES);
+  RGBA *color = malloc(sizeof(RGBA) * LIGHTMAP_TEXELS * LIGHTMAP_TILES);
+  struct {
+    const char *name;
+    LightmapInterleave fn;
+  } kernels[] = {
+    { "scalar", lightmap_interleave_scalar },
+#ifdef BSP_X86
+    { "sse", lightmap_interleave_sse },
+    { "avx2", lightmap_interleave_avx2 },
+#endif
+  };
+  printf("lightmaps: %zu pages, %.1f MB\n", size, sizeof(DiskGfxLightmap) * size / (1024.0 * 1024.0));
+  printf("%8s %12s %12s %12s\n", "kernel", "ms", "MB/s", "mismatches");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+#ifdef BSP_X86
+    if (kernels[k].fn == lightmap_interleave_avx2 && !cpu_has_avx2()) {
+      printf("%8s %12s\n", kernels[k].name, "-");
+      continue;
+    }
+#endif
+    size_t mismatches = 0;
+    double elapsed = 0.0;
+    for (size_t i = 0; i < size; ++i) {
+      double t0 = time_seconds();
+      kernels[k].fn(&pages[i], color);
+      elapsed += time_seconds() - t0;
+      lightmap_interleave_scalar(&pages[i], expected);
+      mismatches += memcmp(color, expected, sizeof(RGBA) * LIGHTMAP_TEXELS * LIGHTMAP_TILES) != 0;
+    }
+    printf("%8s %12.3f %12.1f %12zu\n", kernels[k].name, elapsed * 1000.0,
+           sizeof(DiskGfxLightmap) * size / (1024.0 * 1024.0) / elapsed, mismatches);
+  }
+  Writer w = { .fp = fopen(NULL_DEVICE, "wb") };
+  double t0 = time_seconds();
+  for (size_t i = 0; i < size; ++i) {
+    lightmap_interleave_kernel()(&pages[i], color);
+    write_png(&w, (u8*)color, LIGHTMAP_SIZE, LIGHTMAP_SIZE * LIGHTMAP_TILES, 4);
+    write_png(&w, pages[i].shadowMap, SHADOWMAP_SIZE, SHADOWMAP_SIZE, 1);
+  }
+  writer_free(&w);
+  printf("png: %.3f ms\n", (time_seconds() - t0) * 1000.0);
+  if (w.fp)
+    fclose(w.fp);
+  free(pages);
+  free(expected);
+  free(color);
+}
+// A grid of rooms joined by doorways, with about a third of the walls closed, and four cull groups
+// per room. The camera follows a looping path through it at eye height, looking where it's going.
+#define BENCH_VIS_GRID 32
+#define BENCH_VIS_ROOM 512.f
+static void bench_vis_portal(DiskGfxPortal **portals, DiskGfxPortalVertex **vertices, DiskPlane **planes, s32 to, int axis,
+                      float wall, float center) {
+  DiskGfxPortal portal = { .planeIndex = buf_size(*planes), .cellIndex = to,
+                           .firstPortalVertex = buf_size(*vertices), .portalVertexCount = 4 };
+  DiskPlane plane = {0};
+  plane.normal[axis] = 1.f;
+  plane.dist = wall;
+  buf_push(*planes, plane);
+  float corners[4][2] = { { -64.f, 0.f }, { 64.f, 0.f }, { 64.f, 192.f }, { -64.f, 192.f } };
+  for (int i = 0; i < 4; ++i) {
+    DiskGfxPortalVertex v;
+    v.xyz[axis] = wall;
+    v.xyz[axis ^ 1] = center + corners[i][0];
+    v.xyz[2] = corners[i][1];
+    buf_push(*vertices, v);
+  }
+  buf_push(*portals, portal);
+}
+static void bench_vis(size_t size) {
+  u64 rng = 0xa0761d6478bd642full;
+  size_t cell_count = BENCH_VIS_GRID * BENCH_VIS_GRID;
+  DiskGfxCell *cells = calloc(cell_count, sizeof(DiskGfxCell));
+  DiskGfxCullGroup *cullgroups = calloc(cell_count * 4, sizeof(DiskGfxCullGroup));
+  DiskGfxPortal *portals = NULL;
+  DiskGfxPortalVertex *vertices = NULL;
+  DiskPlane *planes = NULL;
+  // open[cell][0] is the wall towards +x, open[cell][1] the one towards +y.
+  bool (*open)[2] = calloc(cell_count, sizeof(*open));
+  for (size_t i = 0; i < cell_count; ++i) {
+    open[i][0] = bench_rand(&rng) % 3 != 0;
+    open[i][1] = bench_rand(&rng) % 3 != 0;
+  }
+  for (size_t y = 0; y < BENCH_VIS_GRID; ++y) {
+    for (size_t x = 0; x < BENCH_VIS_GRID; ++x) {
+      size_t i = y * BENCH_VIS_GRID + x;
+      DiskGfxCell *cell = &cells[i];
+      vec3 mins = { x * BENCH_VIS_ROOM, y * BENCH_VIS_ROOM, 0.f };
+      vec3 maxs = { mins[0] + BENCH_VIS_ROOM, mins[1] + BENCH_VIS_ROOM, 256.f };
+      vec3_dup(cell->mins, mins);
+      vec3_dup(cell->maxs, maxs);
+      float cx = mins[0] + BENCH_VIS_ROOM * 0.5f, cy = mins[1] + BENCH_VIS_ROOM * 0.5f;
+      cell->firstPortal = buf_size(portals);
+      if (x + 1 < BENCH_VIS_GRID && open[i][0])
+        bench_vis_portal(&portals, &vertices, &planes, i + 1, 0, maxs[0], cy);
+      if (x > 0 && open[i - 1][0])
+        bench_vis_portal(&portals, &vertices, &planes, i - 1, 0, mins[0], cy);
+      if (y + 1 < BENCH_VIS_GRID && open[i][1])
+        bench_vis_portal(&portals, &vertices, &planes, i + BENCH_VIS_GRID, 1, maxs[1], cx);
+      if (y > 0 && open[i - BENCH_VIS_GRID][1])
+        bench_vis_portal(&portals, &vertices, &planes, i - BENCH_VIS_GRID, 1, mins[1], cx);
+      cell->portalCount = buf_size(portals) - cell->firstPortal;
+      cell->firstCullGroup = i * 4;
+      cell->cullGroupCount = 4;
+      for (int q = 0; q < 4; ++q) {
+        DiskGfxCullGroup *cg = &cullgroups[i * 4 + q];
+        cg->mins[0] = (q & 1) ? cx : mins[0];
+        cg->mins[1] = (q & 2) ? cy : mins[1];
+        cg->maxs[0] = cg->mins[0] + BENCH_VIS_ROOM * 0.5f;
+        cg->maxs[1] = cg->mins[1] + BENCH_VIS_ROOM * 0.5f;
+        cg->maxs[2] = 256.f;
+      }
+    }
+  }
+  free(open);
+  Bsp bsp = {0};
+  // bsp_close frees lumps with free(), so hand it plain copies of the growable buffers.
+  void *lumps[3] = { portals, vertices, planes };
+  size_t counts[3] = { buf_size(portals), buf_size(vertices), buf_size(planes) };
+  size_t sizes[3] = { sizeof(DiskGfxPortal), sizeof(DiskGfxPortalVertex), sizeof(DiskPlane) };
+  for (int i = 0; i < 3; ++i) {
+    void *copy = malloc(sizes[i] * counts[i] + 1);
+    memcpy(copy, lumps[i], sizes[i] * counts[i]);
+    lumps[i] = copy;
+  }
+  buf_free(portals);
+  buf_free(vertices);
+  buf_free(planes);
+  bsp_set_lump(&bsp, LUMP_CELLS, cells, cell_count);
+  bsp_set_lump(&bsp, LUMP_CULLGROUPS, cullgroups, cell_count * 4);
+  bsp_set_lump(&bsp, LUMP_PORTALS, lumps[0], counts[0]);
+  bsp_set_lump(&bsp, LUMP_PORTALVERTS, lumps[1], counts[1]);
+  bsp_set_lump(&bsp, LUMP_PLANES, lumps[2], counts[2]);
+  bsp_set_lump(&bsp, LUMP_NODES, NULL, 0);
+  VisContext *ctx = malloc(sizeof(VisContext));
+  vis_context_init(ctx, &bsp);
+  float extent = BENCH_VIS_GRID * BENCH_VIS_ROOM;
+  size_t total_cells = 0, total_cullgroups = 0, max_cells = 0;
+  double t0 = time_seconds();
+  for (size_t i = 0; i < size; ++i) {
+    float t = (float)i / size * 6.2831853f;
+    vec3 origin = { extent * (0.5f + 0.45f * sinf(3.f * t)), extent * (0.5f + 0.45f * sinf(2.f * t)), 64.f };
+    float yaw = atan2f(0.45f * 2.f * cosf(2.f * t), 0.45f * 3.f * cosf(3.f * t)) * 180.f / 3.14159265f;
+    VisFrustum frustum;
+    vis_frustum_from_camera(&frustum, origin, 0.f, yaw, 90.f, 73.74f);
+    size_t n = vis_query(ctx, origin, &frustum);
+    total_cells += n;
+    total_cullgroups += ctx->cullgroup_count;
+    max_cells = n > max_cells ? n : max_cells;
+  }
+  double elapsed = time_seconds() - t0;
+  printf("vis: %zu queries along a camera path through %zu cells and %zu portals\n", size, cell_count, counts[0]);
+  printf("%.3f ms, %.0f queries/s, %.2f cells (max %zu) and %.2f cull groups visible per query\n", elapsed * 1000.0,
+         size / elapsed, (double)total_cells / size, max_cells, (double)total_cullgroups / size);
+  vis_context_free(ctx);
+  free(ctx);
+  bsp_close(&bsp);
+}
+typedef struct {
+  const char *name;
+  void (*run)(size_t size);
+  size_t default_size;
+} Benchmark;
+static Benchmark benchmarks[] = {
+  { "patches", bench_patches, 500000 },
+  { "planes", bench_planes, 20000000 },
+  { "cache", bench_cache, 200000 },
+  { "hash", bench_hash, 1024 },
+  { "export", bench_export, 20000 },
+  { "trace", bench_trace, 1000000 },
+  { "leafs", bench_leafs, 10000000 },
+  { "pvs", bench_pvs, 16384 },
+  { "vis", bench_vis, 100000 },
+  { "lightmaps", bench_lightmaps, 16 },
+  { "mesh", bench_mesh, 2000000 },
+  { "meshopt", bench_meshopt, 2000000 },
+  { "bvh", bench_bvh, 1000000 },
+  { NULL }
+};
+static int generate_map(ProgramOptions *opts) {
+  SyntheticMap sm = synthetic_map_scaled(20000);
+  if (opts->generate_counts && !parse_synthetic_counts(opts->generate_counts, &sm)) {
+    fprintf(stderr, "Error: bad -generate_counts '%s'.\n", opts->generate_counts);
+    return 1;
+  }
+  if (!write_synthetic_map(opts->generate_file, &sm)) {
+    fprintf(stderr, "Error: failed to write '%s'.\n", opts->generate_file);
+    return 1;
+  }
+  printf("Wrote '%s': %zu brushes, %zu collision triangles, %zu portals, %zu entities\n", opts->generate_file,
+         sm.brushes, sm.triangles, sm.portals / 2 * 2, sm.entities);
+  return 0;
+}
+static int run_benchmark(ProgramOptions *opts) {
+  for (Benchmark *b = benchmarks; b->name; ++b) {
+    if (strcmp(b->name, opts->bench))
+      continue;
+    b->run(opts->bench_size ? opts->bench_size : b->default_size);
+    return 0;
+  }
+  fprintf(stderr, "Unknown benchmark: %s\n", opts->bench);
+  return 1;
+}